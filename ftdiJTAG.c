@@ -18,26 +18,67 @@
  */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <time.h>
 #include <errno.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <libusb-1.0/libusb.h>
 
 #if (!defined(LIBUSBX_API_VERSION) || (LIBUSBX_API_VERSION < 0x01000102))
 # error "You need to get a newer version of libusb-1.0 (16 at the very least)"
 #endif
 
-#define XVC_BUFSIZE         1024
+/* libusbx 1.0.16/17 define only LIBUSBX_API_VERSION */
+#if defined(LIBUSB_API_VERSION)
+# define USB_API_VERSION LIBUSB_API_VERSION
+#else
+# define USB_API_VERSION LIBUSBX_API_VERSION
+#endif
+
+#define XVC_BUFSIZE         262144  /* Default advertised vector size */
+#define XVC_BUFSIZE_MAX     16777216 /* Per client, up to 16 clients */
 #define FTDI_CLOCK_RATE     60000000
 #define IDSTRING_CAPACITY   100
-#define USB_BUFSIZE         512
+#define USB_BUFSIZE         4096    /* Largest FTDI channel FIFO */
+#define USB_PACKETSIZE      512     /* High-speed bulk wMaxPacketSize */
+#define USB_READ_BUFSIZE    (((USB_BUFSIZE + USB_PACKETSIZE - 3) / \
+                                    (USB_PACKETSIZE - 2)) * USB_PACKETSIZE)
+#define USB_XFER_DEPTH      4   /* Transfers kept in flight each direction */
+#define XVC_TDI_WINDOW      ((USB_XFER_DEPTH + 1) * (USB_BUFSIZE + 2))
+#define XVC_BUF_SLACK       8   /* Allow word-wide fetches at end of vector */
+#define XVC_OUTBUF_SIZE     16384
+#define XVC_CMD_MAXLEN      16  /* Longest command name plus argument */
+#define XVC_REPLY_MAXLEN    64  /* Longest reply other than TDO */
+#define XVC_BATCH_MAX       64  /* Shift commands sharing USB transfers */
+#define XVC_CLIENT_LIMIT    16  /* Simultaneous clients per device */
+#define XVC_PRIORITY_LIMIT  16  /* -P options */
+#define XVC_LISTEN_LIMIT    4   /* -a options */
+#define XVC_ACCEPT_BACKOFF  100 /* ms without accept() after it fails */
+#define XVC_MIRROR_LIMIT    8   /* -D options */
+#define USB_POLLFD_LIMIT    16
+#define FTDI_LATENCY_MIN    2   /* Milliseconds */
+#define FTDI_LATENCY_MAX    16
+#define SHOWBUF_LIMIT       40
+#define METRICS_BUCKETS     20  /* Latency histogram bounds plus +Inf */
+#define METRICS_INTERVAL    100 /* Milliseconds between snapshots */
 
 /* libusb bmRequestType */
 #define BMREQTYPE_OUT (LIBUSB_REQUEST_TYPE_VENDOR | \
@@ -81,12 +122,27 @@
                                   FTDI_MPSSE_BIT_LSB_FIRST  | \
                                   FTDI_MPSSE_BIT_BIT_MODE   | \
                                   FTDI_MPSSE_BIT_WRITE_ON_FALLING_EDGE)
+#define FTDI_MPSSE_WRITE_TDI_BYTES (FTDI_MPSSE_BIT_WRITE_DATA | \
+                                    FTDI_MPSSE_BIT_LSB_FIRST  | \
+                                    FTDI_MPSSE_BIT_WRITE_ON_FALLING_EDGE)
+#define FTDI_MPSSE_WRITE_TDI_BITS (FTDI_MPSSE_BIT_WRITE_DATA | \
+                                   FTDI_MPSSE_BIT_LSB_FIRST  | \
+                                   FTDI_MPSSE_BIT_BIT_MODE   | \
+                                   FTDI_MPSSE_BIT_WRITE_ON_FALLING_EDGE)
+#define FTDI_MPSSE_WRITE_TMS_BITS (FTDI_MPSSE_BIT_WRITE_TMS  | \
+                                   FTDI_MPSSE_BIT_LSB_FIRST  | \
+                                   FTDI_MPSSE_BIT_BIT_MODE   | \
+                                   FTDI_MPSSE_BIT_WRITE_ON_FALLING_EDGE)
 #define FTDI_SET_LOW_BYTE           0x80
+#define FTDI_READ_LOW_BYTE          0x81
 #define FTDI_ENABLE_LOOPBACK        0x84
 #define FTDI_DISABLE_LOOPBACK       0x85
 #define FTDI_SET_TCK_DIVISOR        0x86
+#define FTDI_SEND_IMMEDIATE         0x87
 #define FTDI_DISABLE_TCK_PRESCALER  0x8A
 #define FTDI_DISABLE_3_PHASE_CLOCK  0x8D
+#define FTDI_CLOCK_BITS             0x8E
+#define FTDI_CLOCK_BYTES            0x8F
 #define FTDI_ACK_BAD_COMMAND        0xFA
 
 /* FTDI I/O pin bits */
@@ -95,6 +151,107 @@
 #define FTDI_PIN_TDO    0x4
 #define FTDI_PIN_TMS    0x8
 
+/*
+ * One encoded chunk and the bookkeeping needed to decode its reply
+ */
+typedef struct usbChunk {
+    struct usbInfo        *usb;
+    struct libusb_transfer *transfer;
+    int                    writeBusy;
+    int                    txCount;
+    int                    rxBytesWanted;
+    int                    rxCount;
+    int                    rxBitcountIndex;
+    uint32_t               tdiStart;
+    uint64_t               submitTime;
+    uint64_t               writeTime;
+    unsigned short         rxBitcounts[2*USB_BUFSIZE/3];
+    unsigned char          txBuf[USB_BUFSIZE + 1]; /* + SEND_IMMEDIATE */
+    unsigned char          rxBuf[USB_BUFSIZE + XVC_BUF_SLACK];
+} usbChunk;
+
+/*
+ * Workspace for finding the cheapest commands for a chunk.
+ * Entry [bit][level] of the steps holds the fewest command bytes
+ * found for encoding up to that bit and leaving TMS at that level,
+ * along with the last commands on the way there.
+ */
+#define SCHEDULE_BITS   (8 * USB_BUFSIZE)
+#define TMS_UNKNOWN     2
+
+typedef struct scheduleStep {
+    unsigned short         cost;
+    unsigned short         nBits;
+    unsigned char          from;
+    unsigned char          isTMS;
+} scheduleStep;
+
+typedef struct schedule {
+    uint64_t               reached[(SCHEDULE_BITS / 64) + 1];
+    scheduleStep           steps[SCHEDULE_BITS + 1][TMS_UNKNOWN + 1];
+    unsigned short         path[(USB_BUFSIZE / 3) + 1];
+    unsigned char          pathLevel[(USB_BUFSIZE / 3) + 1];
+} schedule;
+
+/*
+ * Arbitration priority for clients from a given address.
+ * Unix-domain clients have no address so match on family alone.
+ */
+typedef struct clientPriority {
+    int                    family;
+    struct in_addr         address;
+    struct in6_addr        address6;
+    int                    priority;
+} clientPriority;
+
+/*
+ * Any kind of socket address the server listens on
+ */
+typedef union socketAddress {
+    struct sockaddr        sa;
+    struct sockaddr_in     in;
+    struct sockaddr_in6    in6;
+    struct sockaddr_un     un;
+} socketAddress;
+
+/*
+ * Latency histograms for each stage a shift passes through
+ */
+enum metricsStages {
+    STAGE_RECEIVE, STAGE_ENCODE, STAGE_USB_WRITE, STAGE_USB_READ,
+    STAGE_DECODE, STAGE_REPLY, STAGE_COUNT
+};
+
+typedef struct stageHistogram {
+    uint64_t               counts[METRICS_BUCKETS];
+    uint64_t               sum;
+    uint64_t               count;
+} stageHistogram;
+
+/*
+ * Cumulative counters for one device.  The device thread updates its
+ * own copy and publishes a snapshot for the metrics server to show.
+ */
+typedef struct deviceMetrics {
+    stageHistogram         stages[STAGE_COUNT];
+    uint64_t               shifts;
+    uint64_t               bits;
+    uint64_t               busyTime;
+    double                 tckCapacity;
+    uint64_t               chunks;
+    uint64_t               runts;
+    int                    clients;
+    unsigned int           frequency;
+    char                   serial[IDSTRING_CAPACITY];
+} deviceMetrics;
+
+typedef struct metricsSlot {
+    struct metricsSlot    *next;
+    pthread_mutex_t        lock;
+    int                    port;
+    deviceMetrics          shown;
+} metricsSlot;
+
 typedef struct usbInfo {
     /*
      * Diagnostics
@@ -105,18 +262,27 @@ typedef struct usbInfo {
     int                    showUSB;
     int                    showXVC;
     unsigned int           lockedSpeed;
+    unsigned int           tunedSpeed;
+    int                    traceFd;
+    uint64_t               traceStart;
+    uint64_t               traceEnd;
 
     /*
      * Statistics
      */
     int                    statisticsFlag;
+    uint64_t               runtCount;
     int                    largestShiftRequest;
     int                    largestWriteRequest;
     int                    largestWriteSent;
     int                    largestReadRequest;
-    uint64_t               shiftCount;
     uint64_t               chunkCount;
-    uint64_t               bitCount;
+    int                    metricsFlag;
+    int                    metricsDirty;
+    uint64_t               metricsTime;
+    uint64_t               busyStart;
+    deviceMetrics          metrics;
+    metricsSlot           *metricsSlot;
 
     /*
      * Used to find matching device
@@ -124,6 +290,8 @@ typedef struct usbInfo {
     int                    vendorId;
     int                    productId;
     const char            *serialNumber;
+    int                    busNumber;      /* Non-zero when chosen from */
+    int                    deviceAddress;  /* the fleet registry        */
 
     /*
      * Matched device
@@ -138,7 +306,13 @@ typedef struct usbInfo {
      * Libusb hooks
      */
     libusb_context        *usb;
+    struct mpsseEmulator  *emulator;
+    schedule              *schedule;
+    libusb_device         *device;
     libusb_device_handle  *handle;
+    libusb_device         *arrived;
+    int                    hotplug;
+    int                    deviceLost;
     int                    bInterfaceNumber;
     int                    isConnected;
     int                    termChar;
@@ -147,32 +321,178 @@ typedef struct usbInfo {
     int                    bulkOutRequestSize;
     int                    bulkInEndpointAddress;
     int                    bulkInRequestSize;
+    int                    bulkInPacketSize;
+    int                    bulkInPayloadSize;
+
+    /*
+     * Asynchronous transfers.
+     * Chunks are retired in the order they were submitted.
+     * Bulk-IN transfers return a TDO byte stream which is handed
+     * out to the chunks in that same order.
+     */
+    usbChunk               chunks[USB_XFER_DEPTH];
+    unsigned int           chunksSubmitted;
+    unsigned int           chunksReceived;
+    unsigned int           chunksRetired;
+    struct libusb_transfer *readTransfers[USB_XFER_DEPTH];
+    int                    readBusy[USB_XFER_DEPTH];
+    int                    readPayload[USB_XFER_DEPTH];
+    int                    readsInFlight;
+    int                    readCapacity;
+    int                    draining;
+    int                    rxOutstanding;
+    uint64_t               readTimes[USB_XFER_DEPTH];
+    unsigned char          readBufs[USB_XFER_DEPTH][USB_READ_BUFSIZE];
 
     /*
      * FTDI info
      */
     int                    ftdiJTAGindex;
     const char            *gpioArgument;
+    unsigned int           currentFrequency;
+    unsigned int           actualFrequency;
+    int                    keepOpen;
+    int                    latencyTimer;
+    int                    raiseLatency;
+    uint64_t               runtMark;
+    int                    resyncNeeded;
+    int                    sessionEnded;
+
+    /*
+     * Broadcast
+     * Boards driven in step with this device.  Each has a usbInfo
+     * of its own that shares this device's libusb context.
+     */
+    struct usbInfo        *mirrors[XVC_MIRROR_LIMIT];
+    int                    nMirrors;
+    int                    broadcasting;
+    int                    mirrorDiffers;
+    uint64_t               mismatchCount;
+
+    /*
+     * Client arbitration
+     * Clients wait in order of priority then arrival.  The owner
+     * keeps the device while the TAP is anywhere but Test-Logic-Reset
+     * or Run-Test/Idle so that no one else can break into a scan.
+     */
+    struct clientInfo     *clients[XVC_CLIENT_LIMIT];
+    int                    clientCount;
+    int                    sessionCount;
+    uint64_t               acceptResume;   /* No accept() until then */
+    int                    acceptFailing;
+    struct clientInfo     *owner;
+    struct clientInfo     *waitHead;
+    int                    tapState;
+    int                    tmsLevel;       /* Where commands left TMS pin */
+    const clientPriority  *priorities;
+    int                    nPriorities;
 
     /*
      * I/O buffers
+     * TMS and TDI are encoded straight from the client input buffer.
+     * TDO passes through a window sized by the USB transfers
+     * allowing for the padding at the end of each batched reply.
      */
-    unsigned char          tmsBuf[XVC_BUFSIZE];
-    unsigned char          tdiBuf[XVC_BUFSIZE];
-    unsigned char          tdoBuf[XVC_BUFSIZE];
-    int                    txCount;
+    uint32_t               xvcBufsize;
+    int                    listenPort;
+    unsigned char          tdoBuf[2*USB_BUFSIZE + 1 + XVC_BUF_SLACK];
+    unsigned char          tdoPreview[SHOWBUF_LIMIT];
     unsigned char          ioBuf[USB_BUFSIZE];
-    unsigned char          rxBuf[USB_BUFSIZE];
-    unsigned char          cmdBuf[USB_BUFSIZE];
 } usbInfo;
 
+/*
+ * Client connection
+ * Commands are parsed in place in the input buffer.  The XVC protocol
+ * sends the entire TMS vector ahead of the TDI vector so there is room
+ * for a full TMS vector followed by a window onto the TDI vector.
+ * Consecutive shift commands already in the input buffer are batched.
+ * Replies are gathered in the output buffer and sent as the socket
+ * accepts them.
+ */
+typedef struct xvcShift {
+    uint32_t               nBits;
+    uint32_t               tmsPos;
+    uint32_t               tdiPos;
+    uint64_t               time;
+    uint64_t               traceOffset;
+} xvcShift;
+
+enum xvcOps { XVC_OP_NONE, XVC_OP_SETTCK, XVC_OP_SHIFT };
+
+typedef struct clientInfo {
+    struct usbInfo        *usb;
+    struct clientInfo     *next;
+    int                    session;
+    int                    priority;
+    int                    waiting;
+    int                    deviceOp;
+    int                    opStarted;
+    int                    dead;
+    int                    eof;
+    unsigned int           frequency;
+    uint32_t               tckPeriod;
+    uint64_t               tckTime;
+    uint64_t               shiftCount;
+    uint64_t               chunkCount;
+    uint64_t               bitCount;
+    uint64_t               runtCount;
+    int                    fd;
+    char                   name[100];
+    unsigned char         *inBuf;
+    uint32_t               inCapacity;
+    uint32_t               inPos;
+    uint32_t               inCount;
+    uint32_t               tdiBase;
+    int                    batchCount;
+    int                    sendIndex;
+    uint32_t               sendByte;
+    int                    jobIndex;
+    int                    jobStatus;
+    int                    firstChunk;
+    uint32_t               iBit;
+    int                    tdoBit;
+    xvcShift               batch[XVC_BATCH_MAX];
+    int                    outCount;
+    unsigned char          outBuf[XVC_OUTBUF_SIZE];
+} clientInfo;
+
+/*
+ * JTAG TAP controller
+ */
+enum tapStates {
+    TAP_RESET, TAP_IDLE,
+    TAP_SELECT_DR, TAP_CAPTURE_DR, TAP_SHIFT_DR, TAP_EXIT1_DR,
+    TAP_PAUSE_DR, TAP_EXIT2_DR, TAP_UPDATE_DR,
+    TAP_SELECT_IR, TAP_CAPTURE_IR, TAP_SHIFT_IR, TAP_EXIT1_IR,
+    TAP_PAUSE_IR, TAP_EXIT2_IR, TAP_UPDATE_IR, TAP_STATE_COUNT
+};
+
+static const unsigned char tapNext[TAP_STATE_COUNT][2] = {
+    [TAP_RESET]      = { TAP_IDLE,       TAP_RESET     },
+    [TAP_IDLE]       = { TAP_IDLE,       TAP_SELECT_DR },
+    [TAP_SELECT_DR]  = { TAP_CAPTURE_DR, TAP_SELECT_IR },
+    [TAP_CAPTURE_DR] = { TAP_SHIFT_DR,   TAP_EXIT1_DR  },
+    [TAP_SHIFT_DR]   = { TAP_SHIFT_DR,   TAP_EXIT1_DR  },
+    [TAP_EXIT1_DR]   = { TAP_PAUSE_DR,   TAP_UPDATE_DR },
+    [TAP_PAUSE_DR]   = { TAP_PAUSE_DR,   TAP_EXIT2_DR  },
+    [TAP_EXIT2_DR]   = { TAP_SHIFT_DR,   TAP_UPDATE_DR },
+    [TAP_UPDATE_DR]  = { TAP_IDLE,       TAP_SELECT_DR },
+    [TAP_SELECT_IR]  = { TAP_CAPTURE_IR, TAP_RESET     },
+    [TAP_CAPTURE_IR] = { TAP_SHIFT_IR,   TAP_EXIT1_IR  },
+    [TAP_SHIFT_IR]   = { TAP_SHIFT_IR,   TAP_EXIT1_IR  },
+    [TAP_EXIT1_IR]   = { TAP_PAUSE_IR,   TAP_UPDATE_IR },
+    [TAP_PAUSE_IR]   = { TAP_PAUSE_IR,   TAP_EXIT2_IR  },
+    [TAP_EXIT2_IR]   = { TAP_SHIFT_IR,   TAP_UPDATE_IR },
+    [TAP_UPDATE_IR]  = { TAP_IDLE,       TAP_SELECT_DR }
+};
+
 /************************************* MISC ***************************/
 static void
 showBuf(const char *name, const unsigned char *buf, int numBytes)
 {
     int i;
     printf("%s%4d:", name, numBytes);
-    if (numBytes > 40) numBytes = 40;
+    if (numBytes > SHOWBUF_LIMIT) numBytes = SHOWBUF_LIMIT;
     for (i = 0 ; i < numBytes ; i++) printf(" %02X", buf[i]);
     printf("\n");
 }
@@ -190,917 +510,6338 @@ badChar(void)
 }
 
 /*
- * Fetch 32 bit value from client
+ * Fetch 32 bit value from client input
  */
-static int
-fetch32(FILE *fp, uint32_t *value)
+static uint32_t
+get32(const unsigned char *p)
 {
-    int i;
-    uint32_t v;
-
-    for (i = 0, v = 0 ; i < 32 ; i += 8) {
-        int c = fgetc(fp);
-        if (c == EOF) {
-            badEOF();
-            return 0;
-        }
-        v |= c << i;
-    }
-    *value = v;
-    return 1;
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
 }
 
-/************************************* USB ***************************/
 static void
-getDeviceString(usbInfo *usb, int i, char *dest)
+put32(unsigned char *p, uint32_t value)
 {
-    ssize_t n;
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
 
-    n = libusb_get_string_descriptor_ascii(usb->handle, i,
-                                                 usb->ioBuf, sizeof usb->ioBuf);
-    if (n < 0) {
-        *dest = '\0';
-        return;
+static uint64_t
+nanoseconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/************************************* TIMELINE ***************************/
+/*
+ * Timeline of USB and XVC events in the Chrome trace event JSON
+ * format, for chrome://tracing or the Perfetto UI.  Each device is
+ * a process identified by its XVC port.  Each stage of a shift has
+ * a track of its own, as does each transfer slot so that
+ * overlapping transfers appear side by side, and each client
+ * session.  The closing bracket is rewritten after every flush so
+ * the file is complete whenever the server is idle.
+ */
+#define TIMELINE_NETWORK    1
+#define TIMELINE_HOST       2
+#define TIMELINE_USB_OUT    10  /* Plus chunk slot */
+#define TIMELINE_USB_REPLY  20  /* Plus chunk slot */
+#define TIMELINE_USB_IN     30  /* Plus bulk-IN transfer slot */
+#define TIMELINE_SESSION    100 /* Plus session number */
+
+static FILE *timeline;
+static uint64_t timelineStart;
+static uint64_t timelineFlushed;
+static int timelineCount;
+static int timelineDirty;
+static pthread_mutex_t timelineLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *stageNames[STAGE_COUNT] = {
+    [STAGE_RECEIVE]   = "receive",
+    [STAGE_ENCODE]    = "encode",
+    [STAGE_USB_WRITE] = "usb_write",
+    [STAGE_USB_READ]  = "usb_read",
+    [STAGE_DECODE]    = "decode",
+    [STAGE_REPLY]     = "reply"
+};
+
+static const int stageTracks[STAGE_COUNT] = {
+    [STAGE_RECEIVE]   = TIMELINE_NETWORK,
+    [STAGE_ENCODE]    = TIMELINE_HOST,
+    [STAGE_USB_WRITE] = TIMELINE_USB_OUT,
+    [STAGE_USB_READ]  = TIMELINE_USB_REPLY,
+    [STAGE_DECODE]    = TIMELINE_HOST,
+    [STAGE_REPLY]     = TIMELINE_NETWORK
+};
+
+/*
+ * Latency histogram bucket upper bounds, in nanoseconds
+ */
+static const uint64_t stageBounds[METRICS_BUCKETS - 1] = {
+    1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000,
+    1000000, 2000000, 5000000, 10000000, 20000000, 50000000,
+    100000000, 200000000, 500000000, 1000000000
+};
+
+static void
+timelineOpen(const char *path)
+{
+    if ((timeline = fopen(path, "w")) == NULL) {
+        fprintf(stderr, "Can't create %s: %s\n", path, strerror(errno));
+        exit(1);
     }
-    if (n >= IDSTRING_CAPACITY)
-        n = IDSTRING_CAPACITY - 1;
-    memcpy(dest, (char *)usb->ioBuf, n);
-    *(dest + n) = '\0';
+    timelineStart = nanoseconds();
 }
 
+/*
+ * Append an event.  The format and arguments give
+ * the event fields that follow the process ID.
+ */
 static void
-getDeviceStrings(usbInfo *usb, struct libusb_device_descriptor *desc)
+timelineEvent(const usbInfo *usb, const char *fmt, ...)
 {
-    getDeviceString(usb, desc->iManufacturer, usb->deviceVendorString);
-    getDeviceString(usb, desc->iProduct, usb->deviceProductString);
-    getDeviceString(usb, desc->iSerialNumber, usb->deviceSerialString);
+    va_list args;
+
+    pthread_mutex_lock(&timelineLock);
+    fprintf(timeline, "%s{\"pid\":%d,", timelineCount++ ? ",\n" : "[\n",
+                                                              usb->listenPort);
+    va_start(args, fmt);
+    vfprintf(timeline, fmt, args);
+    va_end(args);
+    fprintf(timeline, "}");
+    timelineDirty = 1;
+    pthread_mutex_unlock(&timelineLock);
 }
 
 /*
- * Get endpoints
+ * Complete event from start to now
  */
 static void
-getEndpoints(usbInfo *usb, const struct libusb_interface_descriptor *iface_desc)
+timelineSpan(const usbInfo *usb, int tid, const char *name, uint64_t start,
+                                              const char *argName, long argValue)
 {
-    int e;
+    uint64_t now = nanoseconds();
 
-    usb->bulkInEndpointAddress = 0;
-    usb->bulkOutEndpointAddress = 0;
-    for (e = 0 ; e < iface_desc->bNumEndpoints ; e++) {
-        const struct libusb_endpoint_descriptor *ep = &iface_desc->endpoint[e];
-        if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) ==
-                                                    LIBUSB_TRANSFER_TYPE_BULK) {
-            if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) ==
-                                                           LIBUSB_ENDPOINT_IN) {
-                if (usb->bulkInEndpointAddress != 0) {
-                    fprintf(stderr, "Too many input endpoints!\n");
-                    exit(10);
-                }
-                usb->bulkInEndpointAddress = ep->bEndpointAddress;
-                usb->bulkInRequestSize = ep->wMaxPacketSize;
-                if ((size_t)usb->bulkInRequestSize > sizeof usb->ioBuf) {
-                    usb->bulkInRequestSize = sizeof usb->ioBuf;
-                }
-            }
-            else {
-                if (usb->bulkOutEndpointAddress != 0) {
-                    fprintf(stderr, "Too many output endpoints!\n");
-                    exit(10);
-                }
-                usb->bulkOutEndpointAddress = ep->bEndpointAddress;
-                usb->bulkOutRequestSize = ep->wMaxPacketSize;
-                if ((size_t)usb->bulkOutRequestSize > sizeof usb->cmdBuf) {
-                    usb->bulkOutRequestSize = sizeof usb->cmdBuf;
-                }
-            }
-        }
+    if (argName) {
+        timelineEvent(usb, "\"tid\":%d,\"ph\":\"X\",\"name\":\"%s\","
+                           "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"%s\":%ld}",
+                           tid, name, (start - timelineStart) * 1e-3,
+                           (now - start) * 1e-3, argName, argValue);
     }
-    if (usb->bulkInEndpointAddress == 0) {
-        fprintf(stderr, "No input endpoint!\n");
-        exit(10);
+    else {
+        timelineEvent(usb, "\"tid\":%d,\"ph\":\"X\",\"name\":\"%s\","
+                           "\"ts\":%.3f,\"dur\":%.3f",
+                           tid, name, (start - timelineStart) * 1e-3,
+                           (now - start) * 1e-3);
     }
-    if (usb->bulkOutEndpointAddress == 0) {
-        fprintf(stderr, "No output endpoint!\n");
-        exit(10);
+}
+
+static void
+timelineInstant(const usbInfo *usb, int tid, const char *name)
+{
+    timelineEvent(usb, "\"tid\":%d,\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\","
+                       "\"ts\":%.3f", tid, name,
+                       (nanoseconds() - timelineStart) * 1e-3);
+}
+
+static void
+timelineName(const usbInfo *usb, int tid, const char *name)
+{
+    if (tid) {
+        timelineEvent(usb, "\"tid\":%d,\"ph\":\"M\",\"name\":\"thread_name\","
+                           "\"args\":{\"name\":\"%s\"}", tid, name);
+    }
+    else {
+        timelineEvent(usb, "\"ph\":\"M\",\"name\":\"process_name\","
+                           "\"args\":{\"name\":\"%s\"}", name);
     }
 }
 
 /*
- * Search the bus for a matching device
+ * Name the device and its tracks
  */
-static int
-findDevice(usbInfo *usb, libusb_device **list, int n)
+static void
+timelineTracks(const usbInfo *usb)
 {
+    char name[IDSTRING_CAPACITY + 30], *cp;
     int i;
-    for (i = 0 ; i < n ; i++) {
-        libusb_device *dev = list[i];
-        struct libusb_device_descriptor desc;
-        struct libusb_config_descriptor *config;
-        int productMatch = 0;
-        int s = libusb_get_device_descriptor(dev, &desc);
-        if (s != 0) {
-           fprintf(stderr, "libusb_get_device_descriptor failed: %s",
-                                                            libusb_strerror(s));
-            return 0;
-        }
-        if (desc.bDeviceClass != LIBUSB_CLASS_PER_INTERFACE)
-            continue;
-        if (usb->productId < 0) {
-            static const uint16_t validCodes[] = { 0x6010, /* FT2232H */
-                                                   0x6011, /* FT4232H */
-                                                   0x6014  /* FT232H  */
-                                                 };
-            int nCodes = sizeof validCodes / sizeof validCodes[0];
-            int p;
-            for (p = 0 ; p < nCodes ; p++) {
-                if (desc.idProduct == validCodes[p]) {
-                    productMatch = 1;
-                    break;
-                }
-            }
-        }
-        else if (usb->productId == desc.idProduct) {
-            productMatch = 1;
-        }
-        if ((usb->vendorId != desc.idVendor) || !productMatch) {
-            continue;
-        }
-        if ((libusb_get_active_config_descriptor(dev, &config) < 0)
-         && (libusb_get_config_descriptor(dev, 0, &config) < 0)) {
-            fprintf(stderr,
-                          "Can't get vendor %04X product %04X configuration.\n",
-                                                 desc.idVendor, desc.idProduct);
-            continue;
-        }
-        if (config == NULL) {
-            continue;
-        }
-        if (config->bNumInterfaces >= usb->ftdiJTAGindex) {
-            s = libusb_open(dev, &usb->handle);
-            if (s == 0) {
-                const struct libusb_interface *iface =
-                                       &config->interface[usb->ftdiJTAGindex-1];
-                const struct libusb_interface_descriptor *iface_desc =
-                                                          &iface->altsetting[0];
-                usb->bInterfaceNumber = iface_desc->bInterfaceNumber;
-                usb->deviceVendorId = desc.idVendor;
-                usb->deviceProductId = desc.idProduct;
-                getDeviceStrings(usb, &desc);
-                if ((usb->serialNumber == NULL)
-                 || (strcmp(usb->serialNumber,
-                            usb->deviceSerialString) == 0)) {
-                    getEndpoints(usb, iface_desc);
-                    libusb_free_config_descriptor(config);
-                    usb->productId = desc.idProduct;
-                    return 1;
-                }
-                libusb_close(usb->handle);
-            }
-            else {
-                fprintf(stderr, "libusb_open failed: %s\n",
-                                                    libusb_strerror(s));
-                exit(1);
-            }
+
+    sprintf(name, "ftdiJTAG port %d %s", usb->listenPort,
+                                                    usb->deviceSerialString);
+    for (cp = name ; *cp ; cp++) {
+        if ((*cp == '"') || (*cp == '\\') || ((unsigned char)*cp < ' ')) {
+            *cp = '_';
         }
-        libusb_free_config_descriptor(config);
     }
-    return 0;
+    timelineName(usb, 0, name);
+    timelineName(usb, TIMELINE_NETWORK, "network");
+    timelineName(usb, TIMELINE_HOST, "host");
+    for (i = 0 ; i < USB_XFER_DEPTH ; i++) {
+        sprintf(name, "bulk out %d", i);
+        timelineName(usb, TIMELINE_USB_OUT + i, name);
+        sprintf(name, "reply %d", i);
+        timelineName(usb, TIMELINE_USB_REPLY + i, name);
+        sprintf(name, "bulk in %d", i);
+        timelineName(usb, TIMELINE_USB_IN + i, name);
+    }
 }
 
-static int
-usbControl(usbInfo *usb, int bmRequestType, int bRequest, int wValue)
+/*
+ * Write out buffered events when idle or at least every second
+ */
+static void
+timelineFlush(int idle)
 {
-    int c;
-    if (usb->showUSB) {
-        printf("usbControl bmRequestType:%02X bRequest:%02X wValue:%04X\n",
-                                               bmRequestType, bRequest, wValue);
-    }
-    c = libusb_control_transfer(usb->handle, bmRequestType, bRequest, wValue,
-                                             usb->ftdiJTAGindex, NULL, 0, 1000);
-    if (c != 0) {
-        fprintf(stderr, "usb_control_transfer failed: %s\n",libusb_strerror(c));
-        exit(1);
+    uint64_t now = nanoseconds();
+
+    pthread_mutex_lock(&timelineLock);
+    if (timelineDirty && (idle || ((now - timelineFlushed) > 1000000000))) {
+        fprintf(timeline, "\n]\n");
+        fflush(timeline);
+        fseek(timeline, -3, SEEK_CUR);
+        timelineDirty = 0;
+        timelineFlushed = now;
     }
-    return 1;
+    pthread_mutex_unlock(&timelineLock);
 }
 
-static int
-usbWriteData(usbInfo *usb, unsigned char *buf, int nSend)
+/*
+ * Start timing an event.  Timing is only done when the
+ * results are wanted so callers are given 0 otherwise.
+ */
+static uint64_t
+eventClock(const usbInfo *usb)
 {
-    int nSent, s;
+    return (usb->metricsFlag || timeline || (usb->traceFd >= 0)) ?
+                                                            nanoseconds() : 0;
+}
 
-    if (usb->showUSB) {
-        showBuf("Tx", buf, nSend);
+/*
+ * Note how long a stage took.  The lane distinguishes
+ * stages that may be under way at the same time.
+ */
+static void
+stageObserve(usbInfo *usb, int stage, int lane, uint64_t start)
+{
+    stageHistogram *h = &usb->metrics.stages[stage];
+    uint64_t t;
+    int i;
+
+    if (timeline) {
+        timelineSpan(usb, stageTracks[stage] + lane, stageNames[stage], start,
+                                                                      NULL, 0);
     }
-    if (nSend > usb->largestWriteRequest) {
-        usb->largestWriteRequest = nSend;
+    if (!usb->metricsFlag) {
+        return;
     }
-    while (nSend) {
-        s = libusb_bulk_transfer(usb->handle, usb->bulkOutEndpointAddress, buf,
-                                                          nSend, &nSent, 10000);
-        if (s) {
-            fprintf(stderr, "Bulk write (%d) failed: %s\n", nSend,
-                                                            libusb_strerror(s));
-            exit(1);
-        }
-        nSend -= nSent;
-        buf += nSent;
-        if (nSent > usb->largestWriteSent) {
-            usb->largestWriteSent = nSent;
-        }
+    t = nanoseconds() - start;
+    for (i = 0 ; (i < (METRICS_BUCKETS - 1)) && (t > stageBounds[i]) ; i++) {
+        continue;
     }
-    return 1;
+    h->counts[i]++;
+    h->sum += t;
+    h->count++;
+    usb->metricsDirty = 1;
 }
 
-static int
-usbReadData(usbInfo *usb, unsigned char *buf, int nWant)
-{
-    int nWanted = nWant;
-    const unsigned char *base = buf;
+/************************************* EMULATOR ***************************/
+/*
+ * In-process stand-in for an FTDI MPSSE channel driving a chain
+ * of JTAG TAPs.  It takes the place of the device at the transfer
+ * level so the protocol, encoder and event loop can be exercised
+ * and benchmarked without JTAG hardware.
+ * Instruction codes follow Xilinx conventions: 0x09 IDCODE,
+ * 0x02 USER1, all ones BYPASS.  Anything else selects BYPASS.
+ */
+#define EMU_TAP_LIMIT       16
+#define EMU_USER_BITS       1024
+#define EMU_FIFO_SIZE       (1 << 17)
+#define EMU_CMD_MAXLEN      (3 + 65536)
+#define EMU_INSTR_IDCODE    0x09
+#define EMU_INSTR_USER1     0x02
 
-    if (nWant > usb->largestReadRequest) {
-        usb->largestReadRequest = nWant;
-        if ((nWant+2) > usb->bulkInRequestSize) {
-            fprintf(stderr, "usbReadData requested %d, limit is %d.\n",
-                                               nWant+2, usb->bulkInRequestSize);
-            exit(1);
-        }
+typedef struct emuTap {
+    int                    irLength;
+    uint32_t               idcode;
+    int                    userLength;
+    uint32_t               ir;
+    uint32_t               irShift;
+    int                    drLength;
+    int                    drPos;
+    unsigned char         *dr;      /* Shift register, used as a ring */
+    unsigned char         *user;
+} emuTap;
+
+typedef struct mpsseEmulator {
+    int                    nTaps;
+    emuTap                 taps[EMU_TAP_LIMIT];
+    int                    tapState;
+    int                    isOpen;
+    int                    mpsse;
+    int                    loopback;
+    int                    tms;
+    int                    tdi;
+    int                    cmdCount;
+    unsigned char          cmdBuf[EMU_CMD_MAXLEN];
+    int                    fifoHead;
+    int                    fifoTail;
+    unsigned char          fifo[EMU_FIFO_SIZE];
+    int                    nQueued;
+    struct libusb_transfer *queue[2 * USB_XFER_DEPTH];
+    int                    cancelled[2 * USB_XFER_DEPTH];
+} mpsseEmulator;
+
+static int
+getBit(const unsigned char *buf, int bit)
+{
+    return (buf[bit >> 3] >> (bit & 0x7)) & 0x1;
+}
+
+static void
+putBit(unsigned char *buf, int bit, int value)
+{
+    if (value) {
+        buf[bit >> 3] |= 1 << (bit & 0x7);
     }
-    while (nWant) {
-        int nRecv, s;
-        const unsigned char *src = usb->ioBuf;
-        s = libusb_bulk_transfer(usb->handle, usb->bulkInEndpointAddress,
-                                             usb->ioBuf, nWant+2, &nRecv, 5000);
-        if (s) {
-            fprintf(stderr, "Bulk read failed: %s\n", libusb_strerror(s));
+    else {
+        buf[bit >> 3] &= ~(1 << (bit & 0x7));
+    }
+}
+
+/*
+ * Chain is a comma-separated list of irLength:idcode[:userBits]
+ * TAPs in order from TDI to TDO
+ */
+static mpsseEmulator *
+emuCreate(const char *str)
+{
+    mpsseEmulator *emu = calloc(1, sizeof *emu);
+
+    if (emu == NULL) {
+        fprintf(stderr, "Can't allocate emulator.\n");
+        exit(1);
+    }
+    for (;;) {
+        emuTap *tap;
+        char *endp;
+        int drBytes;
+        if (emu->nTaps == EMU_TAP_LIMIT) {
+            fprintf(stderr, "Too many emulated TAPs.\n");
+            exit(2);
+        }
+        tap = &emu->taps[emu->nTaps++];
+        tap->irLength = strtol(str, &endp, 10);
+        if ((endp == str) || (*endp != ':')
+         || (tap->irLength < 2) || (tap->irLength > 32)) {
+            break;
+        }
+        str = endp + 1;
+        tap->idcode = strtoul(str, &endp, 16);
+        if (endp == str) {
+            break;
+        }
+        tap->userLength = EMU_USER_BITS;
+        if (*endp == ':') {
+            str = endp + 1;
+            tap->userLength = strtol(str, &endp, 10);
+            if ((endp == str) || (tap->userLength < 1)) {
+                break;
+            }
+        }
+        drBytes = ((tap->userLength > 32 ? tap->userLength : 32) + 7) / 8;
+        tap->dr = calloc(1, drBytes);
+        tap->user = calloc(1, (tap->userLength + 7) / 8);
+        if ((tap->dr == NULL) || (tap->user == NULL)) {
+            fprintf(stderr, "Can't allocate emulated TAP.\n");
             exit(1);
         }
-        if (nRecv <= 2) {
-            if (usb->runtFlag) {
-                fprintf(stderr, "wanted:%d want:%d got:%d",nWanted,nWant,nRecv);
-                if (nRecv >= 1) {
-                    fprintf(stderr, " [%02X", src[0]);
-                    if (nRecv >= 2) {
-                        fprintf(stderr, " %02X", src[1]);
-                    }
-                    fprintf(stderr, "]");
-                }
-                fprintf(stderr, "\n");
+        tap->ir = EMU_INSTR_IDCODE;
+        if (*endp == '\0') {
+            return emu;
+        }
+        if (*endp != ',') {
+            break;
+        }
+        str = endp + 1;
+    }
+    fprintf(stderr, "Bad -E irLength:idcode[:userBits][,...]\n");
+    exit(2);
+}
+
+/*
+ * TAP actions on the rising edge of TCK
+ */
+static int
+emuTapTDO(const emuTap *tap, int state)
+{
+    switch (state) {
+    case TAP_SHIFT_IR: return tap->irShift & 0x1;
+    case TAP_SHIFT_DR: return getBit(tap->dr, tap->drPos);
+    default:           return 1;
+    }
+}
+
+static void
+emuTapClock(emuTap *tap, int state, int tdi)
+{
+    uint32_t instruction = tap->ir & ((1ULL << tap->irLength) - 1);
+    int i;
+
+    switch (state) {
+    case TAP_RESET:
+        tap->ir = EMU_INSTR_IDCODE;
+        break;
+
+    case TAP_CAPTURE_IR:
+        tap->irShift = 0x1;
+        break;
+
+    case TAP_SHIFT_IR:
+        tap->irShift = (tap->irShift >> 1) |
+                                        ((uint32_t)tdi << (tap->irLength - 1));
+        break;
+
+    case TAP_CAPTURE_DR:
+        tap->drPos = 0;
+        if (instruction == EMU_INSTR_IDCODE) {
+            tap->drLength = 32;
+            for (i = 0 ; i < 32 ; i++) {
+                putBit(tap->dr, i, (tap->idcode >> i) & 0x1);
             }
-            continue;
+        }
+        else if (instruction == EMU_INSTR_USER1) {
+            tap->drLength = tap->userLength;
+            memcpy(tap->dr, tap->user, (tap->userLength + 7) / 8);
         }
         else {
-            /* Skip FTDI status bytes */
-            nRecv -= 2;
-            src += 2;
+            tap->drLength = 1;
+            putBit(tap->dr, 0, 0);
+        }
+        break;
+
+    case TAP_SHIFT_DR:
+        putBit(tap->dr, tap->drPos, tdi);
+        if (++tap->drPos == tap->drLength) {
+            tap->drPos = 0;
         }
-        if (nRecv > nWant) nRecv = nWant;
-        memcpy(buf, src, nRecv);
-        nWant -= nRecv;
-        buf += nRecv;
+        break;
     }
-    if (usb->showUSB) {
-        showBuf("Rx", base, nWanted);
+}
+
+static void
+emuTapUpdate(emuTap *tap, int state)
+{
+    uint32_t instruction = tap->ir & ((1ULL << tap->irLength) - 1);
+    int i;
+
+    if (state == TAP_UPDATE_IR) {
+        tap->ir = tap->irShift;
+    }
+    else if ((state == TAP_UPDATE_DR) && (instruction == EMU_INSTR_USER1)) {
+        for (i = 0 ; i < tap->userLength ; i++) {
+            putBit(tap->user, i,
+                          getBit(tap->dr, (tap->drPos + i) % tap->drLength));
+        }
     }
-    return 1;
 }
 
-/************************************* FTDI/JTAG ***************************/
+/*
+ * One TCK cycle through the chain.  Return TDO.
+ */
 static int
-divisorForFrequency(unsigned int frequency)
+emuClock(mpsseEmulator *emu, int tms, int tdi)
 {
-    unsigned int divisor;
-    unsigned int actual;
-    double r;
-    static unsigned int warned = ~0;
+    int state = emu->tapState;
+    int tdo, i;
 
-    if (frequency <= 0) frequency = 1;
-    divisor = ((FTDI_CLOCK_RATE / 2) + (frequency - 1)) / frequency;
-    if (divisor >= 0x10000) {
-        divisor = 0x10000;
+    if (emu->loopback) {
+        return tdi;
     }
-    if (divisor < 1)  {
-        divisor = 1;
+    tdo = emuTapTDO(&emu->taps[emu->nTaps - 1], state);
+    for (i = 0 ; i < emu->nTaps ; i++) {
+        int out = emuTapTDO(&emu->taps[i], state);
+        emuTapClock(&emu->taps[i], state, tdi);
+        tdi = out;
     }
-    actual = FTDI_CLOCK_RATE / (2 * divisor);
-    r = (double)frequency / actual;
-    if (warned != actual) {
-        warned = actual;
-        if ((r < 0.999) || (r > 1.001)) {
-            fprintf(stderr, "Warning -- %d Hz clock requested, %d Hz actual\n",
-                                                             frequency, actual);
-        }
-        if (actual < 500000) {
-            fprintf(stderr, "Warning -- %d Hz clock is a slow choice.\n",
-                                                                        actual);
+    emu->tapState = tapNext[state][tms];
+    for (i = 0 ; i < emu->nTaps ; i++) {
+        emuTapUpdate(&emu->taps[i], emu->tapState);
+    }
+    return tdo;
+}
+
+static void
+emuFifoPut(mpsseEmulator *emu, int c)
+{
+    if (emu->fifoTail == EMU_FIFO_SIZE) {
+        emu->fifoTail -= emu->fifoHead;
+        memmove(emu->fifo, emu->fifo + emu->fifoHead, emu->fifoTail);
+        emu->fifoHead = 0;
+        if (emu->fifoTail == EMU_FIFO_SIZE) {
+            fprintf(stderr, "Emulator FIFO overflow!\n");
+            exit(4);
         }
     }
-    return divisor;
+    emu->fifo[emu->fifoTail++] = c;
 }
 
+/*
+ * Shift bits in or out.  Bit-mode reads arrive at the most
+ * significant end of the byte as they do on the real device.
+ */
 static int
-ftdiSetClockSpeed(usbInfo *usb, unsigned int frequency)
+emuShiftBits(mpsseEmulator *emu, int op, int value, int nBits)
 {
-    unsigned int count;
-    if (usb->lockedSpeed) {
-        frequency = usb->lockedSpeed;
+    int lsbFirst = (op & FTDI_MPSSE_BIT_LSB_FIRST) != 0;
+    int r = 0, i;
+
+    for (i = 0 ; i < nBits ; i++) {
+        int tdo;
+        if (op & FTDI_MPSSE_BIT_WRITE_DATA) {
+            emu->tdi = (value >> (lsbFirst ? i : 7 - i)) & 0x1;
+        }
+        tdo = emuClock(emu, emu->tms, emu->tdi);
+        if (lsbFirst) {
+            r = (r >> 1) | (tdo << 7);
+        }
+        else {
+            r = (r << 1) | tdo;
+        }
     }
-    count = divisorForFrequency(frequency) - 1;
-    usb->ioBuf[0] = FTDI_DISABLE_TCK_PRESCALER;
-    usb->ioBuf[1] = FTDI_SET_TCK_DIVISOR;
-    usb->ioBuf[2] = count;
-    usb->ioBuf[3] = count >> 8;
-    return usbWriteData(usb, usb->ioBuf, 4);
+    if ((nBits < 8) && !lsbFirst) {
+        r &= (1 << nBits) - 1;
+    }
+    return r & 0xFF;
 }
 
+/*
+ * Execute a command.
+ * Return the number of bytes consumed, or 0 if it's incomplete.
+ */
 static int
-ftdiGPIO(usbInfo *usb)
+emuCommand(mpsseEmulator *emu, const unsigned char *cp, int n)
 {
-    unsigned long value;
-    unsigned int direction;
-    const char *str = usb->gpioArgument;
-    char *endp;
-    static const struct timespec ms100 = { .tv_sec = 0, .tv_nsec = 100000000 };
+    int op = cp[0];
+    int len, i;
 
-    usb->ioBuf[0] = FTDI_SET_LOW_BYTE;
-    for (;;) {
-        value = strtol(str, &endp, 16);
-        if ((endp == str) || ((*endp != '\0') && (*endp != ':'))) {
-            break;
+    if ((op & 0x80) == 0) {
+        int read = (op & FTDI_MPSSE_BIT_READ_DATA) != 0;
+        if (op & FTDI_MPSSE_BIT_WRITE_TMS) {
+            int r = 0;
+            if (n < 3) return 0;
+            len = cp[1] + 1;
+            if (len > 7) len = 7;
+            emu->tdi = (cp[2] >> 7) & 0x1;
+            for (i = 0 ; i < len ; i++) {
+                emu->tms = (cp[2] >> i) & 0x1;
+                r = (r >> 1) | (emuClock(emu, emu->tms, emu->tdi) << 7);
+            }
+            if (read) emuFifoPut(emu, r);
+            return 3;
         }
-        str = endp + 1;
-        if (value > 0xFF) {
-            break;
+        if (op & FTDI_MPSSE_BIT_BIT_MODE) {
+            int write = (op & FTDI_MPSSE_BIT_WRITE_DATA) != 0;
+            if (n < (2 + write)) return 0;
+            len = cp[1] + 1;
+            if (len > 8) len = 8;
+            i = emuShiftBits(emu, op, write ? cp[2] : 0, len);
+            if (read) emuFifoPut(emu, i);
+            return 2 + write;
         }
-        direction = value >> 4;
-        value &= 0xF;
-        usb->ioBuf[1] = (value << 4) | FTDI_PIN_TMS;
-        usb->ioBuf[2] = (direction << 4) |
-                                 FTDI_PIN_TMS | FTDI_PIN_TDI | FTDI_PIN_TCK;
-        if (!usbWriteData(usb, usb->ioBuf, 3)) {
-            break;
+        if (n < 3) return 0;
+        len = (cp[1] | (cp[2] << 8)) + 1;
+        if (op & FTDI_MPSSE_BIT_WRITE_DATA) {
+            if (n < (3 + len)) return 0;
+            for (i = 0 ; i < len ; i++) {
+                int r = emuShiftBits(emu, op, cp[3 + i], 8);
+                if (read) emuFifoPut(emu, r);
+            }
+            return 3 + len;
         }
-        if (*endp == '\0') {
-            return 1;
+        for (i = 0 ; i < len ; i++) {
+            int r = emuShiftBits(emu, op, 0, 8);
+            if (read) emuFifoPut(emu, r);
         }
-        nanosleep(&ms100, NULL);
+        return 3;
+    }
+    switch (op) {
+    case FTDI_SET_LOW_BYTE:
+        if (n < 3) return 0;
+        emu->tms = (cp[1] & FTDI_PIN_TMS) != 0;
+        emu->tdi = (cp[1] & FTDI_PIN_TDI) != 0;
+        return 3;
+    case 0x82:                          /* Set high byte */
+        if (n < 3) return 0;
+        return 3;
+    case FTDI_READ_LOW_BYTE:
+        emuFifoPut(emu, (emu->tms ? FTDI_PIN_TMS : 0) |
+                        (emu->tdi ? FTDI_PIN_TDI : 0));
+        return 1;
+    case 0x83:                          /* Read high byte */
+        emuFifoPut(emu, 0xFF);
+        return 1;
+    case FTDI_ENABLE_LOOPBACK:
+        emu->loopback = 1;
+        return 1;
+    case FTDI_DISABLE_LOOPBACK:
+        emu->loopback = 0;
+        return 1;
+    case FTDI_SET_TCK_DIVISOR:
+        if (n < 3) return 0;
+        return 3;
+    case FTDI_CLOCK_BITS:
+        if (n < 2) return 0;
+        for (i = 0 ; i <= cp[1] ; i++) {
+            emuClock(emu, emu->tms, emu->tdi);
+        }
+        return 2;
+    case FTDI_CLOCK_BYTES:
+        if (n < 3) return 0;
+        len = ((cp[1] | (cp[2] << 8)) + 1) * 8;
+        for (i = 0 ; i < len ; i++) {
+            emuClock(emu, emu->tms, emu->tdi);
+        }
+        return 3;
+    case 0x9E:                          /* Drive-only-zero */
+        if (n < 3) return 0;
+        return 3;
+    case 0x87: case 0x88: case 0x89:
+    case FTDI_DISABLE_TCK_PRESCALER: case 0x8B: case 0x8C:
+    case FTDI_DISABLE_3_PHASE_CLOCK: case 0x96: case 0x97:
+        return 1;
+    default:
+        emuFifoPut(emu, FTDI_ACK_BAD_COMMAND);
+        emuFifoPut(emu, op);
+        return 1;
     }
-    return 0;
 }
 
+/*
+ * Bulk-OUT data.  Commands may be split across transfers.
+ */
+static void
+emuWrite(mpsseEmulator *emu, const unsigned char *buf, int n)
+{
+    int i = 0;
+
+    if (!emu->mpsse) {
+        return;
+    }
+    while (n) {
+        int c = n;
+        if (c > (EMU_CMD_MAXLEN - emu->cmdCount)) {
+            c = EMU_CMD_MAXLEN - emu->cmdCount;
+        }
+        memcpy(emu->cmdBuf + emu->cmdCount, buf, c);
+        emu->cmdCount += c;
+        buf += c;
+        n -= c;
+        i = 0;
+        while (i < emu->cmdCount) {
+            int used = emuCommand(emu, emu->cmdBuf + i, emu->cmdCount - i);
+            if (used == 0) {
+                break;
+            }
+            i += used;
+        }
+        emu->cmdCount -= i;
+        memmove(emu->cmdBuf, emu->cmdBuf + i, emu->cmdCount);
+    }
+}
+
+/*
+ * Bulk-IN data.  Every packet starts with two modem status bytes.
+ */
 static int
-ftdiInit(usbInfo *usb)
+emuRead(mpsseEmulator *emu, unsigned char *buf, int length)
 {
-    static unsigned char startup[] = {
-        FTDI_DISABLE_LOOPBACK,
-        FTDI_DISABLE_3_PHASE_CLOCK,
-        FTDI_SET_LOW_BYTE,
-        FTDI_PIN_TMS,
-        FTDI_PIN_TMS | FTDI_PIN_TDI | FTDI_PIN_TCK
-    };
-    if (!usbControl(usb, BMREQTYPE_OUT, BREQ_RESET, WVAL_RESET_RESET)
-     || !usbControl(usb, BMREQTYPE_OUT, BREQ_SET_BITMODE,WVAL_SET_BITMODE_MPSSE)
-     || !usbControl(usb, BMREQTYPE_OUT, BREQ_SET_LATENCY, 2)
-     || !usbControl(usb, BMREQTYPE_OUT, BREQ_RESET, WVAL_RESET_PURGE_TX)
-     || !usbControl(usb, BMREQTYPE_OUT, BREQ_RESET, WVAL_RESET_PURGE_RX)
-     || !ftdiSetClockSpeed(usb, 10000000)
-     || !usbWriteData(usb, startup, sizeof startup)) {
-        return 0;
+    int packetSize = USB_PACKETSIZE;
+    int n = 0;
+
+    while ((length - n) >= 2) {
+        int c = emu->fifoTail - emu->fifoHead;
+        if (c > (packetSize - 2)) c = packetSize - 2;
+        if (c > (length - n - 2)) c = length - n - 2;
+        buf[n] = 0x32;
+        buf[n + 1] = 0x60;
+        memcpy(buf + n + 2, emu->fifo + emu->fifoHead, c);
+        emu->fifoHead += c;
+        n += c + 2;
+        if (c < (packetSize - 2)) {
+            break;
+        }
     }
-    if (usb->gpioArgument && !ftdiGPIO(usb)) {
-        fprintf(stderr, "Bad -g direction:value[:value...]\n");
-        return 0;
+    if (emu->fifoHead == emu->fifoTail) {
+        emu->fifoHead = emu->fifoTail = 0;
+    }
+    return n;
+}
+
+static int
+emuControl(mpsseEmulator *emu, int bRequest, int wValue)
+{
+    switch (bRequest) {
+    case BREQ_RESET:
+        if (wValue == WVAL_RESET_RESET) {
+            emu->mpsse = 0;
+            emu->loopback = 0;
+        }
+        if (wValue != WVAL_RESET_PURGE_RX) {
+            emu->fifoHead = emu->fifoTail = 0;
+        }
+        if (wValue != WVAL_RESET_PURGE_TX) {
+            emu->cmdCount = 0;
+        }
+        break;
+    case BREQ_SET_BITMODE:
+        emu->mpsse = (wValue >> 8) == (WVAL_SET_BITMODE_MPSSE >> 8);
+        break;
     }
     return 1;
 }
 
-/************************************* XVC ***************************/
+/*
+ * Asynchronous transfers complete when the event loop
+ * calls emuHandleEvents().
+ */
+static int
+emuSubmit(mpsseEmulator *emu, struct libusb_transfer *transfer)
+{
+    if (emu->nQueued == (int)(sizeof emu->queue / sizeof emu->queue[0])) {
+        return LIBUSB_ERROR_BUSY;
+    }
+    emu->cancelled[emu->nQueued] = 0;
+    emu->queue[emu->nQueued++] = transfer;
+    return 0;
+}
+
 static void
-cmdByte(usbInfo *usb, int byte)
+emuCancel(mpsseEmulator *emu, struct libusb_transfer *transfer)
 {
-    if (usb->txCount == USB_BUFSIZE) {
-        fprintf(stderr, "USB TX OVERFLOW!\n");
-        exit(4);
+    int i;
+
+    for (i = 0 ; i < emu->nQueued ; i++) {
+        if (emu->queue[i] == transfer) {
+            emu->cancelled[i] = 1;
+        }
     }
-    usb->ioBuf[usb->txCount++] = byte;
 }
 
 /*
- * The USB/JTAG chip can't shift data to TMS and TDI simultaneously
- * so switch between TMS and TDI shift commands as necessary.
- * Break into chunks small enough to fit in single packet.
+ * Return 1 if emuHandleEvents() has work to do
  */
 static int
-shiftChunks(usbInfo *usb, int nBits)
+emuPending(const mpsseEmulator *emu)
 {
-    int iBit = 0x01, iIndex = 0;
-    int cmdBit, cmdIndex, cmdBitcount;
-    int tmsBit, tmsBits, tmsState;
-    int rxBit, rxIndex;
-    int tdoBit = 0x01, tdoIndex = 0;
-    unsigned short rxBitcounts[USB_BUFSIZE/3];
+    int i;
 
-    if (usb->loopback) {
-        cmdByte(usb, FTDI_ENABLE_LOOPBACK);
+    for (i = 0 ; i < emu->nQueued ; i++) {
+        if (emu->cancelled[i]
+         || ((emu->queue[i]->endpoint & LIBUSB_ENDPOINT_DIR_MASK) !=
+                                                           LIBUSB_ENDPOINT_IN)
+         || (emu->fifoTail != emu->fifoHead)) {
+            return 1;
+        }
     }
-    while (nBits) {
-        int rxBytesWanted = 0;
-        int rxBitcountIndex = 0;
-        usb->txCount = 0;
-        usb->chunkCount++;
-        do {
-            /*
-             * Stash TMS bits until bit limit reached or TDI would change state
-             */
-            int tdiFirstState = ((usb->tdiBuf[iIndex] & iBit) != 0);
-            cmdBitcount = 0;
-            cmdBit = 0x01;
-            tmsBits = 0;
-            do {
-                tmsBit = (usb->tmsBuf[iIndex] & iBit) ? cmdBit : 0;
-                tmsBits |= tmsBit;
-                if (iBit == 0x80) {
-                    iBit = 0x01;
-                    iIndex++;
-                }
-                else {
-                    iBit <<= 1;
-                }
-                cmdBitcount++;
-                cmdBit <<= 1;
-            } while ((cmdBitcount < 6) && (cmdBitcount < nBits)
-                && (((usb->tdiBuf[iIndex] & iBit) != 0) == tdiFirstState));
-
-            /*
-             * Duplicate the final TMS bit so the TMS pin holds
-             * its value for subsequent TDI shift commands.
-             * This is why the bit limit above is 6 and not 7 since
-             * we need space to hold the copy of the final bit.
-             */
-            tmsBits |= (tmsBit << 1);
-            tmsState = (tmsBit != 0);
+    return 0;
+}
 
-            /*
-             * Send the TMS bits and TDI value.
-             */
-            cmdByte(usb, FTDI_MPSSE_XFER_TMS_BITS);
-            cmdByte(usb, cmdBitcount - 1);
-            cmdByte(usb, (tdiFirstState << 7) | tmsBits);
-            rxBitcounts[rxBitcountIndex++] = cmdBitcount;
-            rxBytesWanted++;
-            nBits -= cmdBitcount;
+/*
+ * Complete writes, then any reads for which there's data.
+ * Reads are held until there is something to return rather
+ * than returning status bytes every latency timer period.
+ */
+static void
+emuHandleEvents(mpsseEmulator *emu)
+{
+    struct libusb_transfer *done[2 * USB_XFER_DEPTH];
+    int nDone = 0, pass, i, j;
 
-            /*
-             * Stash TDI bits until bit limit reached
-             * or TMS change of state
-             * or transmitter buffer capacity reached.
-             */
-            cmdBitcount = 0;
-            cmdIndex = 0;
-            cmdBit = 0x01;
-            usb->cmdBuf[0] = 0;
-            while ((nBits != 0)
-               && (((usb->tmsBuf[iIndex] & iBit) != 0) == tmsState)
-               && ((usb->txCount+(cmdBitcount/8))<(usb->bulkOutRequestSize-5))){
-                if (usb->tdiBuf[iIndex] & iBit) {
-                    usb->cmdBuf[cmdIndex] |= cmdBit;
-                }
-                if (cmdBit == 0x80) {
-                    cmdBit = 0x01;
-                    cmdIndex++;
-                    usb->cmdBuf[cmdIndex] = 0;
-                }
-                else {
-                    cmdBit <<= 1;
-                }
-                if (iBit == 0x80) {
-                    iBit = 0x01;
-                    iIndex++;
-                }
-                else {
-                    iBit <<= 1;
-                }
-                cmdBitcount++;
-                nBits--;
+    for (pass = 0 ; pass < 2 ; pass++) {
+        for (i = 0, j = 0 ; i < emu->nQueued ; i++) {
+            struct libusb_transfer *t = emu->queue[i];
+            int isRead = (t->endpoint & LIBUSB_ENDPOINT_DIR_MASK) ==
+                                                            LIBUSB_ENDPOINT_IN;
+            if (emu->cancelled[i]) {
+                t->status = LIBUSB_TRANSFER_CANCELLED;
+                t->actual_length = 0;
             }
-
-            /*
-             * Send stashed TDI bits
-             */
-            if (cmdBitcount > 0) {
-                int cmdBytes = cmdBitcount / 8;
-                rxBitcounts[rxBitcountIndex++] = cmdBitcount;
-                if (cmdBitcount >= 8) {
-                    int i;
-                    rxBytesWanted += cmdBytes;
-                    cmdBitcount -= cmdBytes * 8;
-                    i = cmdBytes - 1;
-                    cmdByte(usb, FTDI_MPSSE_XFER_TDI_BYTES);
-                    cmdByte(usb, i);
-                    cmdByte(usb, i >> 8);
-                    for (i = 0 ; i < cmdBytes ; i++) {
-                        cmdByte(usb, usb->cmdBuf[i]);
-                    }
-                }
-                if (cmdBitcount) {
-                    rxBytesWanted++;
-                    cmdByte(usb, FTDI_MPSSE_XFER_TDI_BITS);
-                    cmdByte(usb, cmdBitcount - 1);
-                    cmdByte(usb, usb->cmdBuf[cmdBytes]);
-                }
+            else if (!isRead && (pass == 0)) {
+                emuWrite(emu, t->buffer, t->length);
+                t->status = LIBUSB_TRANSFER_COMPLETED;
+                t->actual_length = t->length;
             }
-        } while ((nBits != 0)
-              && ((usb->txCount+(cmdBitcount/8))<(usb->bulkOutRequestSize-6)));
-
+            else if (isRead && (pass == 1)
+                            && (emu->fifoTail != emu->fifoHead)) {
+                t->status = LIBUSB_TRANSFER_COMPLETED;
+                t->actual_length = emuRead(emu, t->buffer, t->length);
+            }
+            else {
+                emu->cancelled[j] = emu->cancelled[i];
+                emu->queue[j++] = t;
+                continue;
+            }
+            done[nDone++] = t;
+        }
+        emu->nQueued = j;
+    }
+    for (i = 0 ; i < nDone ; i++) {
+        done[i]->callback(done[i]);
+    }
+}
+
+/*
+ * Present the emulator as the B channel of an FT2232H
+ */
+static void
+emuOpen(usbInfo *usb)
+{
+    int nPackets = (USB_BUFSIZE + USB_PACKETSIZE - 3) / (USB_PACKETSIZE - 2);
+
+    usb->deviceVendorId = usb->vendorId = 0x0403;
+    usb->deviceProductId = usb->productId = 0x6010;
+    strcpy(usb->deviceVendorString, "Emulated");
+    snprintf(usb->deviceProductString, IDSTRING_CAPACITY,
+                                  "MPSSE with %d TAP chain", usb->emulator->nTaps);
+    strcpy(usb->deviceSerialString, "EMU00001");
+    usb->bulkInEndpointAddress = LIBUSB_ENDPOINT_IN | 0x01;
+    usb->bulkOutEndpointAddress = LIBUSB_ENDPOINT_OUT | 0x02;
+    usb->bulkOutRequestSize = USB_BUFSIZE;
+    usb->bulkInPacketSize = USB_PACKETSIZE;
+    usb->bulkInRequestSize = nPackets * USB_PACKETSIZE;
+    usb->bulkInPayloadSize = nPackets * (USB_PACKETSIZE - 2);
+    usb->emulator->isOpen = 1;
+}
+
+/************************************* USB ***************************/
+static void
+getDeviceString(usbInfo *usb, int i, char *dest)
+{
+    ssize_t n;
+
+    n = libusb_get_string_descriptor_ascii(usb->handle, i,
+                                                 usb->ioBuf, sizeof usb->ioBuf);
+    if (n < 0) {
+        *dest = '\0';
+        return;
+    }
+    if (n >= IDSTRING_CAPACITY)
+        n = IDSTRING_CAPACITY - 1;
+    memcpy(dest, (char *)usb->ioBuf, n);
+    *(dest + n) = '\0';
+}
+
+static void
+getDeviceStrings(usbInfo *usb, struct libusb_device_descriptor *desc)
+{
+    getDeviceString(usb, desc->iManufacturer, usb->deviceVendorString);
+    getDeviceString(usb, desc->iProduct, usb->deviceProductString);
+    getDeviceString(usb, desc->iSerialNumber, usb->deviceSerialString);
+}
+
+/*
+ * Size of each channel's transmit and receive FIFOs
+ */
+static int
+ftdiFifoSize(int productId, int wMaxPacketSize)
+{
+    switch (productId) {
+    case 0x6010: return 4096;   /* FT2232H */
+    case 0x6011: return 2048;   /* FT4232H */
+    case 0x6014: return 1024;   /* FT232H  */
+    default:     return wMaxPacketSize;
+    }
+}
+
+/*
+ * Get endpoints
+ * Size chunks to fill, but not overflow, the device FIFOs.
+ * Read requests span as many packets as it takes to return
+ * a full FIFO, allowing for the status bytes at the start of
+ * every packet.
+ */
+static void
+getEndpoints(usbInfo *usb, const struct libusb_interface_descriptor *iface_desc)
+{
+    int e;
+
+    usb->bulkInEndpointAddress = 0;
+    usb->bulkOutEndpointAddress = 0;
+    for (e = 0 ; e < iface_desc->bNumEndpoints ; e++) {
+        const struct libusb_endpoint_descriptor *ep = &iface_desc->endpoint[e];
+        int fifoSize = ftdiFifoSize(usb->deviceProductId, ep->wMaxPacketSize);
+        if (fifoSize > USB_BUFSIZE) {
+            fifoSize = USB_BUFSIZE;
+        }
+        if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) ==
+                                                    LIBUSB_TRANSFER_TYPE_BULK) {
+            if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) ==
+                                                           LIBUSB_ENDPOINT_IN) {
+                int nPackets;
+                if (usb->bulkInEndpointAddress != 0) {
+                    fprintf(stderr, "Too many input endpoints!\n");
+                    exit(10);
+                }
+                usb->bulkInEndpointAddress = ep->bEndpointAddress;
+                usb->bulkInPacketSize = ep->wMaxPacketSize;
+                if ((usb->bulkInPacketSize <= 2)
+                 || (usb->bulkInPacketSize > USB_PACKETSIZE)) {
+                    usb->bulkInPacketSize = USB_PACKETSIZE;
+                }
+                nPackets = (fifoSize + usb->bulkInPacketSize - 3) /
+                                                     (usb->bulkInPacketSize - 2);
+                usb->bulkInRequestSize = nPackets * usb->bulkInPacketSize;
+                usb->bulkInPayloadSize = nPackets * (usb->bulkInPacketSize - 2);
+            }
+            else {
+                if (usb->bulkOutEndpointAddress != 0) {
+                    fprintf(stderr, "Too many output endpoints!\n");
+                    exit(10);
+                }
+                usb->bulkOutEndpointAddress = ep->bEndpointAddress;
+                usb->bulkOutRequestSize = fifoSize;
+            }
+        }
+    }
+    if (usb->bulkInEndpointAddress == 0) {
+        fprintf(stderr, "No input endpoint!\n");
+        exit(10);
+    }
+    if (usb->bulkOutEndpointAddress == 0) {
+        fprintf(stderr, "No output endpoint!\n");
+        exit(10);
+    }
+}
+
+/*
+ * Check for a supported device
+ */
+static int
+productMatches(usbInfo *usb, int idProduct)
+{
+    static const uint16_t validCodes[] = { 0x6010, /* FT2232H */
+                                           0x6011, /* FT4232H */
+                                           0x6014  /* FT232H  */
+                                         };
+    int nCodes = sizeof validCodes / sizeof validCodes[0];
+    int p;
+
+    if (usb->productId >= 0) {
+        return usb->productId == idProduct;
+    }
+    for (p = 0 ; p < nCodes ; p++) {
+        if (idProduct == validCodes[p]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Search the bus for a matching device
+ */
+static int
+findDevice(usbInfo *usb, libusb_device **list, int n)
+{
+    int i;
+    for (i = 0 ; i < n ; i++) {
+        libusb_device *dev = list[i];
+        struct libusb_device_descriptor desc;
+        struct libusb_config_descriptor *config;
+        int productMatch;
+        int s = libusb_get_device_descriptor(dev, &desc);
+        if (s != 0) {
+           fprintf(stderr, "libusb_get_device_descriptor failed: %s",
+                                                            libusb_strerror(s));
+            return 0;
+        }
+        if (desc.bDeviceClass != LIBUSB_CLASS_PER_INTERFACE)
+            continue;
+        productMatch = productMatches(usb, desc.idProduct);
+        if ((usb->vendorId != desc.idVendor) || !productMatch) {
+            continue;
+        }
+        if (usb->busNumber
+         && ((libusb_get_bus_number(dev) != usb->busNumber)
+          || (libusb_get_device_address(dev) != usb->deviceAddress))) {
+            continue;
+        }
+        if ((libusb_get_active_config_descriptor(dev, &config) < 0)
+         && (libusb_get_config_descriptor(dev, 0, &config) < 0)) {
+            fprintf(stderr,
+                          "Can't get vendor %04X product %04X configuration.\n",
+                                                 desc.idVendor, desc.idProduct);
+            continue;
+        }
+        if (config == NULL) {
+            continue;
+        }
+        if (config->bNumInterfaces >= usb->ftdiJTAGindex) {
+            s = libusb_open(dev, &usb->handle);
+            if (s == 0) {
+                const struct libusb_interface *iface =
+                                       &config->interface[usb->ftdiJTAGindex-1];
+                const struct libusb_interface_descriptor *iface_desc =
+                                                          &iface->altsetting[0];
+                usb->bInterfaceNumber = iface_desc->bInterfaceNumber;
+                usb->deviceVendorId = desc.idVendor;
+                usb->deviceProductId = desc.idProduct;
+                getDeviceStrings(usb, &desc);
+                if ((usb->serialNumber == NULL)
+                 || (strcmp(usb->serialNumber,
+                            usb->deviceSerialString) == 0)) {
+                    getEndpoints(usb, iface_desc);
+                    libusb_free_config_descriptor(config);
+                    usb->productId = desc.idProduct;
+                    libusb_ref_device(dev);
+                    if (usb->device != NULL) {
+                        libusb_unref_device(usb->device);
+                    }
+                    usb->device = dev;
+                    return 1;
+                }
+                libusb_close(usb->handle);
+                usb->handle = NULL;
+            }
+            else {
+                fprintf(stderr, "libusb_open failed: %s\n",
+                                                    libusb_strerror(s));
+            }
+        }
+        libusb_free_config_descriptor(config);
+    }
+    return 0;
+}
+
+static int
+usbControl(usbInfo *usb, int bmRequestType, int bRequest, int wValue)
+{
+    int c;
+    if (usb->showUSB) {
+        printf("usbControl bmRequestType:%02X bRequest:%02X wValue:%04X\n",
+                                               bmRequestType, bRequest, wValue);
+    }
+    if (usb->emulator) {
+        return emuControl(usb->emulator, bRequest, wValue);
+    }
+    c = libusb_control_transfer(usb->handle, bmRequestType, bRequest, wValue,
+                                             usb->ftdiJTAGindex, NULL, 0, 1000);
+    if (c != 0) {
+        fprintf(stderr, "usb_control_transfer failed: %s\n",libusb_strerror(c));
+        usb->deviceLost = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static int
+usbWriteData(usbInfo *usb, unsigned char *buf, int nSend)
+{
+    int nSent = 0, s;
+
+    if (usb->showUSB) {
+        showBuf("Tx", buf, nSend);
+    }
+    usb->tmsLevel = TMS_UNKNOWN;
+    if (nSend > usb->largestWriteRequest) {
+        usb->largestWriteRequest = nSend;
+    }
+    if (usb->emulator) {
+        emuWrite(usb->emulator, buf, nSend);
+        return 1;
+    }
+    while (nSend) {
+        uint64_t start = eventClock(usb);
+        s = libusb_bulk_transfer(usb->handle, usb->bulkOutEndpointAddress, buf,
+                                                          nSend, &nSent, 10000);
+        if (timeline) {
+            timelineSpan(usb, TIMELINE_HOST, "bulk_out_sync", start, "bytes",
+                                                                 (long)nSent);
+        }
+        if (s) {
+            fprintf(stderr, "Bulk write (%d) failed: %s\n", nSend,
+                                                            libusb_strerror(s));
+            usb->deviceLost = 1;
+            return 0;
+        }
+        nSend -= nSent;
+        buf += nSent;
+        if (nSent > usb->largestWriteSent) {
+            usb->largestWriteSent = nSent;
+        }
+    }
+    return 1;
+}
+
+static int
+usbReadData(usbInfo *usb, unsigned char *buf, int length, int *nRecv)
+{
+    uint64_t start;
+    int s;
+
+    if (usb->emulator) {
+        *nRecv = emuRead(usb->emulator, buf, length);
+        return 1;
+    }
+    start = eventClock(usb);
+    s = libusb_bulk_transfer(usb->handle, usb->bulkInEndpointAddress, buf,
+                                                           length, nRecv, 1000);
+    if (timeline) {
+        timelineSpan(usb, TIMELINE_HOST, "bulk_in_sync", start, "bytes",
+                                                                (long)*nRecv);
+    }
+    if (s) {
+        fprintf(stderr, "Bulk read failed: %s\n", libusb_strerror(s));
+        return 0;
+    }
+    return 1;
+}
+
+static int
+usbSubmitTransfer(usbInfo *usb, struct libusb_transfer *transfer)
+{
+    if (usb->emulator) {
+        return emuSubmit(usb->emulator, transfer);
+    }
+    return libusb_submit_transfer(transfer);
+}
+
+static void
+usbCancelTransfer(usbInfo *usb, struct libusb_transfer *transfer)
+{
+    if (usb->emulator) {
+        emuCancel(usb->emulator, transfer);
+        return;
+    }
+    libusb_cancel_transfer(transfer);
+}
+
+static int
+usbIsOpen(const usbInfo *usb)
+{
+    if (usb->emulator) {
+        return usb->emulator->isOpen;
+    }
+    return usb->handle != NULL;
+}
+
+static void
+usbClose(usbInfo *usb)
+{
+    if (usb->emulator) {
+        usb->emulator->isOpen = 0;
+        return;
+    }
+    if (usb->handle != NULL) {
+        libusb_close(usb->handle);
+        usb->handle = NULL;
+    }
+}
+
+static const char *
+transferStatusString(enum libusb_transfer_status status)
+{
+    switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED: return "Completed";
+    case LIBUSB_TRANSFER_ERROR:     return "Transfer failed";
+    case LIBUSB_TRANSFER_TIMED_OUT: return "Timed out";
+    case LIBUSB_TRANSFER_CANCELLED: return "Cancelled";
+    case LIBUSB_TRANSFER_STALL:     return "Endpoint stalled";
+    case LIBUSB_TRANSFER_NO_DEVICE: return "Device disconnected";
+    case LIBUSB_TRANSFER_OVERFLOW:  return "Overflow";
+    }
+    return "Unknown transfer status";
+}
+
+/*
+ * Allocate the transfers used by the asynchronous engine
+ */
+static void
+usbAsyncInit(usbInfo *usb)
+{
+    int i;
+
+    for (i = 0 ; i < USB_XFER_DEPTH ; i++) {
+        usb->chunks[i].usb = usb;
+        usb->chunks[i].transfer = libusb_alloc_transfer(0);
+        usb->readTransfers[i] = libusb_alloc_transfer(0);
+        if ((usb->chunks[i].transfer == NULL)
+         || (usb->readTransfers[i] == NULL)) {
+            fprintf(stderr, "Can't allocate USB transfers.\n");
+            exit(1);
+        }
+    }
+}
+
+/*
+ * Hand received bytes to the chunks awaiting them, oldest first
+ */
+static void
+usbDistribute(usbInfo *usb, const unsigned char *src, int nRecv)
+{
+    while (nRecv) {
+        usbChunk *chunk;
+        int n;
+        if (usb->chunksReceived == usb->chunksSubmitted) {
+            fprintf(stderr, "Warning -- %d unexpected bytes from device\n",
+                                                                         nRecv);
+            return;
+        }
+        chunk = &usb->chunks[usb->chunksReceived % USB_XFER_DEPTH];
+        n = chunk->rxBytesWanted - chunk->rxCount;
+        if (n > nRecv) n = nRecv;
+        memcpy(chunk->rxBuf + chunk->rxCount, src, n);
+        chunk->rxCount += n;
+        usb->rxOutstanding -= n;
+        src += n;
+        nRecv -= n;
+        if (chunk->rxCount == chunk->rxBytesWanted) {
+            usb->chunksReceived++;
+            stageObserve(usb, STAGE_USB_READ, chunk - usb->chunks,
+                     chunk->writeTime ? chunk->writeTime : chunk->submitTime);
+        }
+    }
+}
+
+static void LIBUSB_CALL usbReadCallback(struct libusb_transfer *transfer);
+
+/*
+ * Keep enough bulk-IN transfers in flight to cover the outstanding replies.
+ * Each asks for no more packets than the reply still needs.
+ */
+static int
+usbSubmitReads(usbInfo *usb)
+{
+    int i;
+
+    for (i = 0 ; i < USB_XFER_DEPTH ; i++) {
+        int s, nWant, nPackets;
+        if (usb->readCapacity >= usb->rxOutstanding) {
+            break;
+        }
+        if (usb->readBusy[i]) {
+            continue;
+        }
+        nWant = usb->rxOutstanding - usb->readCapacity;
+        if (nWant > usb->bulkInPayloadSize) nWant = usb->bulkInPayloadSize;
+        nPackets = (nWant + usb->bulkInPacketSize - 3) /
+                                                    (usb->bulkInPacketSize - 2);
+        libusb_fill_bulk_transfer(usb->readTransfers[i], usb->handle,
+                                usb->bulkInEndpointAddress, usb->readBufs[i],
+                                nPackets * usb->bulkInPacketSize,
+                                usbReadCallback, usb, 5000);
+        s = usbSubmitTransfer(usb, usb->readTransfers[i]);
+        if (s) {
+            fprintf(stderr, "Bulk read submit failed: %s\n",
+                                                            libusb_strerror(s));
+            usb->deviceLost = 1;
+            return 0;
+        }
+        usb->readBusy[i] = 1;
+        usb->readPayload[i] = nPackets * (usb->bulkInPacketSize - 2);
+        usb->readCapacity += usb->readPayload[i];
+        usb->readTimes[i] = eventClock(usb);
+        usb->readsInFlight++;
+    }
+    return 1;
+}
+
+/*
+ * Every packet in a read starts with two FTDI status bytes.
+ * A read is a 'runt' if it holds nothing else.
+ */
+static void LIBUSB_CALL
+usbReadCallback(struct libusb_transfer *transfer)
+{
+    usbInfo *usb = transfer->user_data;
+    const unsigned char *src = transfer->buffer;
+    int nRecv = transfer->actual_length;
+    int i;
+
+    for (i = 0 ; i < USB_XFER_DEPTH ; i++) {
+        if (usb->readTransfers[i] == transfer) {
+            usb->readBusy[i] = 0;
+            usb->readCapacity -= usb->readPayload[i];
+            break;
+        }
+    }
+    if (timeline) {
+        timelineSpan(usb, TIMELINE_USB_IN + i, "bulk_in", usb->readTimes[i],
+                                                         "bytes", (long)nRecv);
+    }
+    usb->readsInFlight--;
+    if (usb->readsInFlight == 0) {
+        usb->draining = 0;
+    }
+    if ((transfer->status != LIBUSB_TRANSFER_COMPLETED)
+     && (transfer->status != LIBUSB_TRANSFER_CANCELLED)) {
+        if (!usb->deviceLost) {
+            fprintf(stderr, "Bulk read failed: %s\n",
+                                        transferStatusString(transfer->status));
+            usb->deviceLost = 1;
+        }
+        return;
+    }
+    if (nRecv <= 2) {
+        if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+            usb->runtCount++;
+            if (timeline) {
+                timelineInstant(usb, TIMELINE_USB_IN + i, "runt");
+            }
+            if (usb->runtFlag) {
+                fprintf(stderr, "want:%d got:%d", usb->rxOutstanding, nRecv);
+                if (nRecv >= 1) {
+                    fprintf(stderr, " [%02X", src[0]);
+                    if (nRecv >= 2) {
+                        fprintf(stderr, " %02X", src[1]);
+                    }
+                    fprintf(stderr, "]");
+                }
+                fprintf(stderr, "\n");
+            }
+        }
+    }
+    else {
+        while (nRecv > 2) {
+            int n = nRecv;
+            if (n > usb->bulkInPacketSize) n = usb->bulkInPacketSize;
+            /* Skip FTDI status bytes */
+            usbDistribute(usb, src + 2, n - 2);
+            src += n;
+            nRecv -= n;
+        }
+    }
+    if (!usb->deviceLost) {
+        usbSubmitReads(usb);
+    }
+}
+
+static void LIBUSB_CALL
+usbWriteCallback(struct libusb_transfer *transfer)
+{
+    usbChunk *chunk = transfer->user_data;
+
+    chunk->writeBusy = 0;
+    if ((transfer->status != LIBUSB_TRANSFER_COMPLETED)
+     || (transfer->actual_length != transfer->length)) {
+        if (!chunk->usb->deviceLost) {
+            fprintf(stderr, "Bulk write (%d) failed: %s\n", transfer->length,
+                                        transferStatusString(transfer->status));
+            chunk->usb->deviceLost = 1;
+        }
+        return;
+    }
+    if (transfer->actual_length > chunk->usb->largestWriteSent) {
+        chunk->usb->largestWriteSent = transfer->actual_length;
+    }
+    chunk->writeTime = eventClock(chunk->usb);
+    stageObserve(chunk->usb, STAGE_USB_WRITE, chunk - chunk->usb->chunks,
+                                                            chunk->submitTime);
+}
+
+/*
+ * Queue a chunk's commands and make sure its reply will be read
+ */
+static int
+usbSubmitChunk(usbInfo *usb, usbChunk *chunk)
+{
+    int s;
+
+    if (usb->showUSB) {
+        showBuf("Tx", chunk->txBuf, chunk->txCount);
+    }
+    if (chunk->txCount > usb->largestWriteRequest) {
+        usb->largestWriteRequest = chunk->txCount;
+    }
+    if (chunk->rxBytesWanted > usb->largestReadRequest) {
+        usb->largestReadRequest = chunk->rxBytesWanted;
+    }
+    chunk->rxCount = 0;
+    chunk->submitTime = eventClock(usb);
+    chunk->writeTime = 0;
+    libusb_fill_bulk_transfer(chunk->transfer, usb->handle,
+                              usb->bulkOutEndpointAddress, chunk->txBuf,
+                              chunk->txCount, usbWriteCallback, chunk, 10000);
+    s = usbSubmitTransfer(usb, chunk->transfer);
+    if (s) {
+        fprintf(stderr, "Bulk write submit failed: %s\n", libusb_strerror(s));
+        usb->deviceLost = 1;
+        return 0;
+    }
+    chunk->writeBusy = 1;
+    usb->chunksSubmitted++;
+    usb->rxOutstanding += chunk->rxBytesWanted;
+    return usbSubmitReads(usb);
+}
+
+/*
+ * Cancel the reads still in flight once all replies are in.
+ * They can only return status bytes.  Nothing more is submitted
+ * until they have come back.
+ */
+static void
+usbDrain(usbInfo *usb)
+{
+    int i;
+
+    for (i = 0 ; i < USB_XFER_DEPTH ; i++) {
+        if (usb->readBusy[i]) {
+            usbCancelTransfer(usb, usb->readTransfers[i]);
+            usb->draining = 1;
+        }
+    }
+}
+
+/*
+ * Once a lost device has returned every transfer, forget
+ * the replies that will never arrive
+ */
+static int
+usbAbandon(usbInfo *usb)
+{
+    int i;
+
+    if (usb->readsInFlight) {
+        return 0;
+    }
+    for (i = 0 ; i < USB_XFER_DEPTH ; i++) {
+        if (usb->chunks[i].writeBusy) {
+            return 0;
+        }
+    }
+    usb->chunksReceived = usb->chunksRetired = usb->chunksSubmitted;
+    usb->rxOutstanding = 0;
+    usb->draining = 0;
+    return 1;
+}
+
+/*
+ * Note matching devices as they come and go.
+ * The event loop does the work.
+ */
+static int LIBUSB_CALL
+usbHotplug(libusb_context *ctx, libusb_device *dev,
+                                  libusb_hotplug_event event, void *user_data)
+{
+    usbInfo *usb = user_data;
+
+    (void)ctx;
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+        if (dev == usb->arrived) {
+            libusb_unref_device(usb->arrived);
+            usb->arrived = NULL;
+        }
+        if (dev == usb->device) {
+            libusb_unref_device(usb->device);
+            usb->device = NULL;
+            if (usbIsOpen(usb)) {
+                usb->deviceLost = 1;
+            }
+            if (!usb->quietFlag) {
+                printf("Device removed.\n");
+                fflush(stdout);
+            }
+        }
+    }
+    else if (usb->device == NULL) {
+        if (usb->arrived != NULL) {
+            libusb_unref_device(usb->arrived);
+        }
+        usb->arrived = libusb_ref_device(dev);
+    }
+    return 0;
+}
+
+static void
+usbHotplugInit(usbInfo *usb)
+{
+#if USB_API_VERSION >= 0x01000102
+    libusb_hotplug_callback_handle handle;
+    int s;
+
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        return;
+    }
+    s = libusb_hotplug_register_callback(usb->usb,
+                LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+                                             LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                0, usb->vendorId,
+                usb->productId >= 0 ? usb->productId : LIBUSB_HOTPLUG_MATCH_ANY,
+                LIBUSB_HOTPLUG_MATCH_ANY, usbHotplug, usb, &handle);
+    if (s != 0) {
+        fprintf(stderr, "Can't register hotplug callback: %s\n",
+                                                            libusb_strerror(s));
+        return;
+    }
+    usb->hotplug = 1;
+#else
+    (void)usb;
+#endif
+}
+
+/************************************* FTDI/JTAG ***************************/
+/*
+ * Automatic TCK tuning.
+ * A known pattern is shifted through the data registers selected by
+ * Test-Logic-Reset (IDCODE or BYPASS) at a slow reference rate and then
+ * at successively larger divisors, starting from the fastest, until a
+ * rate gives the reference result every time.  The rate used is the
+ * next slower one the clock divisor offers, as a safety margin.  Results are kept by serial number in a
+ * cache file so a board is tuned only the first time it is seen.
+ */
+#define AUTOTUNE_BYTES      64
+#define AUTOTUNE_SLOWEST    30  /* Reference divisor (1 MHz) */
+#define AUTOTUNE_PASSES     4
+#define AUTOTUNE_MARGIN     1   /* Divisor steps below fastest reliable */
+
+typedef struct tunedDevice {
+    char                   serial[IDSTRING_CAPACITY + 2];   /* serial:port */
+    unsigned int           frequency;
+} tunedDevice;
+
+static const char *tuneCachePath;
+static tunedDevice *tunedDevices;
+static int nTunedDevices;
+static pthread_mutex_t tuneLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+tuneCacheAdd(const char *serial, unsigned int frequency)
+{
+    tunedDevices = realloc(tunedDevices,
+                                (nTunedDevices + 1) * sizeof *tunedDevices);
+    if (tunedDevices == NULL) {
+        fprintf(stderr, "Can't allocate TCK cache.\n");
+        exit(1);
+    }
+    strcpy(tunedDevices[nTunedDevices].serial, serial);
+    tunedDevices[nTunedDevices].frequency = frequency;
+    nTunedDevices++;
+}
+
+/*
+ * Each line of the cache file holds a serial number, a colon and
+ * an FTDI port letter, then a frequency
+ */
+static void
+tuneCacheLoad(const char *path)
+{
+    FILE *fp;
+    char serial[IDSTRING_CAPACITY + 2];
+    unsigned int frequency;
+
+    tuneCachePath = path;
+    if ((fp = fopen(path, "r")) == NULL) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+        return;
+    }
+    while (fscanf(fp, "%101s %u", serial, &frequency) == 2) {
+        tuneCacheAdd(serial, frequency);
+    }
+    fclose(fp);
+}
+
+static unsigned int
+tuneCacheFind(const char *serial)
+{
+    unsigned int frequency = 0;
+    int i;
+
+    pthread_mutex_lock(&tuneLock);
+    for (i = 0 ; i < nTunedDevices ; i++) {
+        if (strcmp(tunedDevices[i].serial, serial) == 0) {
+            frequency = tunedDevices[i].frequency;
+        }
+    }
+    pthread_mutex_unlock(&tuneLock);
+    return frequency;
+}
+
+static void
+tuneCacheStore(const char *serial, unsigned int frequency)
+{
+    FILE *fp;
+
+    pthread_mutex_lock(&tuneLock);
+    tuneCacheAdd(serial, frequency);
+    if ((fp = fopen(tuneCachePath, "a")) == NULL) {
+        fprintf(stderr, "Can't update %s: %s\n", tuneCachePath,
+                                                              strerror(errno));
+    }
+    else {
+        fprintf(fp, "%s %u\n", serial, frequency);
+        fclose(fp);
+    }
+    pthread_mutex_unlock(&tuneLock);
+}
+
+/*
+ * Read a reply to commands already sent, skipping the FTDI status bytes
+ */
+static int
+ftdiRead(usbInfo *usb, unsigned char *buf, int nWant)
+{
+    int nHave = 0, idle = 0;
+
+    while (nHave < nWant) {
+        const unsigned char *src = usb->readBufs[0];
+        int nRecv;
+        if (!usbReadData(usb, usb->readBufs[0], usb->bulkInRequestSize,
+                                                                     &nRecv)) {
+            return 0;
+        }
+        if ((nRecv <= 2) && (++idle == 100)) {
+            return 0;
+        }
+        while (nRecv > 2) {
+            int n = nRecv, i;
+            if (n > usb->bulkInPacketSize) n = usb->bulkInPacketSize;
+            for (i = 2 ; (i < n) && (nHave < nWant) ; i++) {
+                buf[nHave++] = src[i];
+            }
+            src += n;
+            nRecv -= n;
+            idle = 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Shift the pattern through the chain from Test-Logic-Reset
+ * at the given divisor and return the chain to Test-Logic-Reset
+ */
+static int
+ftdiScan(usbInfo *usb, unsigned int divisor, const unsigned char *tdi,
+                                                            unsigned char *tdo)
+{
+    unsigned char *cp = usb->ioBuf;
+    unsigned char reply[AUTOTUNE_BYTES + 3];
+
+    *cp++ = FTDI_SET_TCK_DIVISOR;
+    *cp++ = (divisor - 1);
+    *cp++ = (divisor - 1) >> 8;
+    *cp++ = FTDI_MPSSE_XFER_TMS_BITS;   /* 11111: Test-Logic-Reset */
+    *cp++ = 5 - 1;
+    *cp++ = 0x1F;
+    *cp++ = FTDI_MPSSE_XFER_TMS_BITS;   /* 0100: Shift-DR */
+    *cp++ = 4 - 1;
+    *cp++ = 0x02;
+    *cp++ = FTDI_MPSSE_XFER_TDI_BYTES;
+    *cp++ = AUTOTUNE_BYTES - 1;
+    *cp++ = 0;
+    memcpy(cp, tdi, AUTOTUNE_BYTES);
+    cp += AUTOTUNE_BYTES;
+    *cp++ = FTDI_MPSSE_XFER_TMS_BITS;   /* 11111: Test-Logic-Reset */
+    *cp++ = 5 - 1;
+    *cp++ = 0x1F;
+    if (!usbWriteData(usb, usb->ioBuf, cp - usb->ioBuf)
+     || !ftdiRead(usb, reply, sizeof reply)) {
+        return 0;
+    }
+    memcpy(tdo, reply + 2, AUTOTUNE_BYTES);
+    return 1;
+}
+
+/*
+ * The pattern must emerge from the chain after the captured
+ * registers, otherwise there is nothing to tune against
+ */
+static int
+chainSeen(const unsigned char *tdi, const unsigned char *tdo)
+{
+    int length, i;
+
+    for (length = 0 ; length <= (AUTOTUNE_BYTES * 4) ; length++) {
+        for (i = length ; i < (AUTOTUNE_BYTES * 8) ; i++) {
+            if (getBit(tdo, i) != getBit(tdi, i - length)) {
+                break;
+            }
+        }
+        if (i == (AUTOTUNE_BYTES * 8)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Return the tuned frequency, or 0 if the chain can't be used for tuning
+ */
+static unsigned int
+ftdiAutoTune(usbInfo *usb)
+{
+    unsigned char tdi[AUTOTUNE_BYTES], ref[AUTOTUNE_BYTES];
+    unsigned char tdo[AUTOTUNE_BYTES];
+    uint32_t x = 0x2545F491;
+    unsigned int divisor;
+    int i, pass;
+
+    for (i = 0 ; i < AUTOTUNE_BYTES ; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        tdi[i] = x;
+    }
+    if (!ftdiScan(usb, AUTOTUNE_SLOWEST, tdi, ref)
+     || !ftdiScan(usb, AUTOTUNE_SLOWEST, tdi, tdo)
+     || (memcmp(ref, tdo, AUTOTUNE_BYTES) != 0)
+     || !chainSeen(tdi, ref)) {
+        return 0;
+    }
+    for (divisor = 1 ; divisor < AUTOTUNE_SLOWEST ; divisor++) {
+        for (pass = 0 ; pass < AUTOTUNE_PASSES ; pass++) {
+            if (!ftdiScan(usb, divisor, tdi, tdo)) {
+                return 0;
+            }
+            if (memcmp(ref, tdo, AUTOTUNE_BYTES) != 0) {
+                break;
+            }
+        }
+        if (pass == AUTOTUNE_PASSES) {
+            break;
+        }
+    }
+    if (divisor < AUTOTUNE_SLOWEST) {
+        divisor += AUTOTUNE_MARGIN;
+    }
+    return FTDI_CLOCK_RATE / (2 * divisor);
+}
+
+static int
+divisorForFrequency(unsigned int frequency)
+{
+    unsigned int divisor;
+    unsigned int actual;
+    double r;
+    static unsigned int warned = ~0;
+
+    if (frequency <= 0) frequency = 1;
+    divisor = ((FTDI_CLOCK_RATE / 2) + (frequency - 1)) / frequency;
+    if (divisor >= 0x10000) {
+        divisor = 0x10000;
+    }
+    if (divisor < 1)  {
+        divisor = 1;
+    }
+    actual = FTDI_CLOCK_RATE / (2 * divisor);
+    r = (double)frequency / actual;
+    if (warned != actual) {
+        warned = actual;
+        if ((r < 0.999) || (r > 1.001)) {
+            fprintf(stderr, "Warning -- %d Hz clock requested, %d Hz actual\n",
+                                                             frequency, actual);
+        }
+        if (actual < 500000) {
+            fprintf(stderr, "Warning -- %d Hz clock is a slow choice.\n",
+                                                                        actual);
+        }
+    }
+    return divisor;
+}
+
+static int
+ftdiSetClockSpeed(usbInfo *usb, unsigned int frequency)
+{
+    unsigned int count;
+    usb->currentFrequency = frequency;
+    if (usb->lockedSpeed) {
+        frequency = usb->lockedSpeed;
+    }
+    else if (usb->tunedSpeed && (frequency > usb->tunedSpeed)) {
+        frequency = usb->tunedSpeed;
+    }
+    count = divisorForFrequency(frequency) - 1;
+    usb->actualFrequency = FTDI_CLOCK_RATE / (2 * (count + 1));
+    usb->ioBuf[0] = FTDI_DISABLE_TCK_PRESCALER;
+    usb->ioBuf[1] = FTDI_SET_TCK_DIVISOR;
+    usb->ioBuf[2] = count;
+    usb->ioBuf[3] = count >> 8;
+    return usbWriteData(usb, usb->ioBuf, 4);
+}
+
+/*
+ * The latency timer sets how often the FTDI returns what it has when
+ * a reply is incomplete, or a status-only runt when it has nothing.
+ * Every chunk ends with SEND_IMMEDIATE, so complete replies don't wait
+ * for the timer.  The timer starts short in case the device ignores
+ * SEND_IMMEDIATE and is lengthened whenever a batch sees runts.
+ * It must only be changed while no transfers are in flight.
+ */
+static int
+ftdiSetLatency(usbInfo *usb, int latency)
+{
+    usb->latencyTimer = latency;
+    usb->raiseLatency = 0;
+    return usbControl(usb, BMREQTYPE_OUT, BREQ_SET_LATENCY, latency);
+}
+
+static int
+ftdiGPIO(usbInfo *usb)
+{
+    unsigned long value;
+    unsigned int direction;
+    const char *str = usb->gpioArgument;
+    char *endp;
+    static const struct timespec ms100 = { .tv_sec = 0, .tv_nsec = 100000000 };
+
+    usb->ioBuf[0] = FTDI_SET_LOW_BYTE;
+    for (;;) {
+        value = strtol(str, &endp, 16);
+        if ((endp == str) || ((*endp != '\0') && (*endp != ':'))) {
+            break;
+        }
+        str = endp + 1;
+        if (value > 0xFF) {
+            break;
+        }
+        direction = value >> 4;
+        value &= 0xF;
+        usb->ioBuf[1] = (value << 4) | FTDI_PIN_TMS;
+        usb->ioBuf[2] = (direction << 4) |
+                                 FTDI_PIN_TMS | FTDI_PIN_TDI | FTDI_PIN_TCK;
+        if (!usbWriteData(usb, usb->ioBuf, 3)) {
+            break;
+        }
+        if (*endp == '\0') {
+            return 1;
+        }
+        nanosleep(&ms100, NULL);
+    }
+    return 0;
+}
+
+/*
+ * Look up or find the fastest reliable TCK for this device
+ * and run at that speed until a client asks for less.
+ * The rate belongs to the chain wired to one FTDI port, so ports
+ * sharing a serial number are kept apart.  A device with no serial
+ * number is tuned each time it is opened.
+ */
+static int
+ftdiTune(usbInfo *usb)
+{
+    char key[IDSTRING_CAPACITY + 2];
+    unsigned int frequency = 0;
+
+    if (usb->deviceSerialString[0]) {
+        sprintf(key, "%s:%c", usb->deviceSerialString,
+                                                 'A' + usb->ftdiJTAGindex - 1);
+        frequency = tuneCacheFind(key);
+    }
+    if (frequency == 0) {
+        usb->tunedSpeed = 0;
+        frequency = ftdiAutoTune(usb);
+        if (usb->deviceLost) {
+            return 0;
+        }
+        if (frequency == 0) {
+            fprintf(stderr, "Warning -- \"%s\" has no JTAG chain to tune "
+                            "against.\n", usb->deviceSerialString);
+            return ftdiSetClockSpeed(usb, 10000000);
+        }
+        if (usb->deviceSerialString[0]) {
+            tuneCacheStore(key, frequency);
+        }
+        if (!usb->quietFlag) {
+            printf("\"%s\" TCK tuned to %u Hz\n", usb->deviceSerialString,
+                                                                    frequency);
+        }
+    }
+    usb->tunedSpeed = frequency;
+    return ftdiSetClockSpeed(usb, frequency);
+}
+
+static int
+ftdiInit(usbInfo *usb)
+{
+    static unsigned char startup[] = {
+        FTDI_DISABLE_LOOPBACK,
+        FTDI_DISABLE_3_PHASE_CLOCK,
+        FTDI_SET_LOW_BYTE,
+        FTDI_PIN_TMS,
+        FTDI_PIN_TMS | FTDI_PIN_TDI | FTDI_PIN_TCK
+    };
+    if (!usbControl(usb, BMREQTYPE_OUT, BREQ_RESET, WVAL_RESET_RESET)
+     || !usbControl(usb, BMREQTYPE_OUT, BREQ_SET_BITMODE,WVAL_SET_BITMODE_MPSSE)
+     || !ftdiSetLatency(usb, FTDI_LATENCY_MIN)
+     || !usbControl(usb, BMREQTYPE_OUT, BREQ_RESET, WVAL_RESET_PURGE_TX)
+     || !usbControl(usb, BMREQTYPE_OUT, BREQ_RESET, WVAL_RESET_PURGE_RX)
+     || !ftdiSetClockSpeed(usb, 10000000)
+     || !usbWriteData(usb, startup, sizeof startup)) {
+        return 0;
+    }
+    if (usb->gpioArgument && !ftdiGPIO(usb)) {
+        fprintf(stderr, "Bad -g direction:value[:value...]\n");
+        return 0;
+    }
+    if (tuneCachePath) {
+        return ftdiTune(usb);
+    }
+    return 1;
+}
+
+/*
+ * Check that a device left open since the last session is still in step.
+ * Discard anything left in the FIFOs then send a bogus opcode and look
+ * for the MPSSE bad command response.
+ */
+static int
+ftdiResync(usbInfo *usb)
+{
+    static unsigned char bogus[] = { 0xAB };
+    unsigned char echo[2];
+    int nEcho = 0, tries;
+
+    if (!usbControl(usb, BMREQTYPE_OUT, BREQ_RESET, WVAL_RESET_PURGE_TX)
+     || !usbControl(usb, BMREQTYPE_OUT, BREQ_RESET, WVAL_RESET_PURGE_RX)
+     || !usbWriteData(usb, bogus, sizeof bogus)) {
+        return 0;
+    }
+    for (tries = 0 ; (tries < 10) && (nEcho < 2) ; tries++) {
+        const unsigned char *src = usb->readBufs[0];
+        int nRecv;
+        if (!usbReadData(usb, usb->readBufs[0], usb->bulkInRequestSize,
+                                                                     &nRecv)) {
+            return 0;
+        }
+        while (nRecv > 2) {
+            int n = nRecv, i;
+            if (n > usb->bulkInPacketSize) n = usb->bulkInPacketSize;
+            /* Skip FTDI status bytes */
+            for (i = 2 ; (i < n) && (nEcho < 2) ; i++) {
+                echo[nEcho++] = src[i];
+            }
+            src += n;
+            nRecv -= n;
+        }
+    }
+    return (nEcho == 2) && (echo[0] == FTDI_ACK_BAD_COMMAND)
+                        && (echo[1] == bogus[0]);
+}
+
+static void
+showDevice(const usbInfo *usb)
+{
+    if (usb->showUSB || !usb->quietFlag) {
+        printf(" Vendor (%04X): \"%s\"\n", usb->vendorId, usb->deviceVendorString);
+        printf("Product (%04X): \"%s\"\n", usb->productId, usb->deviceProductString);
+        printf("        Serial: \"%s\"\n", usb->deviceSerialString);
+        fflush(stdout);
+    }
+}
+
+/*
+ * Claim and initialize the device found by findDevice()
+ */
+static int
+claimDevice(usbInfo *usb)
+{
+    int s;
+
+    s = libusb_kernel_driver_active(usb->handle, usb->bInterfaceNumber);
+    if (s < 0) {
+        fprintf(stderr, "libusb_kernel_driver_active() failed: %s\n", libusb_strerror(s));
+    }
+    else if (s) {
+        s = libusb_detach_kernel_driver(usb->handle, usb->bInterfaceNumber);
+        if (s) {
+            fprintf(stderr, "libusb_detach_kernel_driver() failed: %s\n", libusb_strerror(s));
+        }
+    }
+    s = libusb_claim_interface(usb->handle, usb->bInterfaceNumber);
+    if (s) {
+        libusb_close(usb->handle);
+        usb->handle = NULL;
+        fprintf(stderr, "libusb_claim_interface failed: %s\n", libusb_strerror(s));
+        return 0;
+    }
+    showDevice(usb);
+    if (!ftdiInit(usb)) {
+        libusb_close(usb->handle);
+        usb->handle = NULL;
+        usb->deviceLost = 0;
+        return 0;
+    }
+    return 1;
+}
+
+static int
+connectUSB(usbInfo *usb)
+{
+    libusb_device **list;
+    ssize_t n;
+    int s;
+
+    if (usb->emulator) {
+        emuOpen(usb);
+        showDevice(usb);
+        if (!ftdiInit(usb)) {
+            usbClose(usb);
+            return 0;
+        }
+        return 1;
+    }
+    n = libusb_get_device_list(usb->usb, &list);
+    if (n < 0) {
+        fprintf(stderr, "libusb_get_device_list failed: %s", libusb_strerror((int)n));
+        return 0;
+    }
+    s = findDevice(usb, list, n);
+    libusb_free_device_list(list, 1);
+    if (!s) {
+        fprintf(stderr, "Can't find USB device.\n");
+        return 0;
+    }
+    return claimDevice(usb);
+}
+
+/*
+ * Open a particular device without scanning the bus
+ */
+static int
+attachDevice(usbInfo *usb, libusb_device *dev)
+{
+    if (usb->busNumber) {
+        usb->busNumber = libusb_get_bus_number(dev);
+        usb->deviceAddress = libusb_get_device_address(dev);
+    }
+    return findDevice(usb, &dev, 1) && claimDevice(usb);
+}
+
+/************************************* CLIENT ***************************/
+/*
+ * Client sockets are non-blocking.  Input is read as it arrives and
+ * replies are queued in the output buffer and sent as the socket
+ * accepts them.
+ */
+static int
+replyRoom(clientInfo *client)
+{
+    return (int)sizeof client->outBuf - client->outCount;
+}
+
+/*
+ * Queue a reply.  Callers check that there is room.
+ */
+static int
+reply(clientInfo *client, const unsigned char *buf, int len)
+{
+    if (len > replyRoom(client)) {
+        fprintf(stderr, "Reply buffer overflow!\n");
+        exit(4);
+    }
+    memcpy(client->outBuf + client->outCount, buf, len);
+    client->outCount += len;
+    return 1;
+}
+
+/*
+ * Send as much queued output as the socket will take
+ */
+static void
+clientFlush(clientInfo *client)
+{
+    uint64_t start = eventClock(client->usb);
+    int sent = 0;
+
+    while (sent < client->outCount) {
+        ssize_t n = send(client->fd, client->outBuf + sent,
+                                                 client->outCount - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+            fprintf(stderr, "reply failed: %s\n", strerror(errno));
+            client->dead = 1;
+            client->outCount = 0;
+            return;
+        }
+        sent += n;
+    }
+    if (sent) {
+        stageObserve(client->usb, STAGE_REPLY, 0, start);
+    }
+    client->outCount -= sent;
+    memmove(client->outBuf, client->outBuf + sent, client->outCount);
+}
+
+/*
+ * Move the unparsed input to the start of the buffer
+ */
+static void
+clientCompact(clientInfo *client)
+{
+    client->inCount -= client->inPos;
+    memmove(client->inBuf, client->inBuf + client->inPos, client->inCount);
+    client->inPos = 0;
+}
+
+/*
+ * Read whatever the client has sent.
+ * The buffer can't be compacted while a device operation refers to it.
+ */
+static void
+clientReceive(clientInfo *client)
+{
+    uint64_t start;
+    ssize_t n;
+
+    if ((client->inCount == client->inCapacity)
+     && (client->deviceOp == XVC_OP_NONE)) {
+        clientCompact(client);
+    }
+    if (client->inCount == client->inCapacity) {
+        return;
+    }
+    start = eventClock(client->usb);
+    n = recv(client->fd, client->inBuf + client->inCount,
+                                      client->inCapacity - client->inCount, 0);
+    if (n > 0) {
+        client->inCount += n;
+        stageObserve(client->usb, STAGE_RECEIVE, 0, start);
+    }
+    else if (n == 0) {
+        client->eof = 1;
+    }
+    else if ((errno != EINTR) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        fprintf(stderr, "recv failed: %s\n", strerror(errno));
+        client->dead = 1;
+    }
+}
+
+
+/************************************* XVC ***************************/
+/*
+ * Bit vectors are little-endian: bit 0 of a vector is the least
+ * significant bit of its first byte.  Fetching a 64-bit word at a
+ * byte boundary and shifting by the bit offset gives at least 57
+ * valid bits.  Vector buffers have XVC_BUF_SLACK extra bytes at the
+ * end so these fetches never run off the end of the buffer.
+ */
+static uint64_t
+load64(const unsigned char *p)
+{
+    uint64_t v;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    memcpy(&v, p, sizeof v);
+#else
+    int i;
+    for (i = 7, v = 0 ; i >= 0 ; i--) {
+        v = (v << 8) | p[i];
+    }
+#endif
+    return v;
+}
+
+static void
+store64(unsigned char *p, uint64_t v)
+{
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    memcpy(p, &v, sizeof v);
+#else
+    int i;
+    for (i = 0 ; i < 8 ; i++, v >>= 8) {
+        p[i] = v;
+    }
+#endif
+}
+
+static int
+countTrailingZeros(uint64_t v)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(v);
+#else
+    int n = 0;
+    while ((v & 0x1) == 0) {
+        v >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/*
+ * Fetch up to 57 bits starting at the specified bit
+ */
+static uint64_t
+fetchBits(const unsigned char *buf, int bit)
+{
+    return load64(buf + (bit >> 3)) >> (bit & 0x7);
+}
+
+/*
+ * Count consecutive bits equal to 'value', up to 'limit' of them
+ */
+static int
+bitRun(const unsigned char *buf, int bit, int value, int limit)
+{
+    uint64_t flip = value ? ~(uint64_t)0 : 0;
+    int n = 0;
+
+    while (n < limit) {
+        int valid = 64 - ((bit + n) & 0x7);
+        uint64_t w = (fetchBits(buf, bit + n) ^ flip) &
+                                                  (~(uint64_t)0 >> (64 - valid));
+        if (w) {
+            n += countTrailingZeros(w);
+            break;
+        }
+        n += valid;
+    }
+    return (n < limit) ? n : limit;
+}
+
+/*
+ * Pack 'nBytes' bytes of bits starting at the specified bit
+ */
+static void
+copyBits(unsigned char *dst, const unsigned char *src, int bit, int nBytes)
+{
+    int shift = bit & 0x7;
+
+    src += bit >> 3;
+    if (shift == 0) {
+        memcpy(dst, src, nBytes);
+        return;
+    }
+    while (nBytes >= 8) {
+        store64(dst, load64(src) >> shift);
+        src += 7;
+        dst += 7;
+        nBytes -= 7;
+    }
+    while (nBytes--) {
+        *dst++ = (src[0] >> shift) | (src[1] << (8 - shift));
+        src++;
+    }
+}
+
+static unsigned char *
+cmdReserve(usbChunk *chunk, int n)
+{
+    unsigned char *p;
+    if ((chunk->txCount + n) > (int)sizeof chunk->txBuf) {
+        fprintf(stderr, "USB TX OVERFLOW!\n");
+        exit(4);
+    }
+    p = chunk->txBuf + chunk->txCount;
+    chunk->txCount += n;
+    return p;
+}
+
+static void
+cmdByte(usbChunk *chunk, int byte)
+{
+    *cmdReserve(chunk, 1) = byte;
+}
+
+/*
+ * Split vectors into the MPSSE commands needing the fewest bytes.
+ * The USB/JTAG chip can't shift data to TMS and TDI simultaneously
+ * so there are three commands to choose from:
+ *   TMS bits   3 bytes for up to 7 bits with TDI constant
+ *   TDI bits   3 bytes for up to 8 bits with TMS constant
+ *   TDI bytes  3 bytes plus 1 for every 8 bits with TMS constant
+ * TDI commands clock with TMS held at the level the previous command
+ * left it.  A TMS command of up to 6 bits repeats its final bit so the
+ * TMS pin holds that level, while one of 7 bits leaves it unknown.
+ * The cheapest schedule is found by dynamic programming over the bit
+ * positions, with the TMS level held at each position as the state.
+ * Inside a run of constant TMS only positions near the ends of the run
+ * need be considered since commands that meet in the middle of a run
+ * can be merged into one TDI command for no more bytes.
+ * When TMS changes every few bits there is little to gain over simply
+ * alternating TMS and TDI commands, and the search would take longer
+ * than the wire, so such vectors are encoded greedily instead.
+ * No command returns more bytes than it sends so the reply to a chunk
+ * always fits the USB buffers.
+ */
+#define SCHEDULE_SAMPLE     256 /* Bits examined to choose the encoder */
+#define SCHEDULE_MIN_RUN    16  /* Shortest average TMS run worth a search */
+
+static int
+tdiCost(int nBits)
+{
+    int bitCmds = 3 * ((nBits + 7) / 8);
+    int byteCmds = 3 + (nBits / 8) + ((nBits % 8) ? 3 : 0);
+
+    return (bitCmds <= byteCmds) ? bitCmds : byteCmds;
+}
+
+static void
+scheduleReach(schedule *s, int pos, int level, int cost, int nBits,
+                                                        int from, int isTMS)
+{
+    scheduleStep *step = s->steps[pos];
+
+    if ((s->reached[pos >> 6] & ((uint64_t)1 << (pos & 0x3F))) == 0) {
+        s->reached[pos >> 6] |= (uint64_t)1 << (pos & 0x3F);
+        step[0].cost = step[1].cost = step[TMS_UNKNOWN].cost = USHRT_MAX;
+    }
+    if (cost < step[level].cost) {
+        step[level].cost = cost;
+        step[level].nBits = nBits;
+        step[level].from = from;
+        step[level].isTMS = isTMS;
+    }
+}
+
+/*
+ * Find the next position reached, or -1 if there is none up to 'last'
+ */
+static int
+scheduleNext(const schedule *s, int pos, int last)
+{
+    int i = pos >> 6;
+    uint64_t w = s->reached[i] & (~(uint64_t)0 << (pos & 0x3F));
+
+    while (w == 0) {
+        if (++i > (last >> 6)) {
+            return -1;
+        }
+        w = s->reached[i];
+    }
+    pos = (i << 6) + countTrailingZeros(w);
+    return (pos <= last) ? pos : -1;
+}
+
+/*
+ * Find the cheapest ways of encoding the bits following those at 'pos'.
+ * With TMS already at the level of the run a TMS command that ends
+ * inside the run is no cheaper than a TDI command so isn't tried.
+ * Nor is a 7 bit TMS command that ends 7 or more bits short of the end
+ * of the run, since a 6 bit one followed by a TDI command instead of the
+ * next TMS command costs no more and leaves the level known.
+ */
+static void
+scheduleExpand(schedule *s, const unsigned char *tmsBuf,
+               const unsigned char *tdiBuf, int firstBit, int pos, int nBits,
+               int budget)
+{
+    uint64_t tms = fetchBits(tmsBuf, firstBit + pos);
+    int tms0 = tms & 0x1;
+    int tdi0 = fetchBits(tdiBuf, firstBit + pos) & 0x1;
+    int tmsLimit = bitRun(tdiBuf, firstBit + pos, tdi0, (nBits - pos) < 7 ?
+                                                          (nBits - pos) : 7);
+    int runLength = bitRun(tmsBuf, firstBit + pos, tms0, nBits - pos);
+    int level, i;
+
+    if ((runLength >= 14) && (tmsLimit > 6)) {
+        tmsLimit = 6;
+    }
+
+    for (level = 0 ; level <= TMS_UNKNOWN ; level++) {
+        int cost = s->steps[pos][level].cost;
+        if (cost > (budget - 3)) {
+            continue;
+        }
+        for (i = (level == tms0) ? runLength + 1 : 1 ; i <= tmsLimit ; i++) {
+            scheduleReach(s, pos + i, (i <= 6) ? ((tms >> (i - 1)) & 0x1) :
+                                    TMS_UNKNOWN, cost + 3, i, level, 1);
+        }
+        if (level == tms0) {
+            int far = 8 * (budget - cost - 3);
+            for (i = (runLength > 8) ? runLength - 7 : 1 ;
+                                                    i <= runLength ; i++) {
+                int c = cost + tdiCost(i);
+                if (c <= budget) {
+                    scheduleReach(s, pos + i, level, c, i, level, 0);
+                }
+            }
+            if ((far > 8) && (far < (runLength - 7))) {
+                scheduleReach(s, pos + far, level, cost + tdiCost(far),
+                                                            far, level, 0);
+            }
+        }
+    }
+}
+
+/*
+ * Encode with the fewest command bytes
+ */
+static int
+encodeSchedule(usbInfo *usb, usbChunk *chunk, const unsigned char *tmsBuf,
+               const unsigned char *tdiBuf, int firstBit, int nBits)
+{
+    schedule *s = usb->schedule;
+    int budget = usb->bulkOutRequestSize - 1 - chunk->txCount;
+    int pos, end, level, i, nSteps = 0;
+
+    if (s == NULL) {
+        if ((s = malloc(sizeof *s)) == NULL) {
+            fprintf(stderr, "Can't allocate command schedule.\n");
+            exit(1);
+        }
+        usb->schedule = s;
+    }
+    if (nBits > (8 * budget)) {
+        nBits = 8 * budget;
+    }
+    memset(s->reached, 0, ((nBits >> 6) + 2) * sizeof s->reached[0]);
+    scheduleReach(s, 0, usb->tmsLevel, 0, 0, 0, 0);
+    for (pos = 0, end = 0 ; (pos = scheduleNext(s, pos, nBits)) >= 0 ; pos++) {
+        end = pos;
+        if (pos != nBits) {
+            scheduleExpand(s, tmsBuf, tdiBuf, firstBit, pos, nBits, budget);
+        }
+    }
+    if (end == 0) {
+        return 0;
+    }
+
+    /*
+     * Follow the cheapest way back from the furthest position reached
+     */
+    level = 0;
+    for (i = 1 ; i <= TMS_UNKNOWN ; i++) {
+        if (s->steps[end][i].cost < s->steps[end][level].cost) {
+            level = i;
+        }
+    }
+    usb->tmsLevel = level;
+    for (pos = end ; pos ; ) {
+        const scheduleStep *step = &s->steps[pos][level];
+        s->path[nSteps] = pos;
+        s->pathLevel[nSteps++] = level;
+        pos -= step->nBits;
+        level = step->from;
+    }
+    while (nSteps--) {
+        const scheduleStep *step = &s->steps[s->path[nSteps]]
+                                           [s->pathLevel[nSteps]];
+        int cmdBitcount = step->nBits;
+        int bit = firstBit + s->path[nSteps] - cmdBitcount;
+        chunk->rxBitcounts[chunk->rxBitcountIndex++] = cmdBitcount;
+        if (step->isTMS) {
+            int tmsBits = fetchBits(tmsBuf, bit) & ((1 << cmdBitcount) - 1);
+            if (cmdBitcount <= 6) {
+                tmsBits |= ((tmsBits >> (cmdBitcount - 1)) & 0x1) <<
+                                                                   cmdBitcount;
+            }
+            cmdByte(chunk, FTDI_MPSSE_XFER_TMS_BITS);
+            cmdByte(chunk, cmdBitcount - 1);
+            cmdByte(chunk, ((fetchBits(tdiBuf, bit) & 0x1) << 7) | tmsBits);
+            chunk->rxBytesWanted++;
+            continue;
+        }
+        if ((3 * ((cmdBitcount + 7) / 8)) > tdiCost(cmdBitcount)) {
+            int cmdBytes = cmdBitcount / 8;
+            chunk->rxBytesWanted += cmdBytes;
+            cmdByte(chunk, FTDI_MPSSE_XFER_TDI_BYTES);
+            cmdByte(chunk, cmdBytes - 1);
+            cmdByte(chunk, (cmdBytes - 1) >> 8);
+            copyBits(cmdReserve(chunk, cmdBytes), tdiBuf, bit, cmdBytes);
+            bit += cmdBytes * 8;
+            cmdBitcount -= cmdBytes * 8;
+        }
+        while (cmdBitcount) {
+            int n = (cmdBitcount < 8) ? cmdBitcount : 8;
+            chunk->rxBytesWanted++;
+            cmdByte(chunk, FTDI_MPSSE_XFER_TDI_BITS);
+            cmdByte(chunk, n - 1);
+            cmdByte(chunk, fetchBits(tdiBuf, bit) & 0xFF);
+            bit += n;
+            cmdBitcount -= n;
+        }
+    }
+    return end;
+}
+
+/*
+ * Encode by alternating TMS and TDI commands.
+ * Runs are found a word at a time and TDI is packed straight
+ * into the command buffer.
+ */
+static int
+encodeGreedy(usbInfo *usb, usbChunk *chunk, const unsigned char *tmsBuf,
+             const unsigned char *tdiBuf, int firstBit, int nBits)
+{
+    int bit = firstBit;
+    int limit = firstBit + nBits;
+
+    do {
+        int tdiFirstState, tmsState, tmsBits, cmdBitcount, cmdBytes, room;
+
+        /*
+         * Send TDI bits while TMS is already at the level to be held
+         * until bit limit reached
+         * or TMS change of state
+         * or transmitter buffer capacity reached.
+         */
+        tmsState = fetchBits(tmsBuf, bit) & 0x1;
+        if (tmsState == usb->tmsLevel) {
+            room = (usb->bulkOutRequestSize - 5 - chunk->txCount) * 8;
+            if (room <= 0) {
+                break;
+            }
+            cmdBitcount = bitRun(tmsBuf, bit, tmsState,
+                                     (limit - bit) < room ? (limit - bit) : room);
+            cmdBytes = cmdBitcount / 8;
+            chunk->rxBitcounts[chunk->rxBitcountIndex++] = cmdBitcount;
+            if (cmdBytes) {
+                chunk->rxBytesWanted += cmdBytes;
+                cmdByte(chunk, FTDI_MPSSE_XFER_TDI_BYTES);
+                cmdByte(chunk, cmdBytes - 1);
+                cmdByte(chunk, (cmdBytes - 1) >> 8);
+                copyBits(cmdReserve(chunk, cmdBytes), tdiBuf, bit, cmdBytes);
+                bit += cmdBytes * 8;
+                cmdBitcount -= cmdBytes * 8;
+            }
+            if (cmdBitcount) {
+                chunk->rxBytesWanted++;
+                cmdByte(chunk, FTDI_MPSSE_XFER_TDI_BITS);
+                cmdByte(chunk, cmdBitcount - 1);
+                cmdByte(chunk, fetchBits(tdiBuf, bit) & 0xFF);
+                bit += cmdBitcount;
+            }
+            continue;
+        }
+
+        /*
+         * Stash TMS bits until bit limit reached or TDI would change state
+         */
+        tdiFirstState = fetchBits(tdiBuf, bit) & 0x1;
+        cmdBitcount = bitRun(tdiBuf, bit, tdiFirstState,
+                                       (limit - bit) < 6 ? (limit - bit) : 6);
+        tmsBits = fetchBits(tmsBuf, bit) & ((1 << cmdBitcount) - 1);
+        tmsState = (tmsBits >> (cmdBitcount - 1)) & 0x1;
+        /*
+         * Duplicate the final TMS bit so the TMS pin holds
+         * its value for subsequent TDI shift commands.
+         * This is why the bit limit above is 6 and not 7 since
+         * we need space to hold the copy of the final bit.
+         */
+        tmsBits |= tmsState << cmdBitcount;
+        chunk->rxBitcounts[chunk->rxBitcountIndex++] = cmdBitcount;
+        cmdByte(chunk, FTDI_MPSSE_XFER_TMS_BITS);
+        cmdByte(chunk, cmdBitcount - 1);
+        cmdByte(chunk, (tdiFirstState << 7) | tmsBits);
+        chunk->rxBytesWanted++;
+        usb->tmsLevel = tmsState;
+        bit += cmdBitcount;
+    } while ((bit != limit)
+          && (chunk->txCount < (usb->bulkOutRequestSize - 6)));
+    return bit - firstBit;
+}
+
+/*
+ * Encode as much of a vector as fits in the chunk.
+ * Bit positions are relative to the tmsBuf/tdiBuf pointers passed in.
+ * Return the number of bits encoded.
+ */
+static int
+encodeChunk(usbInfo *usb, usbChunk *chunk, const unsigned char *tmsBuf,
+            const unsigned char *tdiBuf, int firstBit, int nBits)
+{
+    int sample = (nBits < SCHEDULE_SAMPLE) ? nBits : SCHEDULE_SAMPLE;
+    int runLimit = (sample + SCHEDULE_MIN_RUN - 1) / SCHEDULE_MIN_RUN;
+    int pos = 0, runs = 0;
+
+    while ((pos < sample) && (runs <= runLimit)) {
+        pos += bitRun(tmsBuf, firstBit + pos,
+                      fetchBits(tmsBuf, firstBit + pos) & 0x1, sample - pos);
+        runs++;
+    }
+    if (runs > runLimit) {
+        return encodeGreedy(usb, chunk, tmsBuf, tdiBuf, firstBit, nBits);
+    }
+    return encodeSchedule(usb, chunk, tmsBuf, tdiBuf, firstBit, nBits);
+}
+
+/*
+ * Append 'nBits' (at most 57) bits to a vector ending at the specified bit.
+ * Bits above the new end of the vector are cleared.
+ */
+static void
+appendBits(unsigned char *buf, int bit, uint64_t value, int nBits)
+{
+    unsigned char *p = buf + (bit >> 3);
+    int shift = bit & 0x7;
+    uint64_t keep = (((uint64_t)1) << shift) - 1;
+
+    value &= (((uint64_t)1) << nBits) - 1;
+    store64(p, (load64(p) & keep) | (value << shift));
+}
+
+/*
+ * Append whole bytes to a vector ending at the specified bit
+ */
+static void
+appendBytes(unsigned char *buf, int bit, const unsigned char *src, int nBytes)
+{
+    unsigned char *dst = buf + (bit >> 3);
+    int shift = bit & 0x7;
+    uint64_t keep = (((uint64_t)1) << shift) - 1;
+
+    if (shift == 0) {
+        memcpy(dst, src, nBytes);
+        return;
+    }
+    while (nBytes >= 8) {
+        store64(dst, (load64(dst) & keep) | (load64(src) << shift));
+        dst += 7;
+        src += 7;
+        nBytes -= 7;
+    }
+    while (nBytes--) {
+        dst[0] = (dst[0] & keep) | (*src << shift);
+        dst[1] = *src >> (8 - shift);
+        dst++;
+        src++;
+    }
+}
+
+/*
+ * Unpack a chunk's reply into the TDO window.
+ * Byte-mode reads return whole bytes, least significant bit first.
+ * Bit-mode reads return their bits at the most significant end of a byte.
+ * A zero bit count marks the end of a vector.
+ */
+static void
+decodeChunk(usbInfo *usb, usbChunk *chunk, int *tdoBitp)
+{
+    const unsigned char *rx = chunk->rxBuf;
+    int tdoBit = *tdoBitp;
+    int i;
+
+    for (i = 0 ; i < chunk->rxBitcountIndex ; i++) {
+        int rxBitcount = chunk->rxBitcounts[i];
+        int rxBytes = rxBitcount / 8;
+        if (rxBitcount == 0) {
+            tdoBit = (tdoBit + 7) & ~0x7;
+            continue;
+        }
+        if (rxBytes) {
+            appendBytes(usb->tdoBuf, tdoBit, rx, rxBytes);
+            rx += rxBytes;
+            tdoBit += rxBytes * 8;
+            rxBitcount -= rxBytes * 8;
+        }
+        if (rxBitcount) {
+            appendBits(usb->tdoBuf, tdoBit, *rx++ >> (8 - rxBitcount),
+                                                                    rxBitcount);
+            tdoBit += rxBitcount;
+        }
+    }
+    if ((rx - chunk->rxBuf) != chunk->rxBytesWanted) {
+        printf("Warning -- consumed %d but supplied %d\n",
+                                (int)(rx - chunk->rxBuf), chunk->rxBytesWanted);
+    }
+    *tdoBitp = tdoBit;
+}
+
+/************************************* TRACE ***************************/
+/*
+ * Capture of every settck: and shift: request and its reply.
+ * The file starts with the 16 byte header:
+ *     "XVCTRACE", version (4 bytes), header length (4 bytes)
+ * then holds a record for each request in the order they are served:
+ *     record length (4), type (2), session (2), nanoseconds since
+ *     capture started (8), period or bit count (4), settck reply (4)
+ * followed, for shifts, by the TMS, TDI and TDO vectors.
+ * Records are padded to a multiple of 8 bytes and all values are
+ * little-endian so a trace can be memory-mapped for replay.
+ * Space for a shift is set aside when it starts and its vectors
+ * are filled in as they pass through the server.
+ */
+#define TRACE_HEADER_SIZE   16
+#define TRACE_RECORD_SIZE   24
+#define TRACE_SETTCK        1
+#define TRACE_SHIFT         2
+
+/*
+ * Write part of the trace.  Give up on the trace if that fails.
+ */
+static void
+traceWrite(usbInfo *usb, uint64_t offset, const unsigned char *buf, size_t n)
+{
+    while ((usb->traceFd >= 0) && n) {
+        ssize_t c = pwrite(usb->traceFd, buf, n, offset);
+        if (c < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Trace write failed: %s -- trace ends.\n",
+                                                              strerror(errno));
+            close(usb->traceFd);
+            usb->traceFd = -1;
+            return;
+        }
+        buf += c;
+        n -= c;
+        offset += c;
+    }
+}
+
+static void
+traceOpen(usbInfo *usb, const char *path)
+{
+    unsigned char header[TRACE_HEADER_SIZE];
+
+    usb->traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (usb->traceFd < 0) {
+        fprintf(stderr, "Can't create %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    memcpy(header, "XVCTRACE", 8);
+    put32(header + 8, 1);
+    put32(header + 12, TRACE_HEADER_SIZE);
+    traceWrite(usb, 0, header, sizeof header);
+    usb->traceEnd = TRACE_HEADER_SIZE;
+    usb->traceStart = nanoseconds();
+}
+
+/*
+ * Set aside space for a record and write its header.
+ * Return the offset of the vectors.
+ */
+static uint64_t
+traceRecord(usbInfo *usb, clientInfo *client, int type, uint64_t when,
+                                uint32_t value, uint32_t reply, uint32_t nBytes)
+{
+    static const unsigned char pad[8];
+    unsigned char header[TRACE_RECORD_SIZE];
+    uint64_t offset = usb->traceEnd;
+    uint32_t length = (TRACE_RECORD_SIZE + (3 * nBytes) + 7) & ~0x7;
+
+    put32(header, length);
+    header[4] = type;
+    header[5] = 0;
+    header[6] = client->session;
+    header[7] = client->session >> 8;
+    store64(header + 8, when);
+    put32(header + 16, value);
+    put32(header + 20, reply);
+    usb->traceEnd += length;
+    traceWrite(usb, usb->traceEnd - sizeof pad, pad, sizeof pad);
+    traceWrite(usb, offset, header, sizeof header);
+    return offset + TRACE_RECORD_SIZE;
+}
+
+/************************************* BROADCAST ***************************/
+/*
+ * Drive identical boards in step with the device clients see.
+ * Each board has transfers of its own which are sent the same
+ * commands as the device's transfers and submitted alongside them,
+ * so every board shifts at once.  Clients are sent the device's TDO.
+ * Each board's TDO is compared with the device's and differences
+ * are reported.
+ */
+
+/*
+ * Set up the boards like the device but with their own transfers
+ */
+static void
+broadcastInit(usbInfo *usb, const char * const *serials, int nSerials)
+{
+    int i;
+
+    for (i = 0 ; i < nSerials ; i++) {
+        usbInfo *mirror = malloc(sizeof *mirror);
+        if (mirror == NULL) {
+            fprintf(stderr, "No memory for -D board.\n");
+            exit(1);
+        }
+        *mirror = *usb;
+        mirror->serialNumber = serials[i];
+        mirror->showUSB = 0;
+        mirror->showXVC = 0;
+        mirror->statisticsFlag = 0;
+        mirror->metricsFlag = 0;
+        mirror->traceFd = -1;
+        mirror->nMirrors = 0;
+        usbAsyncInit(mirror);
+        usb->mirrors[usb->nMirrors++] = mirror;
+    }
+}
+
+/*
+ * Make a board ready to follow the device.  A board that has been
+ * closed is reopened once per session, as soon as the device's TAP
+ * is in Test-Logic-Reset or Run-Test/Idle, and its TAP is taken to
+ * the same state.  Until then it sits out.
+ */
+static int
+broadcastJoin(usbInfo *usb, usbInfo *mirror)
+{
+    if (mirror->deviceLost) {
+        if (!usbAbandon(mirror)) {
+            return 0;
+        }
+        usbClose(mirror);
+        mirror->deviceLost = 0;
+        mirror->resyncNeeded = 0;
+    }
+    if (mirror->resyncNeeded) {
+        mirror->resyncNeeded = 0;
+        if (!ftdiResync(mirror) && !ftdiInit(mirror)) {
+            usbClose(mirror);
+        }
+    }
+    if (!usbIsOpen(mirror)) {
+        unsigned char tms[3] = { FTDI_MPSSE_WRITE_TMS_BITS, 5, 0x1F };
+        if (!mirror->sessionEnded
+         || ((usb->tapState != TAP_RESET) && (usb->tapState != TAP_IDLE))) {
+            return 0;
+        }
+        mirror->sessionEnded = 0;
+        if (usb->tapState == TAP_RESET) {
+            tms[1] = 4;
+        }
+        if (!connectUSB(mirror) || !usbWriteData(mirror, tms, sizeof tms)) {
+            fprintf(stderr, "Board \"%s\" left out of broadcast.\n",
+                                                        mirror->serialNumber);
+            usbClose(mirror);
+            mirror->deviceLost = 0;
+            return 0;
+        }
+    }
+    mirror->sessionEnded = 0;
+    if ((mirror->currentFrequency != usb->currentFrequency)
+     && !ftdiSetClockSpeed(mirror, usb->currentFrequency)) {
+        fprintf(stderr, "Board \"%s\" left out of broadcast.\n",
+                                                        mirror->serialNumber);
+        return 0;
+    }
+    if (mirror->tmsLevel != usb->tmsLevel) {
+        usb->tmsLevel = TMS_UNKNOWN;
+    }
+    return 1;
+}
+
+/*
+ * Decide which boards take part in the operation about to start
+ */
+static void
+broadcastReady(usbInfo *usb)
+{
+    int i;
+
+    for (i = 0 ; i < usb->nMirrors ; i++) {
+        usb->mirrors[i]->broadcasting = broadcastJoin(usb, usb->mirrors[i]);
+    }
+}
+
+/*
+ * Return 1 if a board's transfers have yet to come back
+ */
+static int
+broadcastBusy(const usbInfo *usb)
+{
+    int i, j;
+
+    for (i = 0 ; i < usb->nMirrors ; i++) {
+        const usbInfo *mirror = usb->mirrors[i];
+        if (mirror->readsInFlight || mirror->draining) {
+            return 1;
+        }
+        for (j = 0 ; j < USB_XFER_DEPTH ; j++) {
+            if (mirror->chunks[j].writeBusy) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Send the boards a copy of the chunk just submitted to the device
+ */
+static void
+broadcastChunk(usbInfo *usb, const usbChunk *chunk)
+{
+    int i;
+
+    for (i = 0 ; i < usb->nMirrors ; i++) {
+        usbInfo *mirror = usb->mirrors[i];
+        usbChunk *copy;
+        if (!mirror->broadcasting || mirror->deviceLost) {
+            continue;
+        }
+        copy = &mirror->chunks[mirror->chunksSubmitted % USB_XFER_DEPTH];
+        memcpy(copy->txBuf, chunk->txBuf, chunk->txCount);
+        copy->txCount = chunk->txCount;
+        copy->rxBytesWanted = chunk->rxBytesWanted;
+        mirror->tmsLevel = usb->tmsLevel;
+        usbSubmitChunk(mirror, copy);
+    }
+}
+
+/*
+ * Return 1 once every board has the reply to the device's oldest chunk.
+ * A board that goes away drops out of the broadcast.
+ */
+static int
+broadcastReceived(usbInfo *usb)
+{
+    int i, received = 1;
+
+    for (i = 0 ; i < usb->nMirrors ; i++) {
+        usbInfo *mirror = usb->mirrors[i];
+        const usbChunk *copy;
+        if (!mirror->broadcasting) {
+            continue;
+        }
+        if (mirror->deviceLost) {
+            mirror->broadcasting = 0;
+            fprintf(stderr, "Board \"%s\" dropped from broadcast.\n",
+                                                        mirror->serialNumber);
+            continue;
+        }
+        copy = &mirror->chunks[mirror->chunksRetired % USB_XFER_DEPTH];
+        if (copy->writeBusy || (copy->rxCount != copy->rxBytesWanted)) {
+            received = 0;
+        }
+    }
+    return received;
+}
+
+/*
+ * Compare two replies to the same commands.  Bit-mode reads
+ * return their bits at the most significant end of a byte.
+ */
+static int
+repliesDiffer(const usbChunk *chunk, const unsigned char *rx)
+{
+    const unsigned char *ref = chunk->rxBuf;
+    int i;
+
+    for (i = 0 ; i < chunk->rxBitcountIndex ; i++) {
+        int rxBitcount = chunk->rxBitcounts[i];
+        int rxBytes = rxBitcount / 8;
+        if (memcmp(ref, rx, rxBytes) != 0) {
+            return 1;
+        }
+        ref += rxBytes;
+        rx += rxBytes;
+        rxBitcount -= rxBytes * 8;
+        if (rxBitcount) {
+            if ((*ref++ ^ *rx++) >> (8 - rxBitcount)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Check and retire the boards' copies of the device's oldest chunk
+ */
+static void
+broadcastRetire(usbInfo *usb, const usbChunk *chunk)
+{
+    int i;
+
+    for (i = 0 ; i < usb->nMirrors ; i++) {
+        usbInfo *mirror = usb->mirrors[i];
+        const usbChunk *copy;
+        if (!mirror->broadcasting) {
+            continue;
+        }
+        copy = &mirror->chunks[mirror->chunksRetired % USB_XFER_DEPTH];
+        if (repliesDiffer(chunk, copy->rxBuf)) {
+            mirror->mirrorDiffers = 1;
+        }
+        mirror->chunksRetired++;
+    }
+}
+
+/*
+ * Wind up the boards' part in an operation.  The first mismatch
+ * from a board is reported, then every tenfold increase.
+ * Replies still to come once the device has gone away are abandoned.
+ */
+static void
+broadcastFinish(usbInfo *usb, int lost)
+{
+    int i;
+
+    for (i = 0 ; i < usb->nMirrors ; i++) {
+        usbInfo *mirror = usb->mirrors[i];
+        if (!mirror->broadcasting) {
+            continue;
+        }
+        if (lost) {
+            mirror->deviceLost = 1;
+        }
+        usbDrain(mirror);
+        if (mirror->mirrorDiffers) {
+            uint64_t n = ++mirror->mismatchCount;
+            mirror->mirrorDiffers = 0;
+            while ((n % 10) == 0) {
+                n /= 10;
+            }
+            if (n == 1) {
+                fprintf(stderr, "Board \"%s\" TDO differs from \"%s\" "
+                                "(%" PRIu64 " time%s).\n",
+                                mirror->serialNumber, usb->deviceSerialString,
+                                mirror->mismatchCount,
+                                mirror->mismatchCount == 1 ? "" : "s");
+            }
+        }
+    }
+}
+
+/*
+ * Close the boards or leave them for the next session
+ */
+static void
+broadcastEnd(usbInfo *usb)
+{
+    int i;
+
+    for (i = 0 ; i < usb->nMirrors ; i++) {
+        usbInfo *mirror = usb->mirrors[i];
+        mirror->sessionEnded = 1;
+        if (mirror->deviceLost) {
+            continue;
+        }
+        if (usb->keepOpen) {
+            mirror->resyncNeeded = usbIsOpen(mirror);
+        }
+        else {
+            usbClose(mirror);
+        }
+    }
+}
+
+/************************************* ARBITRATION ***************************/
+/*
+ * Follow the TAP controller through a TMS vector.
+ * Runs of TMS that leave the state unchanged are skipped a word at a time.
+ */
+static int
+tapAdvance(int state, const unsigned char *tms, uint32_t nBits)
+{
+    uint32_t bit = 0;
+
+    while (bit < nBits) {
+        int tms0 = (tms[bit >> 3] >> (bit & 0x7)) & 0x1;
+        if (tapNext[state][tms0] == state) {
+            bit += bitRun(tms, bit, tms0, nBits - bit);
+            continue;
+        }
+        state = tapNext[state][tms0];
+        bit++;
+    }
+    return state;
+}
+
+/*
+ * Queue a client for the device in order of priority then arrival
+ */
+static void
+deviceRequest(usbInfo *usb, clientInfo *client)
+{
+    clientInfo **cpp;
+
+    if (usb->owner == client) {
+        return;
+    }
+    for (cpp = &usb->waitHead ; *cpp ; cpp = &(*cpp)->next) {
+        if ((*cpp)->priority < client->priority) {
+            break;
+        }
+    }
+    client->next = *cpp;
+    *cpp = client;
+    client->waiting = 1;
+}
+
+/*
+ * Hand an idle device to the first waiting client
+ */
+static int
+deviceGrant(usbInfo *usb)
+{
+    clientInfo *client = usb->waitHead;
+
+    if ((usb->owner != NULL) || (client == NULL)) {
+        return 0;
+    }
+    usb->waitHead = client->next;
+    client->waiting = 0;
+    usb->owner = client;
+    client->chunkCount -= usb->chunkCount;
+    client->runtCount -= usb->runtCount;
+    return 1;
+}
+
+/*
+ * Give up the device unless the TAP is part way through a scan
+ */
+static void
+deviceRelease(usbInfo *usb, clientInfo *client, int force)
+{
+    if ((usb->owner == client)
+     && (force
+      || (usb->tapState == TAP_RESET) || (usb->tapState == TAP_IDLE))) {
+        usb->owner = NULL;
+        client->chunkCount += usb->chunkCount;
+        client->runtCount += usb->runtCount;
+    }
+}
+
+/*
+ * Remove a departing client from the queue or release the device
+ */
+static void
+deviceForget(usbInfo *usb, clientInfo *client)
+{
+    clientInfo **cpp;
+
+    for (cpp = &usb->waitHead ; *cpp ; cpp = &(*cpp)->next) {
+        if (*cpp == client) {
+            *cpp = client->next;
+            break;
+        }
+    }
+    client->waiting = 0;
+    deviceRelease(usb, client, 1);
+}
+
+/*
+ * Open or resynchronize the device and set the
+ * client's clock speed if necessary
+ */
+static int
+deviceReady(usbInfo *usb, clientInfo *client)
+{
+    if (usb->resyncNeeded) {
+        usb->resyncNeeded = 0;
+        if (!ftdiResync(usb)) {
+            fprintf(stderr, "Device out of step -- reinitializing.\n");
+            if (!ftdiInit(usb)) {
+                return 0;
+            }
+        }
+    }
+    if (usb->deviceLost) {
+        fprintf(stderr, "JTAG device unavailable.\n");
+        return 0;
+    }
+    if (!usbIsOpen(usb)
+     && !((usb->device != NULL) && attachDevice(usb, usb->device))) {
+        if (usb->hotplug) {
+            fprintf(stderr, "JTAG device not attached.\n");
+            return 0;
+        }
+        if (!connectUSB(usb)) {
+            return 0;
+        }
+    }
+    if (client->frequency && (client->frequency != usb->currentFrequency)
+     && !ftdiSetClockSpeed(usb, client->frequency)) {
+        return 0;
+    }
+    broadcastReady(usb);
+    return 1;
+}
+
+/*
+ * Slide the TDI window, which follows the TMS vector in the input
+ * buffer, so it starts at byte 'keep' of the TDI vector.
+ */
+static void
+slideTDI(clientInfo *client, uint32_t tdiPos, uint32_t keep)
+{
+    uint32_t drop = keep - client->tdiBase;
+
+    if (drop) {
+        if (client->usb->traceFd >= 0) {
+            xvcShift *xs = &client->batch[0];
+            traceWrite(client->usb, xs->traceOffset + ((xs->nBits + 7) / 8)
+                           + client->tdiBase, client->inBuf + tdiPos, drop);
+        }
+        client->inCount -= drop;
+        memmove(client->inBuf + tdiPos, client->inBuf + tdiPos + drop,
+                                                   client->inCount - tdiPos);
+        client->tdiBase = keep;
+    }
+}
+
+/*
+ * Check that the TDI for the next chunk has arrived.
+ * A batch of more than one shift is only formed from complete commands.
+ */
+static int
+shiftInputReady(usbInfo *usb, clientInfo *client)
+{
+    xvcShift *xs = &client->batch[0];
+    uint32_t nBytes = (xs->nBits + 7) / 8;
+    uint32_t keep = client->iBit / 8;
+    uint32_t need;
+
+    if (client->batchCount != 1) {
+        return 1;
+    }
+    if (usb->chunksRetired != usb->chunksSubmitted) {
+        keep = usb->chunks[usb->chunksRetired % USB_XFER_DEPTH].tdiStart;
+    }
+    slideTDI(client, xs->tdiPos, keep);
+    need = nBytes - (client->iBit / 8);
+    if (need > (uint32_t)usb->bulkOutRequestSize + 1) {
+        need = usb->bulkOutRequestSize + 1;
+    }
+    need += (client->iBit / 8) - client->tdiBase;
+    if ((client->inCount - xs->tdiPos) >= need) {
+        return 1;
+    }
+    if (client->eof) {
+        badEOF();
+        client->dead = 1;
+    }
+    return 0;
+}
+
+/*
+ * Send completed TDO bytes to the client.
+ * The TDO window holds the replies to the batched shifts back to back.
+ */
+static int
+sendTDO(usbInfo *usb, clientInfo *client, int nBytes)
+{
+    const unsigned char *tdo = usb->tdoBuf;
+
+    while (nBytes) {
+        xvcShift *xs = &client->batch[client->sendIndex];
+        uint32_t shiftBytes = (xs->nBits + 7) / 8;
+        uint32_t n = shiftBytes - client->sendByte;
+        uint32_t i;
+        if (n > (uint32_t)nBytes) {
+            n = nBytes;
+        }
+        if (usb->loopback) {
+            const unsigned char *tdi = client->inBuf + xs->tdiPos
+                                          + client->sendByte - client->tdiBase;
+            for (i = 0 ; i < n ; i++) {
+                int mask = 0xFF;
+                if (((client->sendByte + i) == (shiftBytes - 1))
+                 && (xs->nBits % 8)) {
+                    mask = (1 << (xs->nBits % 8)) - 1;
+                }
+                if ((tdi[i] ^ tdo[i]) & mask) {
+                    printf("Loopback failed.\n");
+                    break;
+                }
+            }
+        }
+        if (usb->traceFd >= 0) {
+            traceWrite(usb, xs->traceOffset + (2 * shiftBytes)
+                                                  + client->sendByte, tdo, n);
+        }
+        for (i = 0 ; (i < n) && ((client->sendByte + i) < SHOWBUF_LIMIT) ; i++) {
+            usb->tdoPreview[client->sendByte + i] = tdo[i];
+        }
+        tdo += n;
+        nBytes -= n;
+        client->sendByte += n;
+        if (client->sendByte == shiftBytes) {
+            if (usb->showXVC) {
+                showBuf("TDO", usb->tdoPreview, shiftBytes);
+            }
+            client->sendIndex++;
+            client->sendByte = 0;
+        }
+    }
+    return reply(client, usb->tdoBuf, tdo - usb->tdoBuf);
+}
+
+/*
+ * Start the batched shifts
+ */
+static void
+shiftStart(usbInfo *usb, clientInfo *client)
+{
+    int i;
+
+    client->jobIndex = 0;
+    client->iBit = 0;
+    client->tdoBit = 0;
+    client->firstChunk = 1;
+    client->jobStatus = 1;
+    client->tdiBase = 0;
+    client->sendIndex = 0;
+    client->sendByte = 0;
+    usb->busyStart = eventClock(usb);
+    usb->runtMark = usb->runtCount;
+    if (usb->showXVC) {
+        for (i = 0 ; i < client->batchCount ; i++) {
+            xvcShift *xs = &client->batch[i];
+            uint32_t nBytes = (xs->nBits + 7) / 8;
+            printf("shift:%d\n", (int)xs->nBits);
+            showBuf("TMS", client->inBuf + xs->tmsPos, nBytes);
+            showBuf("TDI", client->inBuf + xs->tdiPos, nBytes);
+        }
+    }
+    if (usb->traceFd >= 0) {
+        for (i = 0 ; i < client->batchCount ; i++) {
+            xvcShift *xs = &client->batch[i];
+            uint32_t nBytes = (xs->nBits + 7) / 8;
+            xs->traceOffset = traceRecord(usb, client, TRACE_SHIFT,
+                          xs->time - usb->traceStart, xs->nBits, 0, nBytes);
+            traceWrite(usb, xs->traceOffset, client->inBuf + xs->tmsPos,
+                                                                       nBytes);
+        }
+    }
+}
+
+/*
+ * Shift the batched vectors through the JTAG chain.
+ * The vectors are encoded back to back so that a run of small shifts
+ * shares USB transfers.  A marker after each vector's final bits
+ * pads its TDO to a byte boundary so the TDO window fills with the
+ * replies in the order the client expects.
+ * A batch of one may be larger than the input buffer window in which
+ * case TDI is taken from the client and TDO returned to the client
+ * as the shift proceeds.
+ * Keep several chunks in flight so that the next chunk is encoded
+ * and queued while the reply to the previous one is on its way back.
+ * Make as much progress as possible without waiting for the client
+ * or the device.  Return 0 once the batch is complete.
+ */
+static int
+shiftStep(usbInfo *usb, clientInfo *client)
+{
+    int progress = 1;
+    usbChunk *chunk;
+
+    while (progress) {
+        progress = 0;
+        if (usb->deviceLost) {
+            client->dead = 1;
+        }
+        if (client->dead) {
+            client->jobStatus = 0;
+            client->jobIndex = client->batchCount;
+        }
+        if ((client->jobIndex != client->batchCount)
+         && !usb->draining
+         && ((usb->chunksSubmitted - usb->chunksRetired) < USB_XFER_DEPTH)
+         && shiftInputReady(usb, client)) {
+            xvcShift *xs = &client->batch[client->jobIndex];
+            xvcShift *batchEnd = &client->batch[client->batchCount];
+            uint32_t iBit = client->iBit;
+            uint64_t start = eventClock(usb);
+
+            chunk = &usb->chunks[usb->chunksSubmitted % USB_XFER_DEPTH];
+            chunk->txCount = 0;
+            chunk->rxBytesWanted = 0;
+            chunk->rxBitcountIndex = 0;
+            chunk->tdiStart = iBit / 8;
+            usb->chunkCount++;
+            if (client->firstChunk) {
+                client->firstChunk = 0;
+                if (usb->loopback) {
+                    cmdByte(chunk, FTDI_ENABLE_LOOPBACK);
+                }
+            }
+            do {
+                iBit += encodeChunk(usb, chunk,
+                        client->inBuf + xs->tmsPos + (iBit / 8),
+                        client->inBuf + xs->tdiPos + (iBit / 8) - client->tdiBase,
+                        iBit % 8, xs->nBits - iBit);
+                if (iBit != xs->nBits) {
+                    break;
+                }
+                chunk->rxBitcounts[chunk->rxBitcountIndex++] = 0;
+                iBit = 0;
+                xs++;
+            } while ((xs != batchEnd)
+                  && (chunk->txCount < (usb->bulkOutRequestSize - 6)));
+            client->iBit = iBit;
+            client->jobIndex = xs - client->batch;
+            cmdByte(chunk, FTDI_SEND_IMMEDIATE);
+            stageObserve(usb, STAGE_ENCODE, 0, start);
+            usbSubmitChunk(usb, chunk);
+            broadcastChunk(usb, chunk);
+            progress = 1;
+        }
+
         /*
-         * Shift
+         * Retire the oldest chunk once its reply is in and
+         * there's room to pass on its TDO
          */
-        if (!usbWriteData(usb, usb->ioBuf, usb->txCount)
-         || !usbReadData(usb, usb->rxBuf, rxBytesWanted)) {
+        chunk = &usb->chunks[usb->chunksRetired % USB_XFER_DEPTH];
+        if ((usb->chunksRetired != usb->chunksSubmitted)
+         && !chunk->writeBusy
+         && (chunk->rxCount == chunk->rxBytesWanted)
+         && broadcastReceived(usb)
+         && (!client->jobStatus || (replyRoom(client) > (2 * USB_BUFSIZE)))) {
+            int tdoBit = client->tdoBit;
+            uint64_t start = eventClock(usb);
+            if (usb->showUSB) {
+                showBuf("Rx", chunk->rxBuf, chunk->rxBytesWanted);
+            }
+            decodeChunk(usb, chunk, &tdoBit);
+            broadcastRetire(usb, chunk);
+            stageObserve(usb, STAGE_DECODE, 0, start);
+            usb->chunksRetired++;
+
+            /*
+             * Pass on completed bytes and keep any partial byte
+             */
+            if (client->jobStatus && (tdoBit >= 8)) {
+                client->jobStatus = sendTDO(usb, client, tdoBit / 8);
+            }
+            usb->tdoBuf[0] = usb->tdoBuf[tdoBit / 8];
+            client->tdoBit = tdoBit % 8;
+            progress = 1;
+        }
+    }
+    if (usb->deviceLost && !usbAbandon(usb)) {
+        return 1;
+    }
+    if ((client->jobIndex != client->batchCount)
+     || (usb->chunksRetired != usb->chunksSubmitted)) {
+        return 1;
+    }
+    usbDrain(usb);
+    broadcastFinish(usb, usb->deviceLost);
+    return 0;
+}
+
+/*
+ * Wind up the batched shifts and keep track of
+ * the state in which they leave the TAP
+ */
+static void
+shiftFinish(usbInfo *usb, clientInfo *client)
+{
+    xvcShift *xs;
+    int i;
+
+    for (i = 0 ; i < client->batchCount ; i++) {
+        xs = &client->batch[i];
+        if (xs->nBits > (unsigned int)usb->largestShiftRequest) {
+            usb->largestShiftRequest = xs->nBits;
+        }
+        usb->tapState = tapAdvance(usb->tapState,
+                                       client->inBuf + xs->tmsPos, xs->nBits);
+        if ((usb->traceFd >= 0) && !client->dead) {
+            uint32_t nBytes = (xs->nBits + 7) / 8;
+            traceWrite(usb, xs->traceOffset + nBytes + client->tdiBase,
+                       client->inBuf + xs->tdiPos, nBytes - client->tdiBase);
+        }
+        if (usb->metricsFlag) {
+            usb->metrics.shifts++;
+            usb->metrics.bits += xs->nBits;
+        }
+        if (timeline) {
+            timelineSpan(usb, TIMELINE_SESSION + client->session, "shift",
+                                             xs->time, "bits", (long)xs->nBits);
+        }
+    }
+    if (usb->metricsFlag) {
+        uint64_t busy = nanoseconds() - usb->busyStart;
+        usb->metrics.busyTime += busy;
+        usb->metrics.tckCapacity += busy * 1e-9 * usb->actualFrequency;
+        usb->metricsDirty = 1;
+    }
+    if ((usb->runtCount != usb->runtMark)
+     && (usb->latencyTimer < FTDI_LATENCY_MAX)) {
+        usb->raiseLatency = 1;
+    }
+    xs = &client->batch[client->batchCount - 1];
+    client->inPos = xs->tdiPos + ((xs->nBits + 7) / 8) - client->tdiBase;
+    client->deviceOp = XVC_OP_NONE;
+    client->opStarted = 0;
+    deviceRelease(usb, client, client->dead);
+}
+
+/*
+ * Queue a shift command whose vectors are at inPos
+ */
+static void
+batchShift(clientInfo *client, uint32_t nBits)
+{
+    xvcShift *xs = &client->batch[client->batchCount++];
+    uint32_t nBytes = (nBits + 7) / 8;
+
+    xs->nBits = nBits;
+    xs->tmsPos = client->inPos;
+    xs->tdiPos = client->inPos + nBytes;
+    client->inPos += 2 * nBytes;
+    xs->time = eventClock(client->usb);
+    client->bitCount += nBits;
+    client->shiftCount++;
+}
+
+/*
+ * Check that a vector size is acceptable.
+ * Return 1 if it is, 0 if the client must be dropped.
+ */
+static int
+checkShiftSize(usbInfo *usb, uint32_t nBytes)
+{
+    if (nBytes > usb->xvcBufsize) {
+        fprintf(stderr, "Client requested %u, max is %u\n", nBytes,
+                                                               usb->xvcBufsize);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Queue a client packet set of bits once its TMS vector has arrived.
+ * If the TDI vector is at hand, too, gather any complete shift
+ * commands that follow into the same batch.
+ */
+static void
+shift(usbInfo *usb, clientInfo *client)
+{
+    uint32_t nBits, nBytes;
+
+    nBits = get32(client->inBuf + client->inPos + 6);
+    nBytes = (nBits / 8) + ((nBits % 8) != 0);
+    if (!checkShiftSize(usb, nBytes)) {
+        client->dead = 1;
+        return;
+    }
+    if ((client->inPos + 10 + nBytes + XVC_TDI_WINDOW) > client->inCapacity) {
+        clientCompact(client);
+    }
+    if ((client->inCount - client->inPos) < (10 + nBytes)) {
+        return;
+    }
+    client->inPos += 10;
+    client->batchCount = 0;
+    if ((client->inCount - client->inPos) >= (2 * nBytes)) {
+        batchShift(client, nBits);
+        while ((client->batchCount < XVC_BATCH_MAX)
+            && ((client->inCount - client->inPos) >= 10)
+            && (memcmp(client->inBuf + client->inPos, "shift:", 6) == 0)) {
+            nBits = get32(client->inBuf + client->inPos + 6);
+            nBytes = (nBits / 8) + ((nBits % 8) != 0);
+            if (!checkShiftSize(usb, nBytes)
+             || ((client->inCount - client->inPos - 10) < (2 * nBytes))) {
+                break;
+            }
+            client->inPos += 10;
+            batchShift(client, nBits);
+        }
+    }
+    else {
+        batchShift(client, nBits);
+    }
+    client->deviceOp = XVC_OP_SHIFT;
+    deviceRequest(usb, client);
+}
+
+/*
+ * Check for a known string.
+ * Return 1 if it's there, 0 if more input is needed, -1 if it isn't.
+ */
+static int
+matchInput(clientInfo *client, const char *str)
+{
+    uint32_t avail = client->inCount - client->inPos;
+    const unsigned char *cp = client->inBuf + client->inPos;
+    uint32_t i;
+
+    for (i = 0 ; str[i] ; i++) {
+        if (i == avail) {
+            return 0;
+        }
+        if (cp[i] != (unsigned char)str[i]) {
+            fprintf(stderr, "Expected 0x%2x, got 0x%2x\n", str[i], cp[i]);
+            client->dead = 1;
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Return a 32 bit value
+ */
+static int
+reply32(clientInfo *client, uint32_t value)
+{
+    int i;
+    unsigned char cbuf[4];
+
+    for (i = 0 ; i < 4 ; i++) {
+        cbuf[i] = value;
+        value >>= 8;
+    }
+    return reply(client, cbuf, 4);
+}
+
+/*
+ * Process the commands that have arrived.
+ * Stop at a command that needs the device or at one that
+ * hasn't arrived in full.
+ */
+static void
+processCommands(clientInfo *client, usbInfo *usb)
+{
+    int c;
+
+    while ((client->deviceOp == XVC_OP_NONE) && !client->dead
+        && (client->inPos != client->inCount)
+        && (replyRoom(client) >= XVC_REPLY_MAXLEN)) {
+        switch(c = client->inBuf[client->inPos]) {
+        case 's':
+            if ((client->inCount - client->inPos) < 2) return;
+            switch(c = client->inBuf[client->inPos + 1]) {
+            case 'e':
+                {
+                uint32_t num;
+                int frequency;
+                if (matchInput(client, "settck:") <= 0) return;
+                if ((client->inCount - client->inPos) < 11) return;
+                num = get32(client->inBuf + client->inPos + 7);
+                client->inPos += 11;
+                if (num == 0) {
+                    /*
+                     * Leave the clock alone and report the current period
+                     */
+                    if (usb->showXVC) {
+                        printf("settck:0  (ignored)\n");
+                    }
+                    if ((client->tckPeriod == 0) && usb->currentFrequency) {
+                        client->tckPeriod = 1000000000 /
+                                                      usb->currentFrequency;
+                    }
+                }
+                else {
+                    frequency = 1000000000 / num;
+                    if (usb->showXVC) {
+                        printf("settck:%d  (%d Hz)\n", (int)num, frequency);
+                    }
+                    client->frequency = frequency;
+                    client->tckPeriod = num;
+                }
+                client->tckTime = eventClock(usb);
+                client->deviceOp = XVC_OP_SETTCK;
+                deviceRequest(usb, client);
+                }
+                break;
+
+            case 'h':
+                if (matchInput(client, "shift:") <= 0) return;
+                if ((client->inCount - client->inPos) < 10) return;
+                shift(usb, client);
+                if (client->deviceOp == XVC_OP_NONE) return;
+                break;
+
+            default:
+                if (usb->showXVC) {
+                    printf("Bad second char 0x%02x\n", c);
+                }
+                badChar();
+                client->dead = 1;
+                return;
+            }
+            break;
+
+        case 'g':
+            {
+            char cBuf[40];
+            int len;
+            if (matchInput(client, "getinfo:") <= 0) return;
+            client->inPos += 8;
+            if (usb->showXVC) {
+                printf("getinfo:\n");
+            }
+            if (timeline) {
+                timelineInstant(usb, TIMELINE_SESSION + client->session,
+                                                                   "getinfo");
+            }
+            len = sprintf(cBuf, "xvcServer_v1.0:%u\n", usb->xvcBufsize);
+            reply(client, (unsigned char *)cBuf, len);
+            }
+            break;
+
+        default:
+            if (usb->showXVC) {
+                printf("Bad initial char 0x%02x\n", c);
+            }
+            badChar();
+            client->dead = 1;
+            return;
+        }
+    }
+}
+
+/*
+ * Carry out the device owner's pending operation.
+ * Return 1 if anything happened.
+ */
+static int
+runDeviceOp(usbInfo *usb, clientInfo *client)
+{
+    unsigned int submitted = usb->chunksSubmitted;
+    unsigned int retired = usb->chunksRetired;
+
+    if (!client->opStarted) {
+        if (usb->draining || broadcastBusy(usb)) {
+            return 0;
+        }
+        if (!deviceReady(usb, client)) {
+            client->dead = 1;
+            client->deviceOp = XVC_OP_NONE;
+            deviceRelease(usb, client, 1);
+            return 1;
+        }
+        if (client->deviceOp == XVC_OP_SETTCK) {
+            if (usb->traceFd >= 0) {
+                traceRecord(usb, client, TRACE_SETTCK,
+                                   client->tckTime - usb->traceStart,
+                                   client->tckPeriod, client->tckPeriod, 0);
+            }
+            if (timeline) {
+                timelineSpan(usb, TIMELINE_SESSION + client->session, "settck",
+                          client->tckTime, "period", (long)client->tckPeriod);
+            }
+            reply32(client, client->tckPeriod);
+            client->deviceOp = XVC_OP_NONE;
+            deviceRelease(usb, client, 0);
+            return 1;
+        }
+        if (usb->raiseLatency) {
+            int latency = usb->latencyTimer * 2;
+            ftdiSetLatency(usb, (latency < FTDI_LATENCY_MAX) ? latency :
+                                                             FTDI_LATENCY_MAX);
+        }
+        client->opStarted = 1;
+        shiftStart(usb, client);
+    }
+    if (!shiftStep(usb, client)) {
+        shiftFinish(usb, client);
+        return 1;
+    }
+    return (usb->chunksSubmitted != submitted)
+        || (usb->chunksRetired != retired);
+}
+
+/*
+ * Keep going until everyone is waiting for the network or the device.
+ * Sending replies may make room for more TDO.
+ */
+static void
+serviceClients(usbInfo *usb)
+{
+    int progress = 1;
+    int i;
+
+    while (progress) {
+        progress = 0;
+        for (i = 0 ; i < usb->clientCount ; i++) {
+            clientInfo *client = usb->clients[i];
+            uint32_t inPos = client->inPos;
+            int outCount = client->outCount;
+            processCommands(client, usb);
+            clientFlush(client);
+            if ((client->inPos != inPos) || (client->outCount != outCount)) {
+                progress = 1;
+            }
+        }
+        if (deviceGrant(usb)) {
+            progress = 1;
+        }
+        if ((usb->owner != NULL) && (usb->owner->deviceOp != XVC_OP_NONE)) {
+            progress |= runDeviceOp(usb, usb->owner);
+        }
+    }
+}
+
+/*
+ * Parse an IPv4 address, an IPv6 address with or without brackets,
+ * or unix:path naming a Unix-domain socket.  Any %d in the path is
+ * replaced by the port number so each device in a fleet gets its own.
+ */
+static socklen_t
+socketAddressParse(socketAddress *addr, const char *str, int port)
+{
+    char address[INET6_ADDRSTRLEN];
+    size_t len = strlen(str);
+
+    memset(addr, '\0', sizeof *addr);
+    if (strncmp(str, "unix:", 5) == 0) {
+        const char *path = str + 5, *cp = strstr(path, "%d");
+        int n;
+        if (cp == NULL) {
+            n = snprintf(addr->un.sun_path, sizeof addr->un.sun_path, "%s",
+                                                                        path);
+        }
+        else {
+            n = snprintf(addr->un.sun_path, sizeof addr->un.sun_path,
+                                "%.*s%d%s", (int)(cp - path), path, port, cp + 2);
+        }
+        if ((*path == '\0') || (n >= (int)sizeof addr->un.sun_path)) {
+            return 0;
+        }
+        addr->un.sun_family = AF_UNIX;
+        return sizeof addr->un;
+    }
+    if (inet_pton(AF_INET, str, &addr->in.sin_addr) == 1) {
+        addr->in.sin_family = AF_INET;
+        addr->in.sin_port = htons(port);
+        return sizeof addr->in;
+    }
+    if ((len > 2) && (str[0] == '[') && (str[len-1] == ']')) {
+        str++;
+        len -= 2;
+    }
+    if (len >= sizeof address) {
+        return 0;
+    }
+    memcpy(address, str, len);
+    address[len] = '\0';
+    if (inet_pton(AF_INET6, address, &addr->in6.sin6_addr) == 1) {
+        addr->in6.sin6_family = AF_INET6;
+        addr->in6.sin6_port = htons(port);
+        return sizeof addr->in6;
+    }
+    return 0;
+}
+
+static int
+createSocket(const char *interface, int port)
+{
+    int s, o;
+    socketAddress myAddr;
+    socklen_t addrlen;
+    struct stat st;
+
+    if ((addrlen = socketAddressParse(&myAddr, interface, port)) == 0) {
+        fprintf(stderr, "Bad address \"%s\"\n", interface);
+        return -1;
+    }
+    s = socket (myAddr.sa.sa_family, SOCK_STREAM, 0);
+    if (s < 0) {
+        return -1;
+    }
+    o = 1;
+    if (myAddr.sa.sa_family == AF_UNIX) {
+        /* Remove the socket left behind by an earlier server */
+        if ((stat(myAddr.un.sun_path, &st) == 0) && S_ISSOCK(st.st_mode)) {
+            unlink(myAddr.un.sun_path);
+        }
+    }
+    else if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &o, sizeof o) < 0) {
+        return -1;
+    }
+    /* Leave IPv4 to its own listener so both :: and 0.0.0.0 can be given */
+    if ((myAddr.sa.sa_family == AF_INET6)
+     && (setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &o, sizeof o) < 0)) {
+        return -1;
+    }
+    if (bind (s, &myAddr.sa, addrlen) < 0) {
+        fprintf(stderr, "Bind(%s) failed: %s\n", interface, strerror (errno));
+        return -1;
+    }
+    if (listen (s, XVC_CLIENT_LIMIT) < 0) {
+        fprintf(stderr, "Listen() failed: %s\n", strerror (errno));
+        return -1;
+    }
+    return s;
+}
+
+/*
+ * Listen on every -a address.  Return the number of sockets or 0 on failure.
+ */
+static int
+createListeners(const char * const *addresses, int nAddresses, int port,
+                                                                   int *fds)
+{
+    int i;
+
+    for (i = 0 ; i < nAddresses ; i++) {
+        if ((fds[i] = createSocket(addresses[i], port)) < 0) {
+            while (i--) close(fds[i]);
+            return 0;
+        }
+    }
+    return nAddresses;
+}
+
+/************************************* METRICS ***************************/
+/*
+ * Cumulative per-device counters and stage latency histograms served
+ * over HTTP in the Prometheus text exposition format.  Each device
+ * thread publishes a snapshot of its counters at most every
+ * METRICS_INTERVAL milliseconds so that the metrics server never
+ * touches state the device thread is using.
+ */
+typedef struct metricsText {
+    char                  *buf;
+    size_t                 count;
+    size_t                 capacity;
+} metricsText;
+
+static pthread_mutex_t metricsLock = PTHREAD_MUTEX_INITIALIZER;
+static metricsSlot *metricsSlots;
+
+/*
+ * Add a device to those shown by the metrics server
+ */
+static void
+metricsRegister(usbInfo *usb)
+{
+    metricsSlot *slot, **sp;
+
+    if ((slot = calloc(1, sizeof *slot)) == NULL) {
+        fprintf(stderr, "Can't allocate metrics.\n");
+        exit(1);
+    }
+    slot->port = usb->listenPort;
+    pthread_mutex_init(&slot->lock, NULL);
+    pthread_mutex_lock(&metricsLock);
+    for (sp = &metricsSlots ; *sp != NULL ; sp = &(*sp)->next) {
+        continue;
+    }
+    *sp = slot;
+    pthread_mutex_unlock(&metricsLock);
+    usb->metricsSlot = slot;
+    usb->metricsDirty = 1;
+}
+
+/*
+ * Publish the device's counters if they have changed and the last
+ * snapshot is old enough.  Return the number of milliseconds until
+ * a pending snapshot is due, or -1 if there is none.
+ */
+static int
+metricsPublish(usbInfo *usb)
+{
+    deviceMetrics *m = &usb->metrics;
+    uint64_t now, due;
+
+    if (usb->metricsSlot == NULL) {
+        return -1;
+    }
+    if ((m->chunks != usb->chunkCount)
+     || (m->runts != usb->runtCount)
+     || (m->clients != usb->clientCount)
+     || (m->frequency != usb->actualFrequency)
+     || (strcmp(m->serial, usb->deviceSerialString) != 0)) {
+        m->chunks = usb->chunkCount;
+        m->runts = usb->runtCount;
+        m->clients = usb->clientCount;
+        m->frequency = usb->actualFrequency;
+        strcpy(m->serial, usb->deviceSerialString);
+        usb->metricsDirty = 1;
+    }
+    if (!usb->metricsDirty) {
+        return -1;
+    }
+    now = nanoseconds();
+    due = usb->metricsTime + ((uint64_t)METRICS_INTERVAL * 1000000);
+    if (now < due) {
+        return (due - now + 999999) / 1000000;
+    }
+    pthread_mutex_lock(&usb->metricsSlot->lock);
+    usb->metricsSlot->shown = *m;
+    pthread_mutex_unlock(&usb->metricsSlot->lock);
+    usb->metricsTime = now;
+    usb->metricsDirty = 0;
+    return -1;
+}
+
+static void
+metricsPrintf(metricsText *t, const char *fmt, ...)
+{
+    va_list args;
+    int n;
+
+    for (;;) {
+        va_start(args, fmt);
+        n = vsnprintf(t->buf + t->count, t->capacity - t->count, fmt, args);
+        va_end(args);
+        if ((n >= 0) && ((size_t)n < (t->capacity - t->count))) {
+            t->count += n;
+            return;
+        }
+        t->capacity = (t->capacity * 2) + n + 1;
+        if ((t->buf = realloc(t->buf, t->capacity)) == NULL) {
+            fprintf(stderr, "Can't allocate metrics.\n");
+            exit(1);
+        }
+    }
+}
+
+/*
+ * Device labels with the serial number escaped as Prometheus requires
+ */
+static void
+metricsLabels(char *dest, const metricsSlot *slot)
+{
+    const char *cp;
+
+    dest += sprintf(dest, "serial=\"");
+    for (cp = slot->shown.serial ; *cp ; cp++) {
+        if ((*cp == '\\') || (*cp == '"')) {
+            *dest++ = '\\';
+            *dest++ = *cp;
+        }
+        else if (*cp == '\n') {
+            *dest++ = '\\';
+            *dest++ = 'n';
+        }
+        else {
+            *dest++ = *cp;
+        }
+    }
+    sprintf(dest, "\",port=\"%d\"", slot->port);
+}
+
+static void
+metricsFamily(metricsText *t, const char *name, const char *type,
+                                                         const char *help)
+{
+    metricsPrintf(t, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * Render every device's latest snapshot
+ */
+static void
+metricsFormat(metricsText *t)
+{
+    metricsSlot *slot, *copies;
+    char (*labels)[2 * IDSTRING_CAPACITY + 30];
+    int nSlots = 0, i, j, k;
+
+    pthread_mutex_lock(&metricsLock);
+    for (slot = metricsSlots ; slot != NULL ; slot = slot->next) {
+        nSlots++;
+    }
+    copies = calloc(nSlots + 1, sizeof *copies);
+    labels = calloc(nSlots + 1, sizeof *labels);
+    if ((copies == NULL) || (labels == NULL)) {
+        fprintf(stderr, "Can't allocate metrics.\n");
+        exit(1);
+    }
+    for (slot = metricsSlots, i = 0 ; slot != NULL ; slot = slot->next, i++) {
+        pthread_mutex_lock(&slot->lock);
+        copies[i].port = slot->port;
+        copies[i].shown = slot->shown;
+        pthread_mutex_unlock(&slot->lock);
+        metricsLabels(labels[i], &copies[i]);
+    }
+    pthread_mutex_unlock(&metricsLock);
+
+    metricsFamily(t, "xvc_clients", "gauge", "Connected XVC clients.");
+    for (i = 0 ; i < nSlots ; i++) {
+        metricsPrintf(t, "xvc_clients{%s} %d\n", labels[i],
+                                                    copies[i].shown.clients);
+    }
+    metricsFamily(t, "xvc_shifts_total", "counter", "Shift commands completed.");
+    for (i = 0 ; i < nSlots ; i++) {
+        metricsPrintf(t, "xvc_shifts_total{%s} %" PRIu64 "\n", labels[i],
+                                                    copies[i].shown.shifts);
+    }
+    metricsFamily(t, "xvc_shift_bits_total", "counter",
+                                                "Bits shifted through the TAP.");
+    for (i = 0 ; i < nSlots ; i++) {
+        metricsPrintf(t, "xvc_shift_bits_total{%s} %" PRIu64 "\n", labels[i],
+                                                    copies[i].shown.bits);
+    }
+    metricsFamily(t, "xvc_usb_chunks_total", "counter",
+                                        "Bulk-OUT transfers sent to the FTDI.");
+    for (i = 0 ; i < nSlots ; i++) {
+        metricsPrintf(t, "xvc_usb_chunks_total{%s} %" PRIu64 "\n", labels[i],
+                                                    copies[i].shown.chunks);
+    }
+    metricsFamily(t, "xvc_usb_runt_replies_total", "counter",
+                        "Bulk-IN transfers holding nothing but status bytes.");
+    for (i = 0 ; i < nSlots ; i++) {
+        metricsPrintf(t, "xvc_usb_runt_replies_total{%s} %" PRIu64 "\n",
+                                            labels[i], copies[i].shown.runts);
+    }
+    metricsFamily(t, "xvc_tck_frequency_hertz", "gauge", "Current TCK rate.");
+    for (i = 0 ; i < nSlots ; i++) {
+        metricsPrintf(t, "xvc_tck_frequency_hertz{%s} %u\n", labels[i],
+                                                copies[i].shown.frequency);
+    }
+    metricsFamily(t, "xvc_shift_busy_seconds_total", "counter",
+                        "Time from the start to the end of each shift batch.");
+    for (i = 0 ; i < nSlots ; i++) {
+        metricsPrintf(t, "xvc_shift_busy_seconds_total{%s} %.9f\n", labels[i],
+                                            copies[i].shown.busyTime * 1e-9);
+    }
+    metricsFamily(t, "xvc_tck_capacity_bits_total", "counter",
+                        "TCK cycles available while shifts were under way.");
+    for (i = 0 ; i < nSlots ; i++) {
+        metricsPrintf(t, "xvc_tck_capacity_bits_total{%s} %.0f\n", labels[i],
+                                                copies[i].shown.tckCapacity);
+    }
+    metricsFamily(t, "xvc_tck_utilization_ratio", "gauge",
+                "Shifted bits as a fraction of TCK capacity while busy.");
+    for (i = 0 ; i < nSlots ; i++) {
+        const deviceMetrics *m = &copies[i].shown;
+        metricsPrintf(t, "xvc_tck_utilization_ratio{%s} %.6f\n", labels[i],
+                            (m->tckCapacity > 0) ? m->bits / m->tckCapacity : 0);
+    }
+    metricsFamily(t, "xvc_stage_seconds", "histogram",
+                                        "Time spent in each stage of a shift.");
+    for (i = 0 ; i < nSlots ; i++) {
+        for (j = 0 ; j < STAGE_COUNT ; j++) {
+            const stageHistogram *h = &copies[i].shown.stages[j];
+            uint64_t count = 0;
+            for (k = 0 ; k < METRICS_BUCKETS ; k++) {
+                count += h->counts[k];
+                if (k < (METRICS_BUCKETS - 1)) {
+                    metricsPrintf(t, "xvc_stage_seconds_bucket{%s,stage=\"%s\","
+                                "le=\"%g\"} %" PRIu64 "\n", labels[i],
+                                stageNames[j], stageBounds[k] * 1e-9, count);
+                }
+                else {
+                    metricsPrintf(t, "xvc_stage_seconds_bucket{%s,stage=\"%s\","
+                                "le=\"+Inf\"} %" PRIu64 "\n", labels[i],
+                                stageNames[j], count);
+                }
+            }
+            metricsPrintf(t, "xvc_stage_seconds_sum{%s,stage=\"%s\"} %.9f\n",
+                                    labels[i], stageNames[j], h->sum * 1e-9);
+            metricsPrintf(t, "xvc_stage_seconds_count{%s,stage=\"%s\"} %"
+                            PRIu64 "\n", labels[i], stageNames[j], h->count);
+        }
+    }
+    free(copies);
+    free(labels);
+}
+
+/*
+ * Answer one HTTP request.  Only GET /metrics is served.
+ */
+static void
+metricsServe(int fd)
+{
+    char request[1024];
+    size_t count = 0;
+    metricsText text = { NULL, 0, 0 };
+    metricsText header = { NULL, 0, 0 };
+    const char *status = "200 OK";
+    struct timeval tv = { .tv_sec = 2, .tv_usec = 0 };
+    size_t sent;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+    while (count < (sizeof request - 1)) {
+        ssize_t n = recv(fd, request + count, sizeof request - 1 - count, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (n == 0) {
+            break;
+        }
+        count += n;
+        request[count] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+            break;
+        }
+    }
+    request[count] = '\0';
+    if ((strncmp(request, "GET /metrics", 12) == 0)
+     && ((request[12] == ' ') || (request[12] == '?'))) {
+        metricsFormat(&text);
+    }
+    else {
+        status = "404 Not Found";
+        metricsPrintf(&text, "Not found.\n");
+    }
+    metricsPrintf(&header, "HTTP/1.0 %s\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: %lu\r\n"
+                           "Connection: close\r\n\r\n",
+                           status, (unsigned long)text.count);
+    metricsPrintf(&header, "%.*s", (int)text.count, text.buf);
+    for (sent = 0 ; sent < header.count ; ) {
+        ssize_t n = send(fd, header.buf + sent, header.count - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        sent += n;
+    }
+    free(text.buf);
+    free(header.buf);
+}
+
+static void *
+metricsThread(void *arg)
+{
+    int s = *(int *)arg;
+
+    for (;;) {
+        int fd = accept(s, NULL, NULL);
+        if (fd < 0) {
+            if ((errno == EINTR) || (errno == ECONNABORTED)) continue;
+            fprintf(stderr, "Can't accept metrics connection: %s\n",
+                                                              strerror(errno));
+            return NULL;
+        }
+        metricsServe(fd);
+        close(fd);
+    }
+}
+
+/*
+ * Serve metrics from a thread of their own
+ */
+static void
+metricsStart(const char *bindAddress, int port)
+{
+    static int s;
+    pthread_t thread;
+    int e;
+
+    if ((s = createSocket(bindAddress, port)) < 0) {
+        exit(1);
+    }
+    e = pthread_create(&thread, NULL, metricsThread, &s);
+    if (e != 0) {
+        fprintf(stderr, "Can't create thread: %s\n", strerror(e));
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+/************************************* PLAYER ***************************/
+/*
+ * Play an SVF or XSVF file, or load a raw Xilinx bitstream, without
+ * an XVC client.  Scans whose TDO is not checked use write-only MPSSE
+ * commands and go out in large transfers.  Only checked scans wait for
+ * a reply, which is read back no more than a device FIFO at a time.
+ */
+#define PLAY_BUFSIZE        65536
+#define PLAY_BYTES_LIMIT    (PLAY_BUFSIZE - 16)
+#define PLAY_CLOCKS_LIMIT   (65536 * 8)
+
+/* Xilinx 7-series/UltraScale configuration instructions */
+#define XILINX_IR_LENGTH    6
+#define XILINX_CFG_IN       0x05
+#define XILINX_JPROGRAM     0x0B
+#define XILINX_JSTART       0x0C
+#define XILINX_BYPASS       0x3F
+#define XILINX_IR_INIT      0x10
+#define XILINX_IR_DONE      0x20
+
+typedef struct player {
+    usbInfo               *usb;
+    const char            *path;
+    int                    line;
+    int                    state;
+    int                    endIR;
+    int                    endDR;
+    int                    runState;
+    int                    runEnd;
+    int                    cmdCount;
+    int                    rxWanted;
+    uint64_t               bitCount;
+    unsigned char          cmd[PLAY_BUFSIZE];
+    unsigned char          rx[USB_BUFSIZE];
+} player;
+
+static const char *tapStateNames[] = {
+    "RESET", "IDLE",
+    "DRSELECT", "DRCAPTURE", "DRSHIFT", "DREXIT1",
+    "DRPAUSE", "DREXIT2", "DRUPDATE",
+    "IRSELECT", "IRCAPTURE", "IRSHIFT", "IREXIT1",
+    "IRPAUSE", "IREXIT2", "IRUPDATE"
+};
+
+/*
+ * Send the queued commands and collect any reply they produce
+ */
+static int
+playFlush(player *p)
+{
+    if (p->rxWanted) {
+        p->cmd[p->cmdCount++] = FTDI_SEND_IMMEDIATE;
+    }
+    if (p->cmdCount && !usbWriteData(p->usb, p->cmd, p->cmdCount)) {
+        return 0;
+    }
+    p->cmdCount = 0;
+    if (p->rxWanted && !ftdiRead(p->usb, p->rx, p->rxWanted)) {
+        fprintf(stderr, "%s: No reply from JTAG adapter.\n", p->path);
+        return 0;
+    }
+    p->rxWanted = 0;
+    return 1;
+}
+
+static unsigned char *
+playReserve(player *p, int n)
+{
+    unsigned char *cp;
+
+    if (((p->cmdCount + n) > PLAY_BUFSIZE - 1) && !playFlush(p)) {
+        return NULL;
+    }
+    cp = p->cmd + p->cmdCount;
+    p->cmdCount += n;
+    return cp;
+}
+
+/*
+ * Clock TMS bits out, least significant first.  As in the XVC encoder
+ * the final bit is duplicated so the TMS pin holds its value afterwards.
+ */
+static int
+playTMS(player *p, unsigned int tms, int nBits)
+{
+    while (nBits > 0) {
+        int n = nBits > 6 ? 6 : nBits;
+        unsigned char *cp = playReserve(p, 3);
+        if (cp == NULL) return 0;
+        *cp++ = FTDI_MPSSE_WRITE_TMS_BITS;
+        *cp++ = n - 1;
+        *cp = (tms & ((1 << n) - 1)) | (((tms >> (n - 1)) & 0x1) << n);
+        tms >>= n;
+        nBits -= n;
+    }
+    return 1;
+}
+
+/*
+ * Move to a state along the shortest path.  Asking for Test-Logic-Reset
+ * always clocks five TMS ones whatever the current state.
+ */
+static int
+playGoto(player *p, int state)
+{
+    int prev[TAP_STATE_COUNT], queue[TAP_STATE_COUNT];
+    int head = 0, tail = 0, s, nBits = 0;
+    unsigned int tms = 0;
+
+    if (state == TAP_RESET) {
+        p->state = TAP_RESET;
+        return playTMS(p, 0x1F, 5);
+    }
+    for (s = 0 ; s < TAP_STATE_COUNT ; s++) prev[s] = -1;
+    prev[p->state] = p->state;
+    queue[tail++] = p->state;
+    while ((head < tail) && (prev[state] < 0)) {
+        int i, from = queue[head++];
+        for (i = 0 ; i < 2 ; i++) {
+            int to = tapNext[from][i];
+            if (prev[to] < 0) {
+                prev[to] = from;
+                queue[tail++] = to;
+            }
+        }
+    }
+    for (s = state ; s != p->state ; s = prev[s]) {
+        tms = (tms << 1) | (tapNext[prev[s]][1] == s);
+        nBits++;
+    }
+    p->state = state;
+    return playTMS(p, tms, nBits);
+}
+
+/*
+ * Clock TCK in the current state without changing TMS
+ */
+static int
+playClocks(player *p, uint64_t nClocks)
+{
+    while (nClocks >= 8) {
+        uint64_t n = nClocks / 8;
+        unsigned char *cp = playReserve(p, 3);
+        if (cp == NULL) return 0;
+        if (n > (PLAY_CLOCKS_LIMIT / 8)) n = PLAY_CLOCKS_LIMIT / 8;
+        *cp++ = FTDI_CLOCK_BYTES;
+        *cp++ = (n - 1);
+        *cp = (n - 1) >> 8;
+        nClocks -= n * 8;
+    }
+    if (nClocks) {
+        unsigned char *cp = playReserve(p, 2);
+        if (cp == NULL) return 0;
+        *cp++ = FTDI_CLOCK_BITS;
+        *cp = nClocks - 1;
+    }
+    return 1;
+}
+
+/*
+ * Wait in the current state for at least the given time
+ */
+static int
+playWait(player *p, double seconds)
+{
+    return playClocks(p, (uint64_t)(seconds * p->usb->actualFrequency) + 1);
+}
+
+/*
+ * Scan nBits through the instruction or data register then move to
+ * endState.  An endState of the shift state itself leaves the TAP
+ * there so a later scan can carry on where this one stopped.
+ * TDO is captured only if asked for.
+ */
+static int
+playScan(player *p, int shiftState, const unsigned char *tdi,
+                            unsigned char *tdo, uint32_t nBits, int endState)
+{
+    int stay = (endState == shiftState);
+    uint32_t nData = stay ? nBits : nBits - 1;
+    uint32_t bit = 0;
+    int nRem, byteLimit;
+    unsigned char *cp;
+
+    if (nBits == 0) {
+        return playGoto(p, endState);
+    }
+    if (!playGoto(p, shiftState)) {
+        return 0;
+    }
+    byteLimit = tdo ? p->usb->bulkOutRequestSize - 8 : PLAY_BYTES_LIMIT;
+    if (byteLimit > PLAY_BYTES_LIMIT) byteLimit = PLAY_BYTES_LIMIT;
+    while ((nData - bit) >= 8) {
+        int n = (nData - bit) / 8;
+        if (n > byteLimit) n = byteLimit;
+        if ((cp = playReserve(p, 3 + n)) == NULL) return 0;
+        *cp++ = tdo ? FTDI_MPSSE_XFER_TDI_BYTES : FTDI_MPSSE_WRITE_TDI_BYTES;
+        *cp++ = (n - 1);
+        *cp++ = (n - 1) >> 8;
+        memcpy(cp, tdi + bit / 8, n);
+        if (tdo) {
+            p->rxWanted += n;
+            if (!playFlush(p)) return 0;
+            memcpy(tdo + bit / 8, p->rx, n);
+        }
+        bit += n * 8;
+    }
+    nRem = nData - bit;
+    /* Reserve room for both commands so a reply can't be split */
+    if ((cp = playReserve(p, 6)) == NULL) return 0;
+    if (nRem) {
+        *cp++ = tdo ? FTDI_MPSSE_XFER_TDI_BITS : FTDI_MPSSE_WRITE_TDI_BITS;
+        *cp++ = nRem - 1;
+        *cp++ = tdi[bit / 8];
+        if (tdo) p->rxWanted++;
+    }
+    if (!stay) {
+        *cp++ = tdo ? FTDI_MPSSE_XFER_TMS_BITS : FTDI_MPSSE_WRITE_TMS_BITS;
+        *cp++ = 0;
+        *cp++ = (getBit(tdi, nData) << 7) | 0x3;
+        if (tdo) p->rxWanted++;
+        p->state = tapNext[shiftState][1];
+    }
+    p->cmdCount = cp - p->cmd;
+    if (tdo && p->rxWanted) {
+        if (!playFlush(p)) return 0;
+        if (nRem) {
+            tdo[bit / 8] = p->rx[0] >> (8 - nRem);
+        }
+        if (!stay) {
+            putBit(tdo, nData, p->rx[nRem != 0] >> 7);
+        }
+    }
+    p->bitCount += nBits;
+    return stay ? 1 : playGoto(p, endState);
+}
+
+/*
+ * Compare captured TDO with the expected value under a mask
+ */
+static int
+playMatch(const unsigned char *tdo, const unsigned char *expect,
+                                    const unsigned char *mask, uint32_t nBits)
+{
+    uint32_t i, nBytes = nBits / 8;
+
+    for (i = 0 ; i < nBytes ; i++) {
+        if ((tdo[i] ^ expect[i]) & (mask ? mask[i] : 0xFF)) return 0;
+    }
+    if (nBits % 8) {
+        int m = ((1 << (nBits % 8)) - 1) & (mask ? mask[nBytes] : 0xFF);
+        if ((tdo[nBytes] ^ expect[nBytes]) & m) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Grow a bit vector to hold nBits, with the new space cleared
+ */
+static unsigned char *
+playVector(unsigned char **vecp, uint32_t nBits)
+{
+    size_t n = ((size_t)nBits + 7) / 8 + 1;
+    unsigned char *vec = realloc(*vecp, n);
+
+    if (vec == NULL) {
+        fprintf(stderr, "Can't allocate %lu byte vector.\n", (unsigned long)n);
+        exit(1);
+    }
+    memset(vec, 0, n);
+    *vecp = vec;
+    return vec;
+}
+
+/*
+ * Serial Vector Format
+ */
+typedef struct svfScan {
+    uint32_t               nBits;
+    int                    check;
+    unsigned char         *tdi;
+    unsigned char         *tdo;
+    unsigned char         *mask;
+} svfScan;
+
+enum svfScans { SVF_HIR, SVF_HDR, SVF_TIR, SVF_TDR, SVF_SIR, SVF_SDR,
+                SVF_SCAN_COUNT };
+
+typedef struct svfPlayer {
+    player                *p;
+    const char            *text;
+    const char            *end;
+    char                  *stmt;
+    size_t                 stmtCapacity;
+    svfScan                scans[SVF_SCAN_COUNT];
+    unsigned char         *tdi;
+    unsigned char         *tdo;
+    unsigned char         *expect;
+    unsigned char         *mask;
+} svfPlayer;
+
+static void
+svfStore(svfPlayer *svf, size_t n, int c)
+{
+    if (n >= svf->stmtCapacity) {
+        svf->stmtCapacity = svf->stmtCapacity ? svf->stmtCapacity * 2 : 4096;
+        svf->stmt = realloc(svf->stmt, svf->stmtCapacity);
+        if (svf->stmt == NULL) {
+            fprintf(stderr, "Can't allocate SVF statement buffer.\n");
+            exit(1);
+        }
+    }
+    svf->stmt[n] = c;
+}
+
+/*
+ * Gather the next statement without its comments or terminating
+ * semicolon.  White space is collapsed to single blanks outside
+ * parentheses and dropped inside them.  Return 0 at end of file.
+ */
+static int
+svfStatement(svfPlayer *svf)
+{
+    size_t n = 0;
+    int paren = 0, blank = 0;
+
+    while (svf->text < svf->end) {
+        int c = (unsigned char)*svf->text++;
+        if ((c == '!')
+         || ((c == '/') && (svf->text < svf->end) && (*svf->text == '/'))) {
+            while ((svf->text < svf->end) && (*svf->text != '\n')) svf->text++;
+            continue;
+        }
+        if (c == '\n') svf->p->line++;
+        if (isspace(c)) {
+            blank = (n != 0) && !paren;
+            continue;
+        }
+        if (c == ';') {
+            svfStore(svf, n, '\0');
+            return 1;
+        }
+        if (c == '(') {
+            paren = 1;
+            blank = (n != 0);
+        }
+        if (blank) {
+            svfStore(svf, n++, ' ');
+            blank = 0;
+        }
+        svfStore(svf, n++, toupper(c));
+        if (c == ')') {
+            paren = 0;
+            blank = 1;
+        }
+    }
+    if (n) {
+        fprintf(stderr, "%s:%d: Unterminated statement.\n", svf->p->path,
+                                                                svf->p->line);
+    }
+    return 0;
+}
+
+static char *
+svfWord(char **cpp)
+{
+    char *word = *cpp, *cp = word;
+
+    if (*cp == '\0') return NULL;
+    while (*cp && (*cp != ' ')) cp++;
+    if (*cp) *cp++ = '\0';
+    *cpp = cp;
+    return word;
+}
+
+static int
+svfState(const char *name)
+{
+    int s;
+
+    if (name) {
+        for (s = 0 ; s < TAP_STATE_COUNT ; s++) {
+            if (strcmp(name, tapStateNames[s]) == 0) return s;
+        }
+    }
+    return -1;
+}
+
+static int
+svfStable(const char *name)
+{
+    int s = svfState(name);
+
+    if ((s == TAP_RESET) || (s == TAP_IDLE)
+     || (s == TAP_PAUSE_DR) || (s == TAP_PAUSE_IR)) {
+        return s;
+    }
+    return -1;
+}
+
+/*
+ * Convert a parenthesized hexadecimal string to a bit vector.
+ * The rightmost digit holds the first bits to be shifted.
+ */
+static int
+svfHex(const char *word, uint32_t nBits, unsigned char **vecp)
+{
+    size_t len = word ? strlen(word) : 0;
+    unsigned char *vec;
+    uint32_t bit = 0;
+    const char *cp;
+
+    if ((len < 2) || (word[0] != '(') || (word[len-1] != ')')) {
+        return 0;
+    }
+    vec = playVector(vecp, nBits);
+    for (cp = word + len - 2 ; cp > word ; cp--, bit += 4) {
+        int v;
+        if (!isxdigit((unsigned char)*cp)) return 0;
+        v = isdigit((unsigned char)*cp) ? *cp - '0' : *cp - 'A' + 10;
+        if (bit < nBits) {
+            vec[bit / 8] |= v << (bit % 8);
+        }
+    }
+    if (nBits % 8) vec[nBits / 8] &= (1 << (nBits % 8)) - 1;
+    return 1;
+}
+
+/*
+ * SIR, SDR and their header and trailer.  TDI and MASK persist until
+ * the length changes.  TDO is checked only when this statement gives
+ * it, or for a header or trailer, while one has been given.
+ */
+static int
+svfScanParams(svfPlayer *svf, int index, char *args)
+{
+    svfScan *scan = &svf->scans[index];
+    char *word = svfWord(&args), *endp;
+    unsigned long nBits;
+    int haveTDI = 0, haveMask = 0;
+
+    nBits = word ? strtoul(word, &endp, 10) : 0;
+    if ((word == NULL) || (*endp != '\0') || (nBits > (INT_MAX - 64))) {
+        return 0;
+    }
+    scan->check = 0;
+    while ((word = svfWord(&args)) != NULL) {
+        char *value = svfWord(&args);
+        if (strcmp(word, "TDI") == 0) {
+            if (!svfHex(value, nBits, &scan->tdi)) return 0;
+            haveTDI = 1;
+        }
+        else if (strcmp(word, "TDO") == 0) {
+            if (!svfHex(value, nBits, &scan->tdo)) return 0;
+            scan->check = 1;
+        }
+        else if (strcmp(word, "MASK") == 0) {
+            if (!svfHex(value, nBits, &scan->mask)) return 0;
+            haveMask = 1;
+        }
+        else if (strcmp(word, "SMASK") == 0) {
+            unsigned char *smask = NULL;
+            int ok = svfHex(value, nBits, &smask);
+            free(smask);
+            if (!ok) return 0;
+        }
+        else {
+            return 0;
+        }
+    }
+    if (nBits != scan->nBits) {
+        if (!haveTDI) {
+            if (nBits) return 0;
+            playVector(&scan->tdi, nBits);
+        }
+        if (!haveMask) {
+            memset(playVector(&scan->mask, nBits), 0xFF, (nBits + 7) / 8);
+        }
+        scan->nBits = nBits;
+    }
+    return 1;
+}
+
+static void
+svfAppend(unsigned char *dst, uint32_t at, const unsigned char *src,
+                                                                uint32_t nBits)
+{
+    uint32_t i;
+
+    if ((at % 8) == 0) {
+        memcpy(dst + at / 8, src, (nBits + 7) / 8);
+        return;
+    }
+    for (i = 0 ; i < nBits ; i++) {
+        putBit(dst, at + i, getBit(src, i));
+    }
+}
+
+/*
+ * Shift the header first, then the data, then the trailer
+ */
+static int
+svfShift(svfPlayer *svf, int isIR)
+{
+    player *p = svf->p;
+    svfScan *parts[3];
+    uint32_t nBits = 0, at = 0;
+    int check = 0, i;
+
+    parts[0] = &svf->scans[isIR ? SVF_HIR : SVF_HDR];
+    parts[1] = &svf->scans[isIR ? SVF_SIR : SVF_SDR];
+    parts[2] = &svf->scans[isIR ? SVF_TIR : SVF_TDR];
+    for (i = 0 ; i < 3 ; i++) {
+        nBits += parts[i]->nBits;
+        check |= parts[i]->check;
+    }
+    playVector(&svf->tdi, nBits);
+    if (check) {
+        playVector(&svf->tdo, nBits);
+        playVector(&svf->expect, nBits);
+        playVector(&svf->mask, nBits);
+    }
+    for (i = 0 ; i < 3 ; i++) {
+        svfScan *scan = parts[i];
+        if (scan->nBits == 0) continue;
+        svfAppend(svf->tdi, at, scan->tdi, scan->nBits);
+        if (scan->check) {
+            svfAppend(svf->expect, at, scan->tdo, scan->nBits);
+            svfAppend(svf->mask, at, scan->mask, scan->nBits);
+        }
+        at += scan->nBits;
+    }
+    if (!playScan(p, isIR ? TAP_SHIFT_IR : TAP_SHIFT_DR, svf->tdi,
+                     check ? svf->tdo : NULL, nBits, isIR ? p->endIR : p->endDR)) {
+        return 0;
+    }
+    if (check && !playMatch(svf->tdo, svf->expect, svf->mask, nBits)) {
+        fprintf(stderr, "%s:%d: TDO mismatch.\n", p->path, p->line);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * RUNTEST [run_state] [run_count TCK|SCK] [min_time SEC
+ *                          [MAXIMUM max_time SEC]] [ENDSTATE end_state]
+ */
+static int
+svfRunTest(svfPlayer *svf, char *args)
+{
+    player *p = svf->p;
+    char *word = svfWord(&args), *endp;
+    double count = 0, seconds = 0;
+    int tck = 0;
+
+    if (svfStable(word) >= 0) {
+        p->runState = p->runEnd = svfStable(word);
+        word = svfWord(&args);
+    }
+    while (word && (isdigit((unsigned char)*word) || (*word == '.'))) {
+        double v = strtod(word, &endp);
+        char *unit = svfWord(&args);
+        if ((*endp != '\0') || (unit == NULL)) return 0;
+        if (strcmp(unit, "TCK") == 0) {
+            count = v;
+            tck = 1;
+        }
+        else if (strcmp(unit, "SCK") == 0) {
+            count = v;
+        }
+        else if (strcmp(unit, "SEC") == 0) {
+            seconds = v;
+        }
+        else {
+            return 0;
+        }
+        word = svfWord(&args);
+    }
+    if (word && (strcmp(word, "MAXIMUM") == 0)) {
+        if (!svfWord(&args) || !svfWord(&args)) return 0;
+        word = svfWord(&args);
+    }
+    if (word && (strcmp(word, "ENDSTATE") == 0)) {
+        if ((p->runEnd = svfStable(svfWord(&args))) < 0) return 0;
+        word = svfWord(&args);
+    }
+    if (word) {
+        return 0;
+    }
+    if (!playGoto(p, p->runState)
+     || (tck && !playClocks(p, (uint64_t)count))
+     || ((seconds > 0) && !playWait(p, seconds))) {
+        return 0;
+    }
+    return playGoto(p, p->runEnd);
+}
+
+static int
+svfExecute(svfPlayer *svf, char *stmt)
+{
+    static const char *scanNames[SVF_SCAN_COUNT] = {
+        "HIR", "HDR", "TIR", "TDR", "SIR", "SDR"
+    };
+    player *p = svf->p;
+    char *command = svfWord(&stmt), *word;
+    int i;
+
+    if (command == NULL) {
+        return 1;
+    }
+    for (i = 0 ; i < SVF_SCAN_COUNT ; i++) {
+        if (strcmp(command, scanNames[i]) == 0) {
+            if (!svfScanParams(svf, i, stmt)) break;
+            if (i == SVF_SIR) return svfShift(svf, 1);
+            if (i == SVF_SDR) return svfShift(svf, 0);
+            return 1;
+        }
+    }
+    if (i < SVF_SCAN_COUNT) {
+        fprintf(stderr, "%s:%d: Bad %s statement.\n", p->path, p->line,
+                                                                     command);
+        return 0;
+    }
+    if ((strcmp(command, "ENDIR") == 0) || (strcmp(command, "ENDDR") == 0)) {
+        int s = svfStable(svfWord(&stmt));
+        if (s >= 0) {
+            if (command[3] == 'I') p->endIR = s;
+            else                   p->endDR = s;
+            return 1;
+        }
+    }
+    else if (strcmp(command, "STATE") == 0) {
+        while ((word = svfWord(&stmt)) != NULL) {
+            int s = svfState(word);
+            if ((s < 0) || !playGoto(p, s)) break;
+        }
+        if (word == NULL) return 1;
+    }
+    else if (strcmp(command, "RUNTEST") == 0) {
+        if (svfRunTest(svf, stmt)) return 1;
+    }
+    else if (strcmp(command, "FREQUENCY") == 0) {
+        double f = 10e6;
+        if ((word = svfWord(&stmt)) != NULL) f = strtod(word, NULL);
+        if ((f >= 1) && playFlush(p)
+         && ftdiSetClockSpeed(p->usb, f > 30e6 ? 30000000 : (unsigned int)f)) {
+            return 1;
+        }
+    }
+    else if (strcmp(command, "TRST") == 0) {
+        /* No TRST pin, so only accept requests that need none */
+        word = svfWord(&stmt);
+        if (word && (strcmp(word, "ON") != 0)) return 1;
+    }
+    else {
+        fprintf(stderr, "%s:%d: Unsupported statement %s.\n", p->path,
+                                                             p->line, command);
+        return 0;
+    }
+    fprintf(stderr, "%s:%d: Bad %s statement.\n", p->path, p->line, command);
+    return 0;
+}
+
+static int
+playSVF(player *p, const unsigned char *buf, size_t n)
+{
+    svfPlayer svf;
+    int ok = 1, i;
+
+    memset(&svf, 0, sizeof svf);
+    svf.p = p;
+    svf.text = (const char *)buf;
+    svf.end = svf.text + n;
+    p->line = 1;
+    while (ok && svfStatement(&svf)) {
+        ok = svfExecute(&svf, svf.stmt);
+    }
+    if (ok && (svf.text < svf.end)) {
+        ok = 0;
+    }
+    for (i = 0 ; i < SVF_SCAN_COUNT ; i++) {
+        free(svf.scans[i].tdi);
+        free(svf.scans[i].tdo);
+        free(svf.scans[i].mask);
+    }
+    free(svf.tdi);
+    free(svf.tdo);
+    free(svf.expect);
+    free(svf.mask);
+    free(svf.stmt);
+    return ok;
+}
+
+/*
+ * Xilinx compact binary form of SVF (XAPP503)
+ */
+enum xsvfCommands {
+    XCOMPLETE, XTDOMASK, XSIR, XSDR, XRUNTEST, XREPEAT = 7, XSDRSIZE,
+    XSDRTDO, XSETSDRMASKS, XSDRINC, XSDRB, XSDRC, XSDRE, XSDRTDOB,
+    XSDRTDOC, XSDRTDOE, XSTATE, XENDIR, XENDDR, XSIR2, XCOMMENT, XWAIT
+};
+
+typedef struct xsvfPlayer {
+    player                *p;
+    const unsigned char   *cp;
+    const unsigned char   *end;
+    size_t                 offset;
+    uint32_t               sdrSize;
+    uint32_t               runTest;
+    int                    repeat;
+    unsigned char         *tdi;
+    unsigned char         *tdo;
+    unsigned char         *expect;
+    unsigned char         *mask;
+} xsvfPlayer;
+
+static int
+xsvfTruncated(xsvfPlayer *x)
+{
+    fprintf(stderr, "%s: Command at offset %ld is truncated.\n", x->p->path,
+                                                              (long)x->offset);
+    return 0;
+}
+
+static int
+xsvfInt(xsvfPlayer *x, int nBytes, uint32_t *value)
+{
+    uint32_t v = 0;
+
+    if ((x->end - x->cp) < nBytes) return xsvfTruncated(x);
+    while (nBytes--) v = (v << 8) | *x->cp++;
+    *value = v;
+    return 1;
+}
+
+/*
+ * Vectors are stored most significant byte first
+ */
+static int
+xsvfVector(xsvfPlayer *x, uint32_t nBits, unsigned char **vecp)
+{
+    uint32_t nBytes = (nBits + 7) / 8, i;
+    unsigned char *vec;
+
+    if ((uint32_t)(x->end - x->cp) < nBytes) return xsvfTruncated(x);
+    vec = playVector(vecp, nBits);
+    for (i = 0 ; i < nBytes ; i++) {
+        vec[i] = x->cp[nBytes - 1 - i];
+    }
+    x->cp += nBytes;
+    return 1;
+}
+
+/*
+ * Shift a data register, retrying a failed TDO check XREPEAT times
+ * after waiting again in Run-Test/Idle
+ */
+static int
+xsvfShiftDR(xsvfPlayer *x, int check)
+{
+    player *p = x->p;
+    int endState = x->runTest ? TAP_IDLE : p->endDR;
+    int attempt;
+
+    for (attempt = 0 ; ; attempt++) {
+        if (!playScan(p, TAP_SHIFT_DR, x->tdi, check ? x->tdo : NULL,
+                                                        x->sdrSize, endState)
+         || (x->runTest && !playWait(p, x->runTest * 1e-6))) {
+            return 0;
+        }
+        if (!check || playMatch(x->tdo, x->expect, x->mask, x->sdrSize)) {
+            break;
+        }
+        if (attempt >= x->repeat) {
+            fprintf(stderr, "%s: TDO mismatch at offset %ld.\n", p->path,
+                                                         (long)x->offset);
+            return 0;
+        }
+        if (!playGoto(p, TAP_IDLE) || !playWait(p, x->runTest * 1e-6)) {
+            return 0;
+        }
+    }
+    return x->runTest ? playGoto(p, p->endDR) : 1;
+}
+
+static int
+xsvfExecute(xsvfPlayer *x, int command)
+{
+    player *p = x->p;
+    uint32_t v, w;
+
+    switch (command) {
+    case XTDOMASK:
+        return xsvfVector(x, x->sdrSize, &x->mask);
+
+    case XSIR:
+    case XSIR2:
+        if (!xsvfInt(x, command == XSIR ? 1 : 2, &v)
+         || !xsvfVector(x, v, &x->tdi)
+         || !playScan(p, TAP_SHIFT_IR, x->tdi, NULL, v,
+                                        x->runTest ? TAP_IDLE : p->endIR)) {
+            return 0;
+        }
+        if (x->runTest) {
+            return playWait(p, x->runTest * 1e-6) && playGoto(p, p->endIR);
+        }
+        return 1;
+
+    case XSDR:
+        return xsvfVector(x, x->sdrSize, &x->tdi) && xsvfShiftDR(x, 1);
+
+    case XSDRTDO:
+        return xsvfVector(x, x->sdrSize, &x->tdi)
+            && xsvfVector(x, x->sdrSize, &x->expect)
+            && xsvfShiftDR(x, 1);
+
+    case XRUNTEST:
+        return xsvfInt(x, 4, &x->runTest);
+
+    case XREPEAT:
+        if (!xsvfInt(x, 1, &v)) return 0;
+        x->repeat = v;
+        return 1;
+
+    case XSDRSIZE:
+        if (!xsvfInt(x, 4, &v)) return 0;
+        if (v > (INT_MAX - 64)) break;
+        if (v != x->sdrSize) {
+            memset(playVector(&x->mask, v), 0xFF, (v + 7) / 8);
+        }
+        x->sdrSize = v;
+        playVector(&x->expect, v);
+        playVector(&x->tdo, v);
+        return 1;
+
+    case XSDRB:
+    case XSDRC:
+    case XSDRE:
+    case XSDRTDOB:
+    case XSDRTDOC:
+    case XSDRTDOE:
+        w = (command >= XSDRTDOB);
+        if (!xsvfVector(x, x->sdrSize, &x->tdi)
+         || (w && !xsvfVector(x, x->sdrSize, &x->expect))
+         || !playScan(p, TAP_SHIFT_DR, x->tdi, w ? x->tdo : NULL, x->sdrSize,
+                 ((command == XSDRE) || (command == XSDRTDOE)) ? p->endDR
+                                                               : TAP_SHIFT_DR)) {
+            return 0;
+        }
+        if (w && !playMatch(x->tdo, x->expect, x->mask, x->sdrSize)) {
+            fprintf(stderr, "%s: TDO mismatch at offset %ld.\n", p->path,
+                                                         (long)x->offset);
+            return 0;
+        }
+        return 1;
+
+    case XSTATE:
+        if (!xsvfInt(x, 1, &v)) return 0;
+        if (v >= TAP_STATE_COUNT) break;
+        return playGoto(p, v);
+
+    case XENDIR:
+    case XENDDR:
+        if (!xsvfInt(x, 1, &v)) return 0;
+        if (v > 1) break;
+        if (command == XENDIR) p->endIR = v ? TAP_PAUSE_IR : TAP_IDLE;
+        else                   p->endDR = v ? TAP_PAUSE_DR : TAP_IDLE;
+        return 1;
+
+    case XCOMMENT:
+        while ((x->cp < x->end) && *x->cp++) continue;
+        return 1;
+
+    case XWAIT:
+        if (!xsvfInt(x, 1, &v) || !xsvfInt(x, 1, &w)) return 0;
+        if ((v >= TAP_STATE_COUNT) || (w >= TAP_STATE_COUNT)) break;
+        if (!playGoto(p, v) || !xsvfInt(x, 4, &v) || !playWait(p, v * 1e-6)) {
+            return 0;
+        }
+        return playGoto(p, w);
+
+    default:
+        fprintf(stderr, "%s: Unsupported command %d at offset %ld.\n", p->path,
+                                                     command, (long)x->offset);
+        return 0;
+    }
+    fprintf(stderr, "%s: Bad argument to command %d at offset %ld.\n", p->path,
+                                                     command, (long)x->offset);
+    return 0;
+}
+
+static int
+playXSVF(player *p, const unsigned char *buf, size_t n)
+{
+    xsvfPlayer x;
+    int ok = 1, command = XCOMPLETE;
+
+    memset(&x, 0, sizeof x);
+    x.p = p;
+    x.cp = buf;
+    x.end = buf + n;
+    p->endIR = p->endDR = TAP_IDLE;
+    while (ok && (x.cp < x.end)) {
+        x.offset = x.cp - buf;
+        if ((command = *x.cp++) == XCOMPLETE) break;
+        ok = xsvfExecute(&x, command);
+    }
+    if (ok && (command != XCOMPLETE)) {
+        fprintf(stderr, "%s: No XCOMPLETE.\n", p->path);
+        ok = 0;
+    }
+    free(x.tdi);
+    free(x.tdo);
+    free(x.expect);
+    free(x.mask);
+    return ok;
+}
+
+/*
+ * Load a .bit or .bin configuration image into a 7-series or
+ * UltraScale FPGA, the only device on the chain, as in the
+ * JTAG configuration flow of UG470.
+ */
+static int
+xilinxInstruction(player *p, int instruction, int *capture)
+{
+    unsigned char tdi = instruction, tdo = 0;
+
+    if (!playScan(p, TAP_SHIFT_IR, &tdi, capture ? &tdo : NULL,
+                                                 XILINX_IR_LENGTH, TAP_IDLE)) {
+        return 0;
+    }
+    if (capture) *capture = tdo;
+    return 1;
+}
+
+static int
+playBitstream(player *p, const unsigned char *buf, size_t n)
+{
+    static const unsigned char bitHeader[] = {
+        0x00, 0x09, 0x0F, 0xF0, 0x0F, 0xF0, 0x0F, 0xF0, 0x0F, 0xF0, 0x00,
+        0x00, 0x01
+    };
+    static const unsigned char sync[] = { 0xAA, 0x99, 0x55, 0x66 };
+    const unsigned char *cp = buf, *end = buf + n;
+    unsigned char *image;
+    int capture, tries;
+    size_t i;
+
+    if ((n > sizeof bitHeader) && !memcmp(buf, bitHeader, sizeof bitHeader)) {
+        cp += sizeof bitHeader;
+        while ((end - cp) >= 5) {
+            int key = *cp++;
+            size_t len;
+            if (key == 'e') {
+                len = ((size_t)cp[0] << 24) | (cp[1] << 16) | (cp[2] << 8)
+                                                                     | cp[3];
+                cp += 4;
+                if (len <= (size_t)(end - cp)) end = cp + len;
+                break;
+            }
+            len = (cp[0] << 8) | cp[1];
+            cp += 2;
+            if (len > (size_t)(end - cp)) break;
+            if (!p->usb->quietFlag && (key >= 'a') && (key <= 'd') && len) {
+                printf("%s: %c \"%.*s\"\n", p->path, key, (int)len - 1, cp);
+            }
+            cp += len;
+        }
+    }
+    for (i = 0 ; (i + sizeof sync) <= (size_t)(end - cp) ; i++) {
+        if (!memcmp(cp + i, sync, sizeof sync)) break;
+    }
+    if ((i + sizeof sync) > (size_t)(end - cp)) {
+        fprintf(stderr, "%s: No configuration sync word.\n", p->path);
+        return 0;
+    }
+    n = end - cp;
+    if ((n == 0) || (n > (INT_MAX / 8))) {
+        fprintf(stderr, "%s: Bad configuration image size.\n", p->path);
+        return 0;
+    }
+    if ((image = malloc(n)) == NULL) {
+        fprintf(stderr, "Can't allocate %lu byte image.\n", (unsigned long)n);
+        return 0;
+    }
+    /* Configuration logic takes each byte most significant bit first */
+    for (i = 0 ; i < n ; i++) {
+        unsigned int b = cp[i];
+        b = ((b & 0xF0) >> 4) | ((b & 0x0F) << 4);
+        b = ((b & 0xCC) >> 2) | ((b & 0x33) << 2);
+        image[i] = ((b & 0xAA) >> 1) | ((b & 0x55) << 1);
+    }
+    if (!playGoto(p, TAP_RESET)
+     || !playGoto(p, TAP_IDLE)
+     || !xilinxInstruction(p, XILINX_JPROGRAM, NULL)) {
+        free(image);
+        return 0;
+    }
+    for (tries = 0 ; ; tries++) {
+        struct timespec ts = { 0, 1000000 };
+        if (!xilinxInstruction(p, XILINX_BYPASS, &capture)) {
+            free(image);
+            return 0;
+        }
+        if (capture & XILINX_IR_INIT) break;
+        if (tries == 1000) {
+            fprintf(stderr, "%s: Device did not finish initializing.\n",
+                                                                      p->path);
+            free(image);
             return 0;
         }
+        nanosleep(&ts, NULL);
+    }
+    if (!playClocks(p, 10000)
+     || !xilinxInstruction(p, XILINX_CFG_IN, NULL)
+     || !playScan(p, TAP_SHIFT_DR, image, NULL, n * 8, TAP_IDLE)
+     || !xilinxInstruction(p, XILINX_JSTART, NULL)
+     || !playClocks(p, 2000)
+     || !playGoto(p, TAP_RESET)
+     || !playGoto(p, TAP_IDLE)
+     || !xilinxInstruction(p, XILINX_BYPASS, &capture)) {
+        free(image);
+        return 0;
+    }
+    free(image);
+    if (!(capture & XILINX_IR_DONE)) {
+        fprintf(stderr, "%s: DONE not asserted.\n", p->path);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Map the file and pick the player from its name
+ */
+static int
+playFile(usbInfo *usb, const char *path)
+{
+    static player workspace;
+    player *p = &workspace;
+    const char *suffix = strrchr(path, '.');
+    unsigned char *buf;
+    struct stat st;
+    uint64_t start;
+    int fd, ok;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "Can't stat %s: %s\n", path, strerror(errno));
+        close(fd);
+        return 0;
+    }
+    if (st.st_size == 0) {
+        fprintf(stderr, "%s: Empty file.\n", path);
+        close(fd);
+        return 0;
+    }
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        fprintf(stderr, "Can't map %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    p->usb = usb;
+    p->path = path;
+    p->state = TAP_RESET;
+    p->endIR = p->endDR = p->runState = p->runEnd = TAP_IDLE;
+    start = nanoseconds();
+    if (suffix && (strcasecmp(suffix, ".svf") == 0)) {
+        ok = playGoto(p, TAP_RESET) && playSVF(p, buf, st.st_size);
+    }
+    else if (suffix && (strcasecmp(suffix, ".xsvf") == 0)) {
+        ok = playGoto(p, TAP_RESET) && playXSVF(p, buf, st.st_size);
+    }
+    else if (suffix && ((strcasecmp(suffix, ".bit") == 0)
+                     || (strcasecmp(suffix, ".bin") == 0))) {
+        ok = playBitstream(p, buf, st.st_size);
+    }
+    else {
+        fprintf(stderr, "%s: Expect .svf, .xsvf, .bit or .bin file.\n", path);
+        ok = 0;
+    }
+    if (ok) {
+        /* Wait for everything queued to be clocked out */
+        unsigned char *cp = playReserve(p, 1);
+        if (cp) {
+            *cp = FTDI_READ_LOW_BYTE;
+            p->rxWanted++;
+        }
+        ok = cp && playFlush(p);
+    }
+    munmap(buf, st.st_size);
+    if (ok && !usb->quietFlag) {
+        double seconds = (nanoseconds() - start) / 1e9;
+        printf("%s: %" PRIu64 " bits in %.3f seconds (%.2f Mb/s)\n", path,
+                               p->bitCount, seconds, p->bitCount / seconds / 1e6);
+    }
+    return ok;
+}
+
+/************************************* Application ***************************/
+static void
+usage(char *name)
+{
+    fprintf(stderr, "Usage: %s [-a address] [-p port] [-b vectorBytes] "
+     "[-d vendor:product[:[serial]]] [-g direction_value[:direction_value...]] "
+     "[-c frequency] [-q] [-A tckCache] [-B] [-D serial] [-E chain] "
+     "[-F fleetConfig] "
+     "[-J timelineFile] [-K] [-L] [-M metricsPort] [-P address:priority] [-R] "
+     "[-S] [-T traceFile] [-U] [-V playFile] [-W milliseconds] [-X]\n",
+                                                                        name);
+    exit(2);
+}
+
+static int
+convertInt(const char *str)
+{
+    long v;
+    char *endp;
+    v = strtol(str, &endp, 0);
+    if ((endp == str) || (*endp != '\0')) {
+        fprintf(stderr, "Bad integer argument \"%s\"\n", str);
+        exit(2);
+    }
+    return v;
+}
+
+static void
+deviceConfig(usbInfo *usb, const char *str)
+{
+    unsigned long vendor, product;
+    char *endp;
+    vendor = strtol(str, &endp, 16);
+    if ((endp != str) && (*endp == ':')) {
+        str = endp + 1;
+        product = strtol(str, &endp, 16);
+        if ((endp != str)
+         && ((*endp == '\0') || (*endp == ':'))
+         && (vendor <= 0xFFFF)
+         && (product <= 0xFFFF)) {
+             if (*endp == ':') {
+                usb->serialNumber = endp + 1;
+            }
+            usb->vendorId = vendor;
+            usb->productId = product;
+            return;
+        }
+    }
+    fprintf(stderr, "Bad -d vendor:product[:[serial]]\n");
+    exit(2);
+}
+
+/*
+ * Another address on which to accept clients
+ */
+static void
+listenConfig(const char **table, int *count, const char *str)
+{
+    socketAddress addr;
+
+    if (*count == XVC_LISTEN_LIMIT) {
+        fprintf(stderr, "Too many -a addresses.\n");
+        exit(2);
+    }
+    if (!socketAddressParse(&addr, str, 0)) {
+        fprintf(stderr, "Bad -a address \"%s\"\n", str);
+        exit(2);
+    }
+    table[(*count)++] = str;
+}
+
+/*
+ * Serial number of a board to drive in step with the device
+ */
+static void
+mirrorConfig(const char **table, int *count, const char *str)
+{
+    if (*count == XVC_MIRROR_LIMIT) {
+        fprintf(stderr, "Too many -D boards.\n");
+        exit(2);
+    }
+    if (*str == '\0') {
+        fprintf(stderr, "Bad -D serial number.\n");
+        exit(2);
+    }
+    table[(*count)++] = str;
+}
+
+/*
+ * Clients from the given address get the given priority
+ */
+static void
+priorityConfig(usbInfo *usb, clientPriority *table, const char *str)
+{
+    char address[INET6_ADDRSTRLEN + 2];
+    const char *colon = strrchr(str, ':');
+    clientPriority *cp = &table[usb->nPriorities];
+
+    if ((colon != NULL)
+     && ((colon - str) < (int)sizeof address)
+     && (usb->nPriorities < XVC_PRIORITY_LIMIT)) {
+        socketAddress addr;
+        memcpy(address, str, colon - str);
+        address[colon - str] = '\0';
+        cp->family = AF_UNSPEC;
+        if (strcmp(address, "unix") == 0) {
+            cp->family = AF_UNIX;
+        }
+        else if (socketAddressParse(&addr, address, 0)) {
+            cp->family = addr.sa.sa_family;
+            cp->address = addr.in.sin_addr;
+            cp->address6 = addr.in6.sin6_addr;
+        }
+        if (cp->family != AF_UNSPEC) {
+            cp->priority = convertInt(colon + 1);
+            usb->nPriorities++;
+            return;
+        }
+    }
+    fprintf(stderr, "Bad -P address:priority\n");
+    exit(2);
+}
+
+static int
+clockSpeed(const char *str)
+{
+    double frequency;
+    char *endp;
+    frequency = strtod(str, &endp);
+    if ((endp == str)
+     || ((*endp != '\0') && (*endp != 'M') && (*endp != 'k'))
+     || ((*endp != '\0') && (*(endp+1) != '\0'))) {
+        fprintf(stderr, "Bad clock frequency argument.\n");
+        exit(2);
+    }
+    if (*endp == 'M') frequency *= 1000000;
+    if (*endp == 'k') frequency *= 1000;
+    if (frequency >= INT_MAX) frequency = INT_MAX;
+    if (frequency <= 0) frequency = 1;
+    divisorForFrequency(frequency);
+    return frequency;
+}
+
+/*
+ * Allocate a client connection with room for the largest shift
+ */
+static clientInfo *
+newClient(usbInfo *usb)
+{
+    clientInfo *client = calloc(1, sizeof *client);
+
+    if (client == NULL) {
+        fprintf(stderr, "Can't allocate client.\n");
+        return NULL;
+    }
+    client->usb = usb;
+    client->inCapacity = XVC_CMD_MAXLEN + usb->xvcBufsize + XVC_TDI_WINDOW;
+    client->inBuf = malloc(client->inCapacity + XVC_BUF_SLACK);
+    if (client->inBuf == NULL) {
+        fprintf(stderr, "Can't allocate %u byte input buffer.\n",
+                                                           client->inCapacity);
+        free(client);
+        return NULL;
+    }
+    return client;
+}
+
+/*
+ * Accept a client
+ */
+static void
+acceptClient(usbInfo *usb, int s)
+{
+    socketAddress farAddr;
+    socklen_t addrlen = sizeof farAddr;
+    clientInfo *client;
+    int c, i;
+
+    int fd = accept(s, &farAddr.sa, &addrlen);
+    if (fd < 0) {
+        if ((errno == EINTR) || (errno == EAGAIN) || (errno == EWOULDBLOCK)
+         || (errno == ECONNABORTED)) {
+            return;
+        }
+        if (!usb->acceptFailing) {
+            fprintf(stderr, "Can't accept connection: %s\n",
+                                                              strerror(errno));
+            usb->acceptFailing = 1;
+        }
+        usb->acceptResume = nanoseconds() +
+                                      (uint64_t)XVC_ACCEPT_BACKOFF * 1000000;
+        return;
+    }
+    usb->acceptFailing = 0;
+    if (usb->clientCount >= XVC_CLIENT_LIMIT) {
+        fprintf(stderr, "Rejecting client -- too many connections.\n");
+        close(fd);
+        return;
+    }
+    if ((client = newClient(usb)) == NULL) {
+        close(fd);
+        return;
+    }
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        fprintf(stderr, "Can't make socket non-blocking: %s\n",
+                                                              strerror(errno));
+        free(client->inBuf);
+        free(client);
+        close(fd);
+        return;
+    }
+
+    /*
+     * TDO is returned in pieces as a shift proceeds so
+     * don't let Nagle's algorithm hold back the final piece.
+     */
+    c = 1;
+    if ((farAddr.sa.sa_family != AF_UNIX)
+     && (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &c, sizeof c) < 0)) {
+        fprintf(stderr, "Can't set TCP_NODELAY: %s\n", strerror(errno));
+    }
+    client->fd = fd;
+    client->session = usb->sessionCount++;
+    for (i = 0 ; i < usb->nPriorities ; i++) {
+        const clientPriority *cp = &usb->priorities[i];
+        if ((cp->family == farAddr.sa.sa_family)
+         && ((cp->family == AF_UNIX)
+          || ((cp->family == AF_INET)
+           && (cp->address.s_addr == farAddr.in.sin_addr.s_addr))
+          || ((cp->family == AF_INET6)
+           && !memcmp(&cp->address6, &farAddr.in6.sin6_addr,
+                                                  sizeof cp->address6)))) {
+            client->priority = cp->priority;
+            break;
+        }
+    }
+    switch (farAddr.sa.sa_family) {
+    case AF_INET:
+        inet_ntop(AF_INET, &farAddr.in.sin_addr, client->name,
+                                                          sizeof client->name);
+        break;
+    case AF_INET6:
+        inet_ntop(AF_INET6, &farAddr.in6.sin6_addr, client->name,
+                                                          sizeof client->name);
+        break;
+    default:
+        strcpy(client->name, "unix");
+        break;
+    }
+    if (!usb->quietFlag) {
+        printf("Connect %s\n", client->name);
+    }
+    if (timeline) {
+        char track[sizeof client->name + 30];
+        sprintf(track, "session %d %s", client->session, client->name);
+        timelineName(usb, TIMELINE_SESSION + client->session, track);
+    }
+    usb->clients[usb->clientCount++] = client;
+}
+
+/*
+ * Disconnect a client
+ */
+static void
+dropClient(usbInfo *usb, int i)
+{
+    clientInfo *client = usb->clients[i];
+    int j;
+
+    deviceForget(usb, client);
+    close(client->fd);
+    if (!usb->quietFlag) {
+        printf("Disconnect %s\n", client->name);
+    }
+    if (usb->statisticsFlag) {
+        printf("   Shifts: %" PRIu64 "\n", client->shiftCount);
+        printf("   Chunks: %" PRIu64 "\n", client->chunkCount);
+        printf("     Bits: %" PRIu64 "\n", client->bitCount);
+        printf(" Largest shift request: %d\n", usb->largestShiftRequest);
+        printf(" Largest write request: %d\n", usb->largestWriteRequest);
+        printf("Largest write transfer: %d\n", usb->largestWriteSent);
+        printf("  Largest read request: %d\n", usb->largestReadRequest);
+        printf("          Runt replies: %" PRIu64 "\n", client->runtCount);
+        for (j = 0 ; j < usb->nMirrors ; j++) {
+            printf("%22s: %" PRIu64 " TDO mismatches\n",
+                   usb->mirrors[j]->serialNumber, usb->mirrors[j]->mismatchCount);
+        }
+    }
+    free(client->inBuf);
+    free(client);
+    usb->acceptResume = 0;
+    usb->clients[i] = usb->clients[--usb->clientCount];
+    if (usb->clientCount == 0) {
+        usb->sessionEnded = 1;
+    }
+}
+
+/*
+ * Disconnect clients that have gone away or broken the protocol.
+ * A client whose shift is under way is kept until its transfers
+ * have finished.  Close the device when the last client leaves
+ * unless it is to be kept open for the next session.
+ */
+static void
+reapClients(usbInfo *usb)
+{
+    int i = 0;
+
+    while (i < usb->clientCount) {
+        clientInfo *client = usb->clients[i];
+        if (client->opStarted) {
+            i++;
+            continue;
+        }
+        if (!client->dead && client->eof
+         && (client->deviceOp == XVC_OP_NONE) && (client->outCount == 0)) {
+            if (client->inPos != client->inCount) {
+                badEOF();
+            }
+            client->dead = 1;
+        }
+        if (client->dead) {
+            dropClient(usb, i);
+            continue;
+        }
+        i++;
+    }
+    if (usb->sessionEnded && (usb->clientCount == 0)
+     && (usb->owner == NULL) && (usb->readsInFlight == 0)
+     && !broadcastBusy(usb)) {
+        usb->sessionEnded = 0;
+        if (usb->keepOpen) {
+            usb->resyncNeeded = usbIsOpen(usb);
+        }
+        else {
+            usbClose(usb);
+        }
+        broadcastEnd(usb);
+    }
+}
+
+/*
+ * Close a device that has gone away once all its transfers are
+ * done and open one that has arrived
+ */
+static void
+checkDevice(usbInfo *usb)
+{
+    if (usb->deviceLost
+     && ((usb->owner == NULL) || !usb->owner->opStarted)
+     && usbAbandon(usb)) {
+        usbClose(usb);
+        if (usb->device != NULL) {
+            libusb_unref_device(usb->device);
+            usb->device = NULL;
+        }
+        usb->deviceLost = 0;
+        usb->resyncNeeded = 0;
+        usb->tapState = TAP_RESET;
+    }
+    if ((usb->arrived != NULL) && !usbIsOpen(usb)) {
+        libusb_device *dev = usb->arrived;
+        usb->arrived = NULL;
+        attachDevice(usb, dev);
+        libusb_unref_device(dev);
+    }
+}
+
+/*
+ * Serve the device and its clients from a single thread.
+ * Client sockets and the file descriptors libusb uses for
+ * its transfers are all waited on together.
+ */
+static void
+deviceLoop(usbInfo *usb, const int *listeners, int nListeners)
+{
+    struct pollfd pfds[XVC_LISTEN_LIMIT + XVC_CLIENT_LIMIT + USB_POLLFD_LIMIT];
+    static struct timeval zero;
+    int i;
+
+    for (i = 0 ; i < nListeners ; i++) {
+        if (fcntl(listeners[i], F_SETFL,
+                                fcntl(listeners[i], F_GETFL) | O_NONBLOCK) < 0) {
+            fprintf(stderr, "Can't make socket non-blocking: %s\n",
+                                                              strerror(errno));
+            exit(1);
+        }
+    }
+    if (usb->metricsFlag) {
+        metricsRegister(usb);
+    }
+    if (timeline) {
+        timelineTracks(usb);
+    }
+    for (;;) {
+        const struct libusb_pollfd **usbFds;
+        struct timeval tv;
+        int nfds, timeout = -1;
+        int n, ms;
+
+        checkDevice(usb);
+        serviceClients(usb);
+        reapClients(usb);
 
         /*
-         * Process received data
+         * Stop listening for a while after accept() fails, for example
+         * when out of file descriptors, rather than spin on a listener
+         * that stays readable.  Dropping a client ends the pause.
          */
-        rxIndex = 0;
-        for (int i = 0 ; i < rxBitcountIndex ; i++) {
-            int rxBitcount = rxBitcounts[i];
-            if (rxBitcount < 8) {
-                rxBit = 0x1 << (8 - rxBitcount);
+        if (usb->acceptResume) {
+            uint64_t now = nanoseconds();
+            if (now >= usb->acceptResume) {
+                usb->acceptResume = 0;
             }
             else {
-                rxBit = 0x01;
+                timeout = ((usb->acceptResume - now) / 1000000) + 1;
             }
-            while (rxBitcount--) {
-                if (tdoBit == 0x1) {
-                    usb->tdoBuf[tdoIndex] = 0;
-                }
-                if (usb->rxBuf[rxIndex] & rxBit) {
-                    usb->tdoBuf[tdoIndex] |= tdoBit;
-                }
-                if (rxBit == 0x80) {
-                    if (rxBitcount < 8) {
-                        rxBit = 0x1 << (8 - rxBitcount);
-                    }
-                    else {
-                        rxBit = 0x01;
-                    }
-                    rxIndex++;
-                }
-                else {
-                    rxBit <<= 1;
-                }
-                if (tdoBit == 0x80) {
-                    tdoBit = 0x01;
-                    tdoIndex++;
-                }
-                else {
-                    tdoBit <<= 1;
+        }
+        for (nfds = 0 ; nfds < nListeners ; nfds++) {
+            pfds[nfds].fd = listeners[nfds];
+            pfds[nfds].events = usb->acceptResume ? 0 : POLLIN;
+        }
+        for (i = 0 ; i < usb->clientCount ; i++) {
+            clientInfo *client = usb->clients[i];
+            pfds[nfds].fd = client->fd;
+            pfds[nfds].events = 0;
+            if (!client->eof
+             && ((client->inCount != client->inCapacity)
+              || ((client->deviceOp == XVC_OP_NONE) && client->inPos))) {
+                pfds[nfds].events |= POLLIN;
+            }
+            if (client->outCount) {
+                pfds[nfds].events |= POLLOUT;
+            }
+            nfds++;
+        }
+        usbFds = libusb_get_pollfds(usb->usb);
+        if (usbFds == NULL) {
+            if ((usb->readsInFlight || broadcastBusy(usb)
+              || (usb->chunksSubmitted != usb->chunksRetired))
+             && ((timeout < 0) || (timeout > 1))) {
+                timeout = 1;
+            }
+        }
+        else {
+            for (i = 0 ; usbFds[i] ; i++) {
+                if (i == USB_POLLFD_LIMIT) {
+                    fprintf(stderr, "Too many libusb file descriptors.\n");
+                    exit(1);
                 }
+                pfds[nfds].fd = usbFds[i]->fd;
+                pfds[nfds].events = usbFds[i]->events;
+                nfds++;
+            }
+#if USB_API_VERSION >= 0x01000104
+            libusb_free_pollfds(usbFds);
+#else
+            free(usbFds);
+#endif
+        }
+        if (usb->emulator && emuPending(usb->emulator)) {
+            timeout = 0;
+        }
+        else if (libusb_get_next_timeout(usb->usb, &tv) == 1) {
+            ms = (tv.tv_sec * 1000) + ((tv.tv_usec + 999) / 1000);
+            if ((timeout < 0) || (ms < timeout)) {
+                timeout = ms;
+            }
+        }
+        ms = metricsPublish(usb);
+        if ((ms >= 0) && ((timeout < 0) || (ms < timeout))) {
+            timeout = ms;
+        }
+        if (timeline) {
+            timelineFlush(timeout < 0);
+        }
+        n = poll(pfds, nfds, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        n = libusb_handle_events_timeout_completed(usb->usb, &zero, NULL);
+        if ((n != 0) && (n != LIBUSB_ERROR_INTERRUPTED)) {
+            /*
+             * Give up on this device but keep serving the others
+             */
+            fprintf(stderr, "libusb_handle_events failed: %s\n",
+                                                            libusb_strerror(n));
+            if (usbIsOpen(usb)) {
+                usb->deviceLost = 1;
+            }
+            for (i = 0 ; i < usb->clientCount ; i++) {
+                usb->clients[i]->dead = 1;
+            }
+        }
+        if (usb->emulator) {
+            emuHandleEvents(usb->emulator);
+        }
+        for (i = 0 ; i < usb->clientCount ; i++) {
+            clientInfo *client = usb->clients[i];
+            if (pfds[nListeners + i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                clientReceive(client);
+            }
+            if (pfds[nListeners + i].revents & POLLOUT) {
+                clientFlush(client);
+            }
+        }
+        for (i = 0 ; i < nListeners ; i++) {
+            if (pfds[i].revents & POLLIN) {
+                acceptClient(usb, listeners[i]);
+            }
+        }
+    }
+}
+
+/************************************* FLEET ***************************/
+/*
+ * Registry of every JTAG-capable interface on the bus.
+ * Channel 1 is FTDI port A, channel 2 is port B.
+ */
+typedef struct ftdiInterface {
+    int                    busNumber;
+    int                    deviceAddress;
+    int                    productId;
+    int                    channel;
+    int                    inUse;
+    char                   serial[IDSTRING_CAPACITY];
+} ftdiInterface;
+
+typedef struct fleetWorker {
+    usbInfo               *usb;
+    const char * const    *bindAddresses;
+    int                    nBindAddresses;
+    int                    port;
+    pthread_t              thread;
+} fleetWorker;
+
+/*
+ * Scan the bus once, opening each matching device only long enough
+ * to read its serial number.  Only the first two channels of an
+ * FT4232H have an MPSSE.
+ */
+static int
+buildRegistry(usbInfo *usb, ftdiInterface **registryp)
+{
+    libusb_device **list;
+    ftdiInterface *registry = NULL;
+    int nRegistry = 0;
+    ssize_t n;
+    int i;
+
+    n = libusb_get_device_list(usb->usb, &list);
+    if (n < 0) {
+        fprintf(stderr, "libusb_get_device_list failed: %s", libusb_strerror((int)n));
+        exit(1);
+    }
+    for (i = 0 ; i < n ; i++) {
+        libusb_device *dev = list[i];
+        struct libusb_device_descriptor desc;
+        struct libusb_config_descriptor *config;
+        int nChannels, channel;
+
+        if ((libusb_get_device_descriptor(dev, &desc) != 0)
+         || (desc.bDeviceClass != LIBUSB_CLASS_PER_INTERFACE)
+         || (desc.idVendor != usb->vendorId)
+         || !productMatches(usb, desc.idProduct)) {
+            continue;
+        }
+        if ((libusb_get_active_config_descriptor(dev, &config) < 0)
+         && (libusb_get_config_descriptor(dev, 0, &config) < 0)) {
+            continue;
+        }
+        if (config == NULL) {
+            continue;
+        }
+        nChannels = (desc.idProduct == 0x6014) ? 1 : 2;
+        if (nChannels > config->bNumInterfaces) {
+            nChannels = config->bNumInterfaces;
+        }
+        libusb_free_config_descriptor(config);
+        if (libusb_open(dev, &usb->handle) != 0) {
+            continue;
+        }
+        getDeviceStrings(usb, &desc);
+        libusb_close(usb->handle);
+        usb->handle = NULL;
+        registry = realloc(registry, (nRegistry + nChannels) * sizeof *registry);
+        if (registry == NULL) {
+            fprintf(stderr, "Can't allocate device registry.\n");
+            exit(1);
+        }
+        for (channel = 1 ; channel <= nChannels ; channel++) {
+            ftdiInterface *fi = &registry[nRegistry++];
+            fi->busNumber = libusb_get_bus_number(dev);
+            fi->deviceAddress = libusb_get_device_address(dev);
+            fi->productId = desc.idProduct;
+            fi->channel = channel;
+            fi->inUse = 0;
+            strcpy(fi->serial, usb->deviceSerialString);
+            if (!usb->quietFlag) {
+                printf("%3d: %04X:%04X bus %d address %d port %c serial \"%s\"\n",
+                                nRegistry - 1, desc.idVendor, desc.idProduct,
+                                fi->busNumber, fi->deviceAddress,
+                                'A' + channel - 1, fi->serial);
+            }
+        }
+    }
+    libusb_free_device_list(list, 1);
+    *registryp = registry;
+    return nRegistry;
+}
+
+static void *
+fleetThread(void *arg)
+{
+    fleetWorker *worker = arg;
+    usbInfo *usb = worker->usb;
+    int listeners[XVC_LISTEN_LIMIT];
+    int s;
+
+    s = libusb_init(&usb->usb);
+    if (s != 0) {
+        fprintf(stderr, "libusb_init() failed: %s\n", libusb_strerror(s));
+        return NULL;
+    }
+    usbAsyncInit(usb);
+    usbHotplugInit(usb);
+    if (!connectUSB(usb)) {
+        fprintf(stderr, "Can't open \"%s\" port %c.\n", usb->serialNumber,
+                                                  'A' + usb->ftdiJTAGindex - 1);
+        if (!usb->hotplug) {
+            return NULL;
+        }
+    }
+    if ((s = createListeners(worker->bindAddresses, worker->nBindAddresses,
+                                                worker->port, listeners)) == 0) {
+        return NULL;
+    }
+    deviceLoop(usb, listeners, s);
+    return NULL;
+}
+
+/*
+ * Serve the devices listed in the configuration file, each from
+ * its own thread with its own libusb context so that traffic to
+ * one device never waits on another.
+ * Each line has a serial number, a TCP port number and,
+ * optionally, the FTDI port (A or B).  '#' starts a comment.
+ */
+static void
+runFleet(usbInfo *usbTemplate, const char *path,
+                        const char * const *bindAddresses, int nBindAddresses)
+{
+    FILE *fp;
+    char line[200];
+    int lineNumber = 0;
+    ftdiInterface *registry;
+    int nRegistry;
+    fleetWorker *workers = NULL;
+    int nWorkers = 0;
+    int i;
+
+    for (i = 0 ; i < nBindAddresses ; i++) {
+        if ((strncmp(bindAddresses[i], "unix:", 5) == 0)
+         && (strstr(bindAddresses[i], "%d") == NULL)) {
+            fprintf(stderr, "Fleet socket path \"%s\" needs a %%d for the "
+                                               "port.\n", bindAddresses[i] + 5);
+            exit(2);
+        }
+    }
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    if ((i = libusb_init(&usbTemplate->usb)) != 0) {
+        fprintf(stderr, "libusb_init() failed: %s\n", libusb_strerror(i));
+        exit(1);
+    }
+    nRegistry = buildRegistry(usbTemplate, &registry);
+    while (fgets(line, sizeof line, fp) != NULL) {
+        char serial[IDSTRING_CAPACITY], channelName[4], *cp;
+        int port, channel = 1, n;
+        ftdiInterface *fi = NULL;
+        fleetWorker *worker;
+
+        lineNumber++;
+        if ((cp = strchr(line, '#')) != NULL) {
+            *cp = '\0';
+        }
+        n = sscanf(line, "%99s %d %3s", serial, &port, channelName);
+        if (n <= 0) {
+            continue;
+        }
+        if (n == 3) {
+            channel = ((channelName[0] == 'B') || (channelName[0] == 'b')) ? 2 :
+                      ((channelName[0] == 'A') || (channelName[0] == 'a')) ? 1 : 0;
+        }
+        if ((n < 2) || (channel == 0) || (port <= 0) || (port > 0xFFFF)) {
+            fprintf(stderr, "%s:%d: Expected \"serial port [A|B]\".\n", path,
+                                                                    lineNumber);
+            exit(2);
+        }
+        for (i = 0 ; i < nRegistry ; i++) {
+            if ((strcmp(registry[i].serial, serial) == 0)
+             && (registry[i].channel == channel)) {
+                fi = &registry[i];
+                break;
             }
         }
-        if (rxIndex != rxBytesWanted) {
-            printf("Warning -- consumed %d but supplied %d\n", rxIndex,
-                                                                 rxBytesWanted);
+        if (fi == NULL) {
+            fprintf(stderr, "%s:%d: No device \"%s\" port %c.\n", path,
+                                          lineNumber, serial, 'A' + channel - 1);
+            continue;
+        }
+        if (fi->inUse) {
+            fprintf(stderr, "%s:%d: Device \"%s\" port %c already assigned.\n",
+                                    path, lineNumber, serial, 'A' + channel - 1);
+            continue;
+        }
+        fi->inUse = 1;
+        workers = realloc(workers, (nWorkers + 1) * sizeof *workers);
+        if (workers == NULL) {
+            fprintf(stderr, "Can't allocate worker.\n");
+            exit(1);
+        }
+        worker = &workers[nWorkers];
+        worker->usb = malloc(sizeof *worker->usb);
+        if (worker->usb == NULL) {
+            fprintf(stderr, "Can't allocate worker.\n");
+            exit(1);
+        }
+        *worker->usb = *usbTemplate;
+        worker->usb->usb = NULL;
+        worker->usb->schedule = NULL;
+        worker->usb->productId = fi->productId;
+        worker->usb->serialNumber = fi->serial;
+        worker->usb->ftdiJTAGindex = fi->channel;
+        worker->usb->busNumber = fi->busNumber;
+        worker->usb->deviceAddress = fi->deviceAddress;
+        worker->bindAddresses = bindAddresses;
+        worker->nBindAddresses = nBindAddresses;
+        worker->usb->listenPort = port;
+        worker->port = port;
+        nWorkers++;
+    }
+    fclose(fp);
+    if (nWorkers == 0) {
+        fprintf(stderr, "No devices to serve.\n");
+        exit(1);
+    }
+    for (i = 0 ; i < nWorkers ; i++) {
+        int s = pthread_create(&workers[i].thread, NULL, fleetThread,
+                                                                   &workers[i]);
+        if (s != 0) {
+            fprintf(stderr, "Can't create thread: %s\n", strerror(s));
+            exit(1);
         }
     }
-    return 1;
+    for (i = 0 ; i < nWorkers ; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    exit(1);
 }
 
+/************************************* LOOPBACK SWEEP ***************************/
 /*
- * Shift a client packet set of bits
+ * Throughput benchmark that needs nothing but the FTDI adapter.
+ * The MPSSE is put into loopback, so TDO is TDI, and generated shifts
+ * are run through the same encoding, transfers and decoding as client
+ * shifts for each combination of TCK rate, shift size and density of
+ * TMS transitions.  Every returned bit is checked.  TMS still reaches
+ * the JTAG connector so no target should be attached.
  */
-static int
-shift(usbInfo *usb, FILE *fp)
+#define SWEEP_MIN_SHIFTS    3
+
+static const unsigned int sweepFrequencies[] = {
+    30000000, 15000000, 6000000, 1000000
+};
+static const uint32_t sweepSizes[] = { 32, 1024, 32768, 1048576 };
+static const char *sweepPatterns[] = { "none", "sparse", "dense" };
+
+typedef struct sweepResult {
+    uint64_t               shifts;
+    uint64_t               bits;
+    uint64_t               errors;
+    uint64_t               latencySum;
+    uint64_t               latencyMax;
+} sweepResult;
+
+static void
+sweepRandom(unsigned char *buf, uint32_t n, uint32_t *state)
 {
-    uint32_t nBits, nBytes;
+    uint32_t x = *state;
 
-    if (!fetch32(fp, &nBits)) {
-        return 0;
-    }
-    if (nBits > (unsigned int)usb->largestShiftRequest) {
-        usb->largestShiftRequest = nBits;
-    }
-    usb->bitCount += nBits;
-    usb->shiftCount++;
-    nBytes = (nBits + 7) / 8;
-    if (usb->showXVC) {
-        printf("shift:%d\n", (int)nBits);
-    }
-    if (nBytes > XVC_BUFSIZE) {
-        fprintf(stderr, "Client requested %u, max is %u\n", nBytes,XVC_BUFSIZE);
-        exit(1);
-    }
-    if ((fread(usb->tmsBuf, 1, nBytes, fp) != nBytes)
-     || (fread(usb->tdiBuf, 1, nBytes, fp) != nBytes)) {
-        return 0;
-    }
-    if (usb->showXVC) {
-        showBuf("TMS", usb->tmsBuf, nBytes);
-        showBuf("TDI", usb->tdiBuf, nBytes);
-    }
-    if (!shiftChunks(usb, nBits)) {
-        return 0;
-    }
-    if (usb->showXVC) {
-        showBuf("TDO", usb->tdoBuf, nBytes);
-    }
-    if (usb->loopback) {
-        if (memcmp(usb->tdiBuf, usb->tdoBuf, nBytes)) {
-            printf("Loopback failed.\n");
-        }
+    while (n--) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        *buf++ = x;
     }
-    return nBytes;
+    *state = x;
 }
 
 /*
- * Fetch a known string
+ * TMS that never changes, changes every 256 bits, or is random
  */
-static int
-matchInput(FILE *fp, const char *str)
+static void
+sweepTMS(unsigned char *tms, uint32_t nBytes, int pattern, uint32_t *state)
 {
-    while (*str) {
-        int c = fgetc(fp);
-        if (c == EOF) {
-            badEOF();
-            return 0;
-        }
-        if (c != *str) {
-            fprintf(stderr, "Expected 0x%2x, got 0x%2x\n", *str, c);
-            return 0;
-        }
-        str++;
-    }
-    return 1;
-}
+    uint32_t i;
 
-static int
-reply(int fd, const unsigned char *buf, int len)
-{
-    if (write(fd, buf, len) != len) {
-        fprintf(stderr, "reply failed: %s\n", strerror(errno));
-        return 0;
+    switch (pattern) {
+    case 0:
+        memset(tms, 0, nBytes);
+        break;
+    case 1:
+        for (i = 0 ; i < nBytes ; i++) {
+            tms[i] = (i & 0x20) ? 0xFF : 0x00;
+        }
+        break;
+    default:
+        sweepRandom(tms, nBytes, state);
+        break;
     }
-    return 1;
 }
 
 /*
- * Return a 32 bit value
+ * Wait for the device
  */
-static int
-reply32(int fd, uint32_t value)
+static void
+sweepWait(usbInfo *usb)
 {
-    int i;
-    unsigned char cbuf[4];
+    struct timeval tv = { 1, 0 };
 
-    for (i = 0 ; i < 4 ; i++) {
-        cbuf[i] = value;
-        value >>= 8;
+    if (usb->emulator) {
+        emuHandleEvents(usb->emulator);
+        return;
     }
-    return reply(fd, cbuf, 4);
+    libusb_handle_events_timeout_completed(usb->usb, &tv, NULL);
 }
 
 /*
- * Read and process commands
+ * Run one shift and check the TDO that comes back.
+ * TDI is supplied as the input window makes room for it,
+ * just as it would be by a client.
  */
-static void
-processCommands(FILE *fp, int fd, usbInfo *usb)
+static int
+sweepShift(usbInfo *usb, clientInfo *client, const unsigned char *tms,
+           const unsigned char *tdi, uint32_t nBits, sweepResult *result)
 {
-    int c;
-
-    for (;;) {
-        switch(c = fgetc(fp)) {
-        case 's':
-            switch(c = fgetc(fp)) {
-            case 'e':
-                {
-                uint32_t num;
-                int frequency;
-                if (!matchInput(fp, "ttck:")) return;
-                if (!fetch32(fp, &num)) return;
-                frequency = 1000000000 / num;
-                if (usb->showXVC) {
-                    printf("settck:%d  (%d Hz)\n", (int)num, frequency);
-                }
-                if (!ftdiSetClockSpeed(usb, frequency)) return;
-                if (!reply32(fd, num)) return;
-                }
-                break;
-
-            case 'h':
-                {
-                int nBytes;
-                if (!matchInput(fp, "ift:")) return;
-                nBytes = shift(usb, fp);
-                if ((nBytes <= 0) || !reply(fd, usb->tdoBuf, nBytes)) {
-                    return;
-                }
-                }
-                break;
-
-            default:
-                if (usb->showXVC) {
-                    printf("Bad second char 0x%02x\n", c);
-                }
-                badChar();
-                return;
-            }
-            break;
+    uint32_t nBytes = (nBits + 7) / 8;
+    uint32_t tdoPos = 0;
+    uint64_t start, latency;
 
-        case 'g':
-            if (matchInput(fp, "etinfo:")) {
-                char cBuf[40];
-                int len;;
-                if (usb->showXVC) {
-                    printf("getinfo:\n");
-                }
-                len = sprintf(cBuf, "xvcServer_v1.0:%u\n", XVC_BUFSIZE);
-                if (reply(fd, (unsigned char *)cBuf, len)) {
-                    break;
-                }
+    while (usb->draining) {
+        sweepWait(usb);
+    }
+    memcpy(client->inBuf, tms, nBytes);
+    client->inPos = 0;
+    client->inCount = nBytes;
+    client->tdiBase = 0;
+    client->batchCount = 0;
+    start = nanoseconds();
+    batchShift(client, nBits);
+    client->deviceOp = XVC_OP_SHIFT;
+    deviceRequest(usb, client);
+    deviceGrant(usb);
+    while (client->deviceOp != XVC_OP_NONE) {
+        uint32_t fed = client->tdiBase + client->inCount - nBytes;
+        uint32_t n = nBytes - fed;
+        int i;
+        if (n > (client->inCapacity - client->inCount)) {
+            n = client->inCapacity - client->inCount;
+        }
+        memcpy(client->inBuf + client->inCount, tdi + fed, n);
+        client->inCount += n;
+        if (!runDeviceOp(usb, client)) {
+            sweepWait(usb);
+        }
+        for (i = 0 ; i < client->outCount ; i++, tdoPos++) {
+            int diff = client->outBuf[i] ^ tdi[tdoPos];
+            if ((tdoPos == (nBytes - 1)) && (nBits % 8)) {
+                diff &= (1 << (nBits % 8)) - 1;
             }
-            return;
-
-        case EOF:
-            return;
-
-        default:
-            if (usb->showXVC) {
-                printf("Bad initial char 0x%02x\n", c);
+            for ( ; diff ; diff &= diff - 1) {
+                result->errors++;
             }
-            badChar();
-            return;
         }
+        client->outCount = 0;
+    }
+    latency = nanoseconds() - start;
+    result->shifts++;
+    result->bits += nBits;
+    result->latencySum += latency;
+    if (latency > result->latencyMax) {
+        result->latencyMax = latency;
     }
+    return !client->dead;
 }
 
+/*
+ * Run each configuration for at least the given number of
+ * milliseconds and print its throughput, the bits carried by
+ * and host time spent encoding and decoding each USB transfer,
+ * and the shift latency
+ */
 static int
-createSocket(const char *interface, int port)
+loopbackSweep(usbInfo *usb, int milliseconds)
 {
-    int s, o;
-    struct sockaddr_in myAddr;
+    static unsigned char loopbackOn[] = { FTDI_ENABLE_LOOPBACK };
+    static unsigned char loopbackOff[] = { FTDI_DISABLE_LOOPBACK };
+    int nFrequencies = sizeof sweepFrequencies / sizeof sweepFrequencies[0];
+    int nSizes = sizeof sweepSizes / sizeof sweepSizes[0];
+    int nPatterns = sizeof sweepPatterns / sizeof sweepPatterns[0];
+    uint32_t maxBytes = (sweepSizes[nSizes - 1] + 7) / 8;
+    unsigned char *tms, *tdi;
+    clientInfo *client;
+    uint64_t errors = 0;
+    uint32_t state = 0x2545F491;
+    int f, s, p;
 
-    s = socket (AF_INET, SOCK_STREAM, 0);
-    if (s < 0) {
-        return -1;
-    }
-    o = 1;
-    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &o, sizeof o) < 0) {
-        return -1;
+    if ((client = newClient(usb)) == NULL) {
+        return 0;
     }
-    memset (&myAddr, '\0', sizeof myAddr);
-    myAddr.sin_family = AF_INET;
-    if (inet_pton(AF_INET, interface, &myAddr.sin_addr) != 1) {
-        fprintf(stderr, "Bad address \"%s\"\n", interface);
-        return -1;
+    if (maxBytes > usb->xvcBufsize) {
+        maxBytes = usb->xvcBufsize;
     }
-    myAddr.sin_port = htons(port);
-    if (bind (s, (struct sockaddr *)&myAddr, sizeof myAddr) < 0) {
-        fprintf(stderr, "Bind() failed: %s\n", strerror (errno));
-        return -1;
+    tms = malloc(maxBytes);
+    tdi = malloc(maxBytes);
+    if ((tms == NULL) || (tdi == NULL)) {
+        fprintf(stderr, "Can't allocate sweep vectors.\n");
+        return 0;
     }
-    if (listen (s, 1) < 0) {
-        fprintf(stderr, "Listen() failed: %s\n", strerror (errno));
-        return -1;
+    if (usb->lockedSpeed) {
+        nFrequencies = 1;
     }
-    return s;
-}
-
-/************************************* Application ***************************/
-static int
-connectUSB(usbInfo *usb)
-{
-   libusb_device **list;
-    ssize_t n;
-    int s;
-
-    n = libusb_get_device_list(usb->usb, &list);
-    if (n < 0) {
-        fprintf(stderr, "libusb_get_device_list failed: %s", libusb_strerror((int)n));
+    if (!usbWriteData(usb, loopbackOn, sizeof loopbackOn)) {
         return 0;
     }
-    s = findDevice(usb, list, n);
-    libusb_free_device_list(list, 1);
-    if (s) {
-        s = libusb_kernel_driver_active(usb->handle, usb->bInterfaceNumber);
-        if (s < 0) {
-            fprintf(stderr, "libusb_kernel_driver_active() failed: %s\n", libusb_strerror(s));
-        }
-        else if (s) {
-            s = libusb_detach_kernel_driver(usb->handle, usb->bInterfaceNumber);
-            if (s) {
-                fprintf(stderr, "libusb_detach_kernel_driver() failed: %s\n", libusb_strerror(s));
+    usb->metricsFlag = 1;
+    printf("  TCK (Hz)     Bits  TMS        Mbit/s  TCK use  Xfer bits"
+           "  Host (us)   Mean (us)    Max (us)     Errors\n");
+    for (f = 0 ; f < nFrequencies ; f++) {
+        client->frequency = sweepFrequencies[f];
+        for (s = 0 ; s < nSizes ; s++) {
+            uint32_t nBits = sweepSizes[s];
+            if (((nBits + 7) / 8) > maxBytes) {
+                continue;
+            }
+            for (p = 0 ; p < nPatterns ; p++) {
+                sweepResult result;
+                stageHistogram *enc = &usb->metrics.stages[STAGE_ENCODE];
+                stageHistogram *dec = &usb->metrics.stages[STAGE_DECODE];
+                uint64_t start, elapsed;
+                double rate;
+                memset(&result, 0, sizeof result);
+                memset(enc, 0, sizeof *enc);
+                memset(dec, 0, sizeof *dec);
+                sweepTMS(tms, (nBits + 7) / 8, p, &state);
+                sweepRandom(tdi, (nBits + 7) / 8, &state);
+                start = nanoseconds();
+                do {
+                    if (!sweepShift(usb, client, tms, tdi, nBits, &result)) {
+                        fprintf(stderr, "JTAG device unavailable.\n");
+                        return 0;
+                    }
+                    elapsed = nanoseconds() - start;
+                } while ((result.shifts < SWEEP_MIN_SHIFTS)
+                      || (elapsed < (uint64_t)milliseconds * 1000000));
+                rate = result.bits / (elapsed * 1e-9);
+                printf("%10u %8u  %-6s %10.3f %7.1f%% %10.0f %10.1f"
+                       " %11.1f %11.1f %10" PRIu64 "\n",
+                       usb->actualFrequency, nBits, sweepPatterns[p],
+                       rate / 1e6, 100 * rate / usb->actualFrequency,
+                       (double)result.bits / enc->count,
+                       (enc->sum + dec->sum) / enc->count / 1e3,
+                       result.latencySum / result.shifts / 1e3,
+                       result.latencyMax / 1e3, result.errors);
+                fflush(stdout);
+                errors += result.errors;
             }
-        }
-        s = libusb_claim_interface(usb->handle, usb->bInterfaceNumber);
-        if (s) {
-            libusb_close(usb->handle);
-            fprintf(stderr, "libusb_claim_interface failed: %s\n", libusb_strerror(s));
-            return 0;
-        }
-        if (usb->showUSB || !usb->quietFlag) {
-            printf(" Vendor (%04X): \"%s\"\n", usb->vendorId, usb->deviceVendorString);
-            printf("Product (%04X): \"%s\"\n", usb->productId, usb->deviceProductString);
-            printf("        Serial: \"%s\"\n", usb->deviceSerialString);
-            fflush(stdout);
         }
     }
-    else {
-        fprintf(stderr, "Can't find USB device.\n");
+    while (usb->draining) {
+        sweepWait(usb);
+    }
+    if (!usbWriteData(usb, loopbackOff, sizeof loopbackOff)) {
         return 0;
     }
-    if (!ftdiInit(usb)) {
+    if (errors) {
+        fprintf(stderr, "Loopback failed -- %" PRIu64 " bit%s in error.\n",
+                                                errors, errors == 1 ? "" : "s");
         return 0;
     }
     return 1;
 }
 
-static void
-usage(char *name)
-{
-    fprintf(stderr, "Usage: %s [-a address] [-p port] "
-     "[-d vendor:product[:[serial]]] [-g direction_value[:direction_value...]] "
-     "[-c frequency] [-q] [-B] [-L] [-R] [-S] [-U] [-X]\n", name);
-    exit(2);
-}
-
-static int
-convertInt(const char *str)
-{
-    long v;
-    char *endp;
-    v = strtol(str, &endp, 0);
-    if ((endp == str) || (*endp != '\0')) {
-        fprintf(stderr, "Bad integer argument \"%s\"\n", str);
-        exit(2);
-    }
-    return v;
-}
-
-static void
-deviceConfig(usbInfo *usb, const char *str)
-{
-    unsigned long vendor, product;
-    char *endp;
-    vendor = strtol(str, &endp, 16);
-    if ((endp != str) && (*endp == ':')) {
-        str = endp + 1;
-        product = strtol(str, &endp, 16);
-        if ((endp != str)
-         && ((*endp == '\0') || (*endp == ':'))
-         && (vendor <= 0xFFFF)
-         && (product <= 0xFFFF)) {
-             if (*endp == ':') {
-                usb->serialNumber = endp + 1;
-            }
-            usb->vendorId = vendor;
-            usb->productId = product;
-            return;
-        }
-    }
-    fprintf(stderr, "Bad -d vendor:product[:[serial]]\n");
-    exit(2);
-}
-
-static int
-clockSpeed(const char *str)
-{
-    double frequency;
-    char *endp;
-    frequency = strtod(str, &endp);
-    if ((endp == str)
-     || ((*endp != '\0') && (*endp != 'M') && (*endp != 'k'))
-     || ((*endp != '\0') && (*(endp+1) != '\0'))) {
-        fprintf(stderr, "Bad clock frequency argument.\n");
-        exit(2);
-    }
-    if (*endp == 'M') frequency *= 1000000;
-    if (*endp == 'k') frequency *= 1000;
-    if (frequency >= INT_MAX) frequency = INT_MAX;
-    if (frequency <= 0) frequency = 1;
-    divisorForFrequency(frequency);
-    return frequency;
-}
-
 int
 main(int argc, char **argv)
 {
-    int c;
-    const char *bindAddress = "127.0.0.1";
+    int c, i;
+    static const char *bindAddresses[XVC_LISTEN_LIMIT];
+    int nBindAddresses = 0;
+    static const char *boards[XVC_MIRROR_LIMIT];
+    int nBoards = 0;
+    const char *metricsAddress = "127.0.0.1";
+    int listeners[XVC_LISTEN_LIMIT];
     int port = 2542;
+    int metricsPort = 0;
     int s;
-    char farName[100];
     static usbInfo usbWorkspace = {
         .vendorId = 0x0403,
         .productId = -1,
-        .ftdiJTAGindex = 1
+        .ftdiJTAGindex = 1,
+        .xvcBufsize = XVC_BUFSIZE,
+        .tmsLevel = TMS_UNKNOWN,
+        .traceFd = -1
     };
     usbInfo *usb = &usbWorkspace;
+    const char *fleetConfig = NULL;
+    const char *traceFile = NULL;
+    const char *playPath = NULL;
+    int sweepTime = -1;
+    static clientPriority priorities[XVC_PRIORITY_LIMIT];
 
-    while ((c = getopt(argc, argv, "a:b:c:d:g:hp:qBLRSUX")) >= 0) {
+    usb->priorities = priorities;
+    while ((c = getopt(argc, argv, "a:b:c:d:g:hp:qA:BD:E:F:J:KLM:P:RST:UV:W:X")) >= 0) {
         switch(c) {
-        case 'a': bindAddress = optarg;                     break;
+        case 'a': listenConfig(bindAddresses, &nBindAddresses, optarg); break;
+        case 'b': usb->xvcBufsize = convertInt(optarg);     break;
         case 'c': usb->lockedSpeed = clockSpeed(optarg);    break;
         case 'd': deviceConfig(usb, optarg);                break;
         case 'g': usb->gpioArgument = optarg;               break;
@@ -1109,11 +6850,22 @@ main(int argc, char **argv)
         case 'q': usb->quietFlag = 1;                       break;
         case 'u': usb->showUSB = 1;                         break;
         case 'x': usb->showXVC = 1;                         break;
+        case 'A': tuneCacheLoad(optarg);                    break;
         case 'B': usb->ftdiJTAGindex = 2;                   break;
+        case 'D': mirrorConfig(boards, &nBoards, optarg);   break;
+        case 'E': usb->emulator = emuCreate(optarg);        break;
+        case 'F': fleetConfig = optarg;                     break;
+        case 'J': timelineOpen(optarg);                     break;
+        case 'K': usb->keepOpen = 1;                        break;
         case 'L': usb->loopback = 1;                        break;
+        case 'M': metricsPort = convertInt(optarg);         break;
+        case 'P': priorityConfig(usb, priorities, optarg);  break;
         case 'R': usb->runtFlag = 1;                        break;
         case 'S': usb->statisticsFlag = 1;                  break;
+        case 'T': traceFile = optarg;                       break;
         case 'U': usb->showUSB = 1;                         break;
+        case 'V': playPath = optarg;                        break;
+        case 'W': sweepTime = convertInt(optarg);           break;
         case 'X': usb->showXVC = 1;                         break;
         default:  usage(argv[0]);
         }
@@ -1122,60 +6874,101 @@ main(int argc, char **argv)
         fprintf(stderr, "Unexpected argument.\n");
         usage(argv[0]);
     }
-    s = libusb_init(&usb->usb);
-    if (!connectUSB(usb)) {
-        exit(1);
+    if ((usb->xvcBufsize < 4) || (usb->xvcBufsize > XVC_BUFSIZE_MAX)) {
+        fprintf(stderr, "Bad -b vector size.\n");
+        exit(2);
     }
-    if (s != 0) {
-        fprintf(stderr, "libusb_init() failed: %s\n", libusb_strerror(s));
-        return 0;
+    if (nBindAddresses == 0) {
+        bindAddresses[nBindAddresses++] = "127.0.0.1";
     }
-    if ((s = createSocket(bindAddress, port)) < 0) {
-        exit(1);
+    /* Metrics are served on the first network address */
+    for (i = nBindAddresses - 1 ; i >= 0 ; i--) {
+        if (strncmp(bindAddresses[i], "unix:", 5) != 0) {
+            metricsAddress = bindAddresses[i];
+        }
     }
-    for (;;) {
-        struct sockaddr_in farAddr;
-        socklen_t addrlen = sizeof farAddr;
-        FILE *fp;
-
-        int fd = accept(s, (struct sockaddr *)&farAddr, &addrlen);
-        if (fd < 0) {
-            fprintf(stderr, "Can't accept connection: %s\n", strerror (errno));
-            exit(1);
+    usb->listenPort = port;
+    if (fleetConfig && usb->emulator) {
+        fprintf(stderr, "Can't emulate a fleet.\n");
+        exit(2);
+    }
+    if (fleetConfig && traceFile) {
+        fprintf(stderr, "Can't trace a fleet.\n");
+        exit(2);
+    }
+    if (sweepTime >= 0) {
+        if ((sweepTime == 0) || fleetConfig || nBoards || playPath) {
+            fprintf(stderr, "-W needs a positive time and can't be combined "
+                            "with -D, -F or -V.\n");
+            exit(2);
         }
-        if ((usb->handle == NULL) && !connectUSB(usb)) {
+        if ((s = libusb_init(&usb->usb)) != 0) {
+            fprintf(stderr, "libusb_init() failed: %s\n", libusb_strerror(s));
             exit(1);
         }
-        usb->shiftCount = 0;
-        usb->chunkCount = 0;
-        usb->bitCount = 0;
-        if (!usb->quietFlag) {
-            inet_ntop(farAddr.sin_family, &(farAddr.sin_addr), farName, sizeof farName);
-            printf("Connect %s\n", farName);
+        usbAsyncInit(usb);
+        if (!connectUSB(usb)) {
+            exit(1);
         }
-        fp = fdopen(fd, "r");
-        if (fp == NULL) {
-            fprintf(stderr, "fdopen failed: %s\n", strerror(errno));
-            close(fd);
+        exit(loopbackSweep(usb, sweepTime) ? 0 : 1);
+    }
+    if (nBoards
+     && (fleetConfig || usb->emulator || timeline || playPath)) {
+        fprintf(stderr, "Can't broadcast with -E, -F, -J or -V.\n");
+        exit(2);
+    }
+    if (playPath) {
+        if (fleetConfig) {
+            fprintf(stderr, "Can't play a file to a fleet.\n");
             exit(2);
         }
-        else {
-            processCommands(fp, fd, usb);
-            fclose(fp);  /* Closes underlying socket, too */
+        if ((s = libusb_init(&usb->usb)) != 0) {
+            fprintf(stderr, "libusb_init() failed: %s\n", libusb_strerror(s));
+            exit(1);
         }
-        if (!usb->quietFlag) {
-            printf("Disconnect %s\n", farName);
+        usbAsyncInit(usb);
+        if (!connectUSB(usb)) {
+            exit(1);
+        }
+        exit(playFile(usb, playPath) ? 0 : 1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (metricsPort) {
+        usb->metricsFlag = 1;
+        metricsStart(metricsAddress, metricsPort);
+    }
+    if (fleetConfig) {
+        runFleet(usb, fleetConfig, bindAddresses, nBindAddresses);
+    }
+    s = libusb_init(&usb->usb);
+    broadcastInit(usb, boards, nBoards);
+    usbAsyncInit(usb);
+    if (!usb->emulator) {
+        usbHotplugInit(usb);
+    }
+    if (!connectUSB(usb)) {
+        if (!usb->hotplug) {
+            exit(1);
         }
-        if (usb->statisticsFlag) {
-            printf("   Shifts: %" PRIu64 "\n", usb->shiftCount);
-            printf("   Chunks: %" PRIu64 "\n", usb->chunkCount);
-            printf("     Bits: %" PRIu64 "\n", usb->bitCount);
-            printf(" Largest shift request: %d\n", usb->largestShiftRequest);
-            printf(" Largest write request: %d\n", usb->largestWriteRequest);
-            printf("Largest write transfer: %d\n", usb->largestWriteSent);
-            printf("  Largest read request: %d\n", usb->largestReadRequest);
+        fprintf(stderr, "Waiting for device.\n");
+    }
+    if (s != 0) {
+        fprintf(stderr, "libusb_init() failed: %s\n", libusb_strerror(s));
+        return 0;
+    }
+    for (i = 0 ; i < usb->nMirrors ; i++) {
+        if (!connectUSB(usb->mirrors[i])) {
+            fprintf(stderr, "Can't open -D board \"%s\".\n", boards[i]);
+            exit(1);
         }
-        libusb_close(usb->handle);
-        usb->handle = NULL;
     }
+    if ((s = createListeners(bindAddresses, nBindAddresses, port,
+                                                            listeners)) == 0) {
+        exit(1);
+    }
+    if (traceFile) {
+        traceOpen(usb, traceFile);
+    }
+    deviceLoop(usb, listeners, s);
+    return 0;
 }
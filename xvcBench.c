@@ -0,0 +1,913 @@
+/*
+ * XVC FTDI JTAG Copyright (c) 2021, The Regents of the University of
+ * California, through Lawrence Berkeley National Laboratory (subject to
+ * receipt of any required approvals from the U.S. Dept. of Energy). All
+ * rights reserved.
+ *
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Intellectual Property Office at
+ * IPO@lbl.gov.
+ *
+ * NOTICE.  This Software was developed under funding from the U.S. Department
+ * of Energy and the U.S. Government consequently retains certain rights.  As
+ * such, the U.S. Government has been granted for itself and others acting on
+ * its behalf a paid-up, nonexclusive, irrevocable, worldwide license in the
+ * Software to reproduce, distribute copies to the public, prepare derivative
+ * works, and perform publicly and display publicly, and to permit others to
+ * do so.
+ */
+
+/*
+ * Xilinx Virtual Cable load generator and latency benchmark
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define CONNECTION_LIMIT    64
+#define DEPTH_LIMIT         64
+#define HIST_SUB_BITS       5   /* Histogram buckets per power of two */
+#define HIST_BUCKETS        (64 << HIST_SUB_BITS)
+#define SCAN_OVERHEAD       5   /* Idle->Shift-DR and Exit1-DR->Idle */
+#define READOUT_BITS        32768
+#define TRACE_HEADER_SIZE   16
+#define TRACE_RECORD_SIZE   24
+#define TRACE_SETTCK        1
+#define TRACE_SHIFT         2
+
+enum workloads { WORK_BITSTREAM, WORK_NAVIGATE, WORK_READOUT };
+
+static const char *workloadNames[] = {
+    [WORK_BITSTREAM] = "bitstream",
+    [WORK_NAVIGATE]  = "navigate",
+    [WORK_READOUT]   = "readout"
+};
+
+/*
+ * Server address of any family
+ */
+typedef union socketAddress {
+    struct sockaddr        sa;
+    struct sockaddr_in     in;
+    struct sockaddr_in6    in6;
+    struct sockaddr_un     un;
+} socketAddress;
+
+/*
+ * Settings shared by every connection
+ */
+typedef struct benchConfig {
+    const char            *address;
+    int                    port;
+    int                    nConnections;
+    int                    workload;
+    int                    depth;
+    int                    bits;
+    double                 seconds;
+    uint64_t               shiftLimit;
+    unsigned int           seed;
+    const char            *tracePath;
+    int                    originalTiming;
+    uint64_t               traceBase;
+} benchConfig;
+
+/*
+ * One connection to the server
+ * Up to 'depth' shift commands are kept outstanding.  Each one's
+ * latency runs from when it is queued until its last TDO byte arrives.
+ */
+typedef struct benchConnection {
+    const benchConfig     *config;
+    pthread_t              thread;
+    int                    index;
+    int                    fd;
+    unsigned int           rng;
+    uint32_t               vecBits;
+    unsigned char         *randomBits;
+    unsigned char         *outBuf;
+    size_t                 outCapacity;
+    size_t                 outCount;
+    size_t                 outPos;
+    const unsigned char  **records;
+    int                    nRecords;
+    int                    nextRecord;
+    uint64_t               replayStart;
+    int                    inFlight;
+    int                    head;
+    uint32_t               replyBytes[DEPTH_LIMIT];
+    uint64_t               started[DEPTH_LIMIT];
+    const unsigned char   *expect[DEPTH_LIMIT];
+    uint32_t               expectBits[DEPTH_LIMIT];
+    uint32_t               received;
+    int                    mismatch;
+    uint64_t               mismatchCount;
+    unsigned char          discard[65536];
+    uint64_t               shiftCount;
+    uint64_t               bitCount;
+    uint64_t               finished;
+    uint64_t               histogram[HIST_BUCKETS];
+    int                    failed;
+} benchConnection;
+
+static volatile int stopFlag;
+
+/************************************* MISC ***************************/
+static uint64_t
+nanoseconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static unsigned int
+nextRandom(unsigned int *state)
+{
+    unsigned int x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void
+put32(unsigned char *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static uint32_t
+get32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t
+get64(const unsigned char *p)
+{
+    return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+static void
+setBit(unsigned char *buf, uint32_t bit)
+{
+    buf[bit >> 3] |= 1 << (bit & 0x7);
+}
+
+/************************************* HISTOGRAM ***************************/
+/*
+ * Log-linear buckets, accurate to about three percent
+ */
+static int
+histBucket(uint64_t v)
+{
+    int e = 0;
+
+    if (v < (2 << HIST_SUB_BITS)) {
+        return v;
+    }
+    while ((v >> e) >= (2 << HIST_SUB_BITS)) {
+        e++;
+    }
+    return (e << HIST_SUB_BITS) + (v >> e);
+}
+
+static uint64_t
+histValue(int bucket)
+{
+    int e = bucket >> HIST_SUB_BITS;
+
+    if (e <= 1) {
+        return bucket;
+    }
+    e--;
+    return (uint64_t)(bucket - (e << HIST_SUB_BITS)) << e;
+}
+
+static uint64_t
+histPercentile(const uint64_t *histogram, uint64_t count, double fraction)
+{
+    uint64_t want = (uint64_t)(fraction * count), seen = 0;
+    int i;
+
+    if (want >= count) want = count - 1;
+    for (i = 0 ; i < HIST_BUCKETS ; i++) {
+        seen += histogram[i];
+        if (seen > want) {
+            return histValue(i);
+        }
+    }
+    return 0;
+}
+
+/************************************* XVC ***************************/
+static int
+sendAll(int fd, const void *buf, size_t n)
+{
+    const char *cp = buf;
+
+    while (n) {
+        ssize_t c = send(fd, cp, n, 0);
+        if (c < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        cp += c;
+        n -= c;
+    }
+    return 1;
+}
+
+static int
+recvAll(int fd, void *buf, size_t n)
+{
+    char *cp = buf;
+
+    while (n) {
+        ssize_t c = recv(fd, cp, n, 0);
+        if (c <= 0) {
+            if ((c < 0) && (errno == EINTR)) continue;
+            return 0;
+        }
+        cp += c;
+        n -= c;
+    }
+    return 1;
+}
+
+/*
+ * Accept the same address forms as the server's -a option: IPv4, IPv6
+ * with or without brackets, or unix:path with any %d replaced by the port
+ */
+static socklen_t
+parseAddress(socketAddress *addr, const char *str, int port)
+{
+    char address[INET6_ADDRSTRLEN];
+    size_t len = strlen(str);
+
+    memset(addr, '\0', sizeof *addr);
+    if (strncmp(str, "unix:", 5) == 0) {
+        const char *path = str + 5, *cp = strstr(path, "%d");
+        int n;
+        if (cp == NULL) {
+            n = snprintf(addr->un.sun_path, sizeof addr->un.sun_path, "%s",
+                                                                        path);
+        }
+        else {
+            n = snprintf(addr->un.sun_path, sizeof addr->un.sun_path,
+                                "%.*s%d%s", (int)(cp - path), path, port, cp + 2);
+        }
+        if ((*path == '\0') || (n >= (int)sizeof addr->un.sun_path)) {
+            return 0;
+        }
+        addr->un.sun_family = AF_UNIX;
+        return sizeof addr->un;
+    }
+    if (inet_pton(AF_INET, str, &addr->in.sin_addr) == 1) {
+        addr->in.sin_family = AF_INET;
+        addr->in.sin_port = htons(port);
+        return sizeof addr->in;
+    }
+    if ((len > 2) && (str[0] == '[') && (str[len-1] == ']')) {
+        str++;
+        len -= 2;
+    }
+    if (len >= sizeof address) {
+        return 0;
+    }
+    memcpy(address, str, len);
+    address[len] = '\0';
+    if (inet_pton(AF_INET6, address, &addr->in6.sin6_addr) == 1) {
+        addr->in6.sin6_family = AF_INET6;
+        addr->in6.sin6_port = htons(port);
+        return sizeof addr->in6;
+    }
+    return 0;
+}
+
+/*
+ * Connect, find the vector size and, unless replaying a trace,
+ * move the TAP to Run-Test/Idle
+ */
+static int
+benchConnect(benchConnection *conn)
+{
+    const benchConfig *config = conn->config;
+    socketAddress addr;
+    socklen_t addrlen;
+    static const unsigned char toIdle[] = {
+        's', 'h', 'i', 'f', 't', ':', 6, 0, 0, 0, 0x1F, 0x00
+    };
+    char info[100];
+    unsigned char tdo;
+    int n = 0, o = 1;
+    char *colon;
+
+    if ((addrlen = parseAddress(&addr, config->address, config->port)) == 0) {
+        fprintf(stderr, "Bad address \"%s\"\n", config->address);
+        return 0;
+    }
+    conn->fd = socket(addr.sa.sa_family, SOCK_STREAM, 0);
+    if ((conn->fd < 0) || (connect(conn->fd, &addr.sa, addrlen) < 0)) {
+        fprintf(stderr, "Can't connect to %s:%d: %s\n", config->address,
+                                                config->port, strerror(errno));
+        return 0;
+    }
+    if (addr.sa.sa_family != AF_UNIX) {
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &o, sizeof o);
+    }
+    if (!sendAll(conn->fd, "getinfo:", 8)) {
+        return 0;
+    }
+    do {
+        if ((n == (int)sizeof info - 1) || !recvAll(conn->fd, info + n, 1)) {
+            fprintf(stderr, "Bad getinfo: reply.\n");
+            return 0;
+        }
+    } while (info[n++] != '\n');
+    info[n] = '\0';
+    if (((colon = strchr(info, ':')) == NULL)
+     || ((conn->vecBits = strtoul(colon + 1, NULL, 10) * 8) <
+                                                        SCAN_OVERHEAD + 1)) {
+        fprintf(stderr, "Bad getinfo: reply \"%s\".\n", info);
+        return 0;
+    }
+    if (!config->tracePath
+     && (!sendAll(conn->fd, toIdle, sizeof toIdle)
+      || !recvAll(conn->fd, &tdo, 1))) {
+        return 0;
+    }
+    o = fcntl(conn->fd, F_GETFL);
+    return fcntl(conn->fd, F_SETFL, o | O_NONBLOCK) == 0;
+}
+
+/*
+ * Make room at the end of the output buffer
+ */
+static unsigned char *
+outReserve(benchConnection *conn, size_t n)
+{
+    if ((conn->outCount + n) > conn->outCapacity) {
+        memmove(conn->outBuf, conn->outBuf + conn->outPos,
+                                                conn->outCount - conn->outPos);
+        conn->outCount -= conn->outPos;
+        conn->outPos = 0;
+    }
+    return conn->outBuf + conn->outCount;
+}
+
+/*
+ * Note a command now queued.  Replies to replayed
+ * commands are checked against those in the trace.
+ */
+static void
+expectReply(benchConnection *conn, uint32_t nBytes,
+                                      const unsigned char *expect, uint32_t nBits)
+{
+    int slot = (conn->head + conn->inFlight) % DEPTH_LIMIT;
+
+    conn->replyBytes[slot] = nBytes;
+    conn->expect[slot] = expect;
+    conn->expectBits[slot] = nBits;
+    conn->started[slot] = nanoseconds();
+    conn->inFlight++;
+}
+
+/*
+ * Append a shift command to the output buffer
+ * Data scans go from Run-Test/Idle to Shift-DR, shift, then return
+ * to Run-Test/Idle so that other clients can take their turn.
+ * Only the data register selected by Test-Logic-Reset is used so
+ * the workloads are safe to run against real hardware.
+ */
+static void
+queueShift(benchConnection *conn)
+{
+    const benchConfig *config = conn->config;
+    uint32_t nBits, nData = 0, nBytes;
+    int idleOnly = 0;
+    unsigned char *tms, *tdi, *cp;
+
+    switch (config->workload) {
+    case WORK_NAVIGATE:
+        if ((nextRandom(&conn->rng) % 10) < 3) {
+            idleOnly = 1;
+            nData = 1 + (nextRandom(&conn->rng) % 16);
+        }
+        else {
+            nData = 1 + (nextRandom(&conn->rng) % 32);
+        }
+        break;
+    case WORK_READOUT:
+        nData = config->bits ? config->bits : READOUT_BITS;
+        break;
+    default:
+        nData = config->bits ? (uint32_t)config->bits : conn->vecBits;
+        break;
+    }
+    nBits = idleOnly ? nData : nData + SCAN_OVERHEAD;
+    if (nBits > conn->vecBits) {
+        nBits = conn->vecBits;
+        nData = nBits - SCAN_OVERHEAD;
+    }
+    nBytes = (nBits + 7) / 8;
+    cp = outReserve(conn, 10 + (2 * nBytes));
+    memcpy(cp, "shift:", 6);
+    put32(cp + 6, nBits);
+    tms = cp + 10;
+    tdi = tms + nBytes;
+    memset(tms, 0, nBytes);
+    if (idleOnly) {
+        memset(tdi, 0, nBytes);
+    }
+    else {
+        setBit(tms, 0);
+        setBit(tms, nBits - 3);
+        setBit(tms, nBits - 2);
+        if (config->workload == WORK_READOUT) {
+            memset(tdi, 0, nBytes);
+        }
+        else {
+            uint32_t offset = nextRandom(&conn->rng) % (conn->vecBits / 8);
+            memcpy(tdi, conn->randomBits + offset, nBytes);
+        }
+    }
+    conn->outCount += 10 + (2 * nBytes);
+    expectReply(conn, nBytes, NULL, 0);
+    conn->bitCount += nBits;
+}
+
+/*
+ * Append the next command from the trace to the output buffer
+ */
+static int
+queueRecord(benchConnection *conn)
+{
+    const unsigned char *rp = conn->records[conn->nextRecord++];
+    uint32_t value = get32(rp + 16);
+    unsigned char *cp;
+
+    if ((rp[4] | (rp[5] << 8)) == TRACE_SETTCK) {
+        cp = outReserve(conn, 11);
+        memcpy(cp, "settck:", 7);
+        put32(cp + 7, value);
+        conn->outCount += 11;
+        expectReply(conn, 4, rp + 20, 32);
+    }
+    else {
+        uint32_t nBytes = (value + 7) / 8;
+        if (value > conn->vecBits) {
+            fprintf(stderr, "Connection %d: %u bit shift exceeds server "
+                            "vector size.\n", conn->index, value);
+            return 0;
+        }
+        if (nBytes == 0) {
+            return 1;
+        }
+        cp = outReserve(conn, 10 + (2 * nBytes));
+        memcpy(cp, "shift:", 6);
+        put32(cp + 6, value);
+        memcpy(cp + 10, rp + TRACE_RECORD_SIZE, 2 * nBytes);
+        conn->outCount += 10 + (2 * nBytes);
+        expectReply(conn, nBytes, rp + TRACE_RECORD_SIZE + (2 * nBytes), value);
+        conn->bitCount += value;
+    }
+    return 1;
+}
+
+/*
+ * Compare reply bytes with those recorded, ignoring
+ * the unused bits at the end of a TDO vector
+ */
+static void
+checkReply(benchConnection *conn, uint32_t n)
+{
+    const unsigned char *expect = conn->expect[conn->head] + conn->received;
+    uint32_t nBits = conn->expectBits[conn->head];
+    uint32_t i;
+
+    for (i = 0 ; i < n ; i++) {
+        int mask = 0xFF;
+        if (((conn->received + i) == (nBits - 1) / 8) && (nBits % 8)) {
+            mask = (1 << (nBits % 8)) - 1;
+        }
+        if ((conn->discard[i] ^ expect[i]) & mask) {
+            conn->mismatch = 1;
+        }
+    }
+}
+
+/*
+ * Take in TDO and note completed shifts
+ */
+static int
+receiveReplies(benchConnection *conn)
+{
+    for (;;) {
+        uint32_t want = conn->replyBytes[conn->head] - conn->received;
+        ssize_t n;
+        if (want > sizeof conn->discard) want = sizeof conn->discard;
+        n = recv(conn->fd, conn->discard, want, 0);
+        if (n < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return 1;
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Connection %d: %s\n", conn->index, strerror(errno));
+            return 0;
+        }
+        if (n == 0) {
+            fprintf(stderr, "Connection %d: server closed connection.\n",
+                                                                  conn->index);
+            return 0;
+        }
+        if (conn->expect[conn->head] != NULL) {
+            checkReply(conn, n);
+        }
+        conn->received += n;
+        if (conn->received == conn->replyBytes[conn->head]) {
+            uint64_t now = nanoseconds();
+            conn->histogram[histBucket(now - conn->started[conn->head])]++;
+            conn->shiftCount++;
+            if (conn->mismatch) {
+                conn->mismatch = 0;
+                conn->mismatchCount++;
+            }
+            conn->received = 0;
+            conn->head = (conn->head + 1) % DEPTH_LIMIT;
+            if (--conn->inFlight == 0) return 1;
+        }
+    }
+}
+
+static void *
+benchThread(void *arg)
+{
+    benchConnection *conn = arg;
+    const benchConfig *config = conn->config;
+    uint32_t i;
+
+    conn->rng = config->seed + conn->index * 7919;
+    if (conn->rng == 0) conn->rng = 1;
+    conn->outCapacity = (size_t)(config->depth + 1) *
+                                                 (10 + 2 * (conn->vecBits / 8));
+    conn->outBuf = malloc(conn->outCapacity);
+    if (conn->outBuf == NULL) {
+        fprintf(stderr, "Can't allocate buffers.\n");
+        exit(1);
+    }
+    if (!config->tracePath) {
+        conn->randomBits = malloc(2 * (conn->vecBits / 8));
+        if (conn->randomBits == NULL) {
+            fprintf(stderr, "Can't allocate buffers.\n");
+            exit(1);
+        }
+        for (i = 0 ; i < 2 * (conn->vecBits / 8) ; i++) {
+            conn->randomBits[i] = nextRandom(&conn->rng);
+        }
+    }
+    conn->replayStart = nanoseconds();
+    for (;;) {
+        struct pollfd pfd;
+        int timeout = -1;
+        if (config->tracePath) {
+            while (!stopFlag && (conn->nextRecord < conn->nRecords)
+                             && (conn->inFlight < config->depth)) {
+                if (config->originalTiming) {
+                    const unsigned char *rp = conn->records[conn->nextRecord];
+                    uint64_t due = conn->replayStart + get64(rp + 8)
+                                                           - config->traceBase;
+                    uint64_t now = nanoseconds();
+                    if (due > now) {
+                        timeout = (due - now + 999999) / 1000000;
+                        break;
+                    }
+                }
+                if (!queueRecord(conn)) {
+                    conn->failed = 1;
+                    break;
+                }
+            }
+            if (conn->failed) {
+                break;
+            }
+        }
+        else {
+            int more = !stopFlag && ((config->shiftLimit == 0)
+                 || ((conn->shiftCount + conn->inFlight) < config->shiftLimit));
+            while (more && (conn->inFlight < config->depth)) {
+                queueShift(conn);
+                more = (config->shiftLimit == 0)
+                 || ((conn->shiftCount + conn->inFlight) < config->shiftLimit);
+            }
+        }
+        if ((conn->inFlight == 0) && (timeout < 0)) {
+            break;
+        }
+        pfd.fd = conn->fd;
+        pfd.events = conn->inFlight ? POLLIN : 0;
+        if (conn->outPos != conn->outCount) {
+            pfd.events |= POLLOUT;
+        }
+        if (poll(&pfd, 1, timeout) < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (pfd.revents & POLLOUT) {
+            ssize_t n = send(conn->fd, conn->outBuf + conn->outPos,
+                                             conn->outCount - conn->outPos, 0);
+            if ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)
+                                                         && (errno != EINTR)) {
+                fprintf(stderr, "Connection %d: %s\n", conn->index,
+                                                              strerror(errno));
+                conn->failed = 1;
+                break;
+            }
+            if (n > 0) {
+                conn->outPos += n;
+                if (conn->outPos == conn->outCount) {
+                    conn->outPos = conn->outCount = 0;
+                }
+            }
+        }
+        if (conn->inFlight && (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+         && !receiveReplies(conn)) {
+            conn->failed = 1;
+            break;
+        }
+    }
+    conn->finished = nanoseconds();
+    close(conn->fd);
+    return NULL;
+}
+
+/************************************* TRACE ***************************/
+/*
+ * Map a trace captured by ftdiJTAG -T and hand each session's
+ * commands to a connection of its own
+ */
+static int
+loadTrace(benchConfig *config, benchConnection *conns)
+{
+    int sessions[CONNECTION_LIMIT];
+    const unsigned char *base, *rp, *end;
+    struct stat st;
+    int fd, nConnections = 0, i;
+
+    if (((fd = open(config->tracePath, O_RDONLY)) < 0)
+     || (fstat(fd, &st) < 0)) {
+        fprintf(stderr, "Can't open %s: %s\n", config->tracePath,
+                                                              strerror(errno));
+        exit(1);
+    }
+    if ((st.st_size < TRACE_HEADER_SIZE)
+     || ((base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+                                                                  MAP_FAILED)
+     || (memcmp(base, "XVCTRACE", 8) != 0)
+     || (get32(base + 8) != 1)) {
+        fprintf(stderr, "%s is not an XVC trace.\n", config->tracePath);
+        exit(1);
+    }
+    close(fd);
+    end = base + st.st_size;
+    config->traceBase = UINT64_MAX;
+    for (rp = base + get32(base + 12) ; (end - rp) >= TRACE_RECORD_SIZE ;
+                                                          rp += get32(rp)) {
+        uint32_t length = get32(rp);
+        int type = rp[4] | (rp[5] << 8);
+        int session = rp[6] | (rp[7] << 8);
+        benchConnection *conn;
+        if ((length < TRACE_RECORD_SIZE) || (length % 8)
+         || (length > (uint64_t)(end - rp))
+         || ((type == TRACE_SHIFT) && (length < TRACE_RECORD_SIZE +
+                                        (3 * ((get32(rp + 16) + 7) / 8))))) {
+            fprintf(stderr, "Trace truncated.\n");
+            break;
+        }
+        if ((type != TRACE_SETTCK) && (type != TRACE_SHIFT)) {
+            continue;
+        }
+        for (i = 0 ; i < nConnections ; i++) {
+            if (sessions[i] == session) break;
+        }
+        if (i == nConnections) {
+            if (nConnections == CONNECTION_LIMIT) {
+                fprintf(stderr, "Too many sessions in trace.\n");
+                exit(1);
+            }
+            sessions[nConnections++] = session;
+        }
+        conn = &conns[i];
+        if ((conn->nRecords % 1024) == 0) {
+            conn->records = realloc(conn->records,
+                                (conn->nRecords + 1024) * sizeof *conn->records);
+            if (conn->records == NULL) {
+                fprintf(stderr, "Can't allocate trace index.\n");
+                exit(1);
+            }
+        }
+        conn->records[conn->nRecords++] = rp;
+        if (get64(rp + 8) < config->traceBase) {
+            config->traceBase = get64(rp + 8);
+        }
+    }
+    if (nConnections == 0) {
+        fprintf(stderr, "Trace is empty.\n");
+        exit(1);
+    }
+    return nConnections;
+}
+
+/************************************* Application ***************************/
+static void
+usage(char *name)
+{
+    fprintf(stderr, "Usage: %s [-a address] [-p port] [-c connections] "
+     "[-w bitstream|navigate|readout] [-b bits] [-d depth] [-t seconds] "
+     "[-n shifts] [-r seed] [-T trace [-O]]\n", name);
+    exit(2);
+}
+
+static int
+convertInt(const char *str)
+{
+    long v;
+    char *endp;
+    v = strtol(str, &endp, 0);
+    if ((endp == str) || (*endp != '\0')) {
+        fprintf(stderr, "Bad integer argument \"%s\"\n", str);
+        exit(2);
+    }
+    return v;
+}
+
+static int
+workloadConfig(const char *str)
+{
+    int i;
+
+    for (i = 0 ; i < (int)(sizeof workloadNames / sizeof workloadNames[0]) ; i++) {
+        if (strcmp(str, workloadNames[i]) == 0) {
+            return i;
+        }
+    }
+    fprintf(stderr, "Bad -w workload \"%s\"\n", str);
+    exit(2);
+}
+
+static void
+showResults(const benchConfig *config, benchConnection *conns, uint64_t start)
+{
+    static uint64_t histogram[HIST_BUCKETS];
+    uint64_t shifts = 0, bits = 0, mismatches = 0, end = start;
+    double seconds;
+    int i, j;
+
+    for (i = 0 ; i < config->nConnections ; i++) {
+        shifts += conns[i].shiftCount;
+        bits += conns[i].bitCount;
+        mismatches += conns[i].mismatchCount;
+        if (conns[i].finished > end) end = conns[i].finished;
+        for (j = 0 ; j < HIST_BUCKETS ; j++) {
+            histogram[j] += conns[i].histogram[j];
+        }
+    }
+    seconds = (end - start) / 1e9;
+    printf("  Workload: %s, %d connection%s, depth %d\n",
+                        config->tracePath ? config->tracePath :
+                                              workloadNames[config->workload],
+                        config->nConnections,
+                        config->nConnections == 1 ? "" : "s", config->depth);
+    printf("    Shifts: %" PRIu64 " in %.3f seconds\n", shifts, seconds);
+    if (shifts == 0) {
+        return;
+    }
+    printf("Throughput: %.3f Mbit/s, %.1f shifts/s\n",
+                                    bits / seconds / 1e6, shifts / seconds);
+    printf("   Latency: p50 %.1f us, p99 %.1f us, p99.9 %.1f us\n",
+                        histPercentile(histogram, shifts, 0.50) / 1e3,
+                        histPercentile(histogram, shifts, 0.99) / 1e3,
+                        histPercentile(histogram, shifts, 0.999) / 1e3);
+    if (config->tracePath) {
+        printf("Mismatches: %" PRIu64 " replies differ from the trace\n",
+                                                                   mismatches);
+    }
+}
+
+static void
+handleSignal(int sig)
+{
+    (void)sig;
+    stopFlag = 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    int c, i, failed = 0;
+    static benchConfig config = {
+        .address = "127.0.0.1",
+        .port = 2542,
+        .nConnections = 1,
+        .workload = WORK_BITSTREAM,
+        .depth = 1,
+        .seconds = 10,
+        .seed = 1
+    };
+    static benchConnection conns[CONNECTION_LIMIT];
+    uint64_t start;
+
+    while ((c = getopt(argc, argv, "a:b:c:d:hn:p:r:t:w:OT:")) >= 0) {
+        switch(c) {
+        case 'a': config.address = optarg;                  break;
+        case 'b': config.bits = convertInt(optarg);         break;
+        case 'c': config.nConnections = convertInt(optarg); break;
+        case 'd': config.depth = convertInt(optarg);        break;
+        case 'h': usage(argv[0]);                           break;
+        case 'n': config.shiftLimit = convertInt(optarg);   break;
+        case 'p': config.port = convertInt(optarg);         break;
+        case 'r': config.seed = convertInt(optarg);         break;
+        case 't': config.seconds = strtod(optarg, NULL);    break;
+        case 'w': config.workload = workloadConfig(optarg); break;
+        case 'O': config.originalTiming = 1;                break;
+        case 'T': config.tracePath = optarg;                break;
+        default:  usage(argv[0]);
+        }
+    }
+    if (optind != argc) {
+        fprintf(stderr, "Unexpected argument.\n");
+        usage(argv[0]);
+    }
+    if ((config.nConnections < 1) || (config.nConnections > CONNECTION_LIMIT)) {
+        fprintf(stderr, "Bad -c connection count.\n");
+        exit(2);
+    }
+    if ((config.depth < 1) || (config.depth > DEPTH_LIMIT)) {
+        fprintf(stderr, "Bad -d depth.\n");
+        exit(2);
+    }
+    if (config.bits < 0) {
+        fprintf(stderr, "Bad -b bit count.\n");
+        exit(2);
+    }
+    if (config.originalTiming && !config.tracePath) {
+        fprintf(stderr, "-O applies only to trace replay.\n");
+        exit(2);
+    }
+    if (config.tracePath) {
+        config.nConnections = loadTrace(&config, conns);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handleSignal);
+    for (i = 0 ; i < config.nConnections ; i++) {
+        conns[i].config = &config;
+        conns[i].index = i;
+        if (!benchConnect(&conns[i])) {
+            exit(1);
+        }
+    }
+    start = nanoseconds();
+    for (i = 0 ; i < config.nConnections ; i++) {
+        if (pthread_create(&conns[i].thread, NULL, benchThread, &conns[i])) {
+            fprintf(stderr, "Can't create thread.\n");
+            exit(1);
+        }
+    }
+    if (!config.tracePath && (config.shiftLimit == 0)) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)config.seconds;
+        ts.tv_nsec = (long)((config.seconds - ts.tv_sec) * 1e9);
+        while ((nanosleep(&ts, &ts) < 0) && (errno == EINTR) && !stopFlag) {
+            continue;
+        }
+        stopFlag = 1;
+    }
+    for (i = 0 ; i < config.nConnections ; i++) {
+        pthread_join(conns[i].thread, NULL);
+        failed |= conns[i].failed;
+    }
+    showResults(&config, conns, start);
+    return failed;
+}